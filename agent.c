@@ -21,14 +21,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <glib.h>
@@ -38,6 +42,26 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_PIDFD_H
+#include <sys/pidfd.h>
+#else
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+/* io_uring takes over the connections, everything else is left to epoll */
+#if defined(USE_IO_URING) && !defined(HAVE_SYS_EPOLL_H)
+#undef USE_IO_URING
+#endif
+#ifdef USE_IO_URING
+#include <poll.h>
+#include "uring.h"
+#endif
+
 #ifdef HAVE_ALLOCA_H
 #include <alloca.h>
 #endif
@@ -51,11 +75,17 @@
 #include "i18n.h"
 #include "memory.h"
 #include "agent.h"
+#include "cache.h"
+#include "handover.h"
+#include "shmring.h"
 #include "util.h"
 
 #ifndef HAVE_STRDUP
 #include "strdup.h"
 #endif
+#ifndef HAVE_SETENV
+#include "setenv.h"
+#endif
 
 /* commands to set an environment variable in the different shells */
 #define SETENV_SH	"AGENT_SOCKET='%s'; export AGENT_SOCKET\n"
@@ -63,30 +93,374 @@
 
 #define TMP_DIR_TRIES	1000
 
-struct value {
-  char comment[COMMENT_LENGTH];
-  char *data;
+/* the first descriptor passed by a supervisor doing socket activation */
+#define LISTEN_FDS_START	3
+
+/* tells a new agent binary which descriptor to take over from */
+#define HANDOVER_ENV	"Q_AGENT_HANDOVER"
+
+/* identifies what is handed over; this should change, whenever the format
+   changes */
+#define HANDOVER_MAGIC	0xa8e52307
+
+/* how many seconds a restart waits for pending replies, before it is
+   given up */
+#define DRAIN_TIMEOUT	30
+
+/* how many milliseconds the main loop waits at once while draining */
+#define DRAIN_WAIT	10
+
+/* how many ready descriptors are fetched per wakeup of the main loop */
+#define MAX_EVENTS	64
+
+/* how much output of the query program is considered */
+#define QUERY_OUTPUT_LENGTH	(DATA_LENGTH + 1000)
+
+/* default for how many bytes of replies may pile up for a client, before
+   the agent stops reading its requests */
+#define OUTPUT_LIMIT	65536
+
+/* minimum size of buffers for queued replies that contain no secrets */
+#define OUTBUF_SIZE	4096
+
+/* how many queued buffers are written with one call */
+#define OUTBUF_IOV	16
+
+/* what the main loop can wait for on a file descriptor */
+#define WATCH_READ	1
+#define WATCH_WRITE	2
+
+/* into how many shards the cache is split when serving with threads */
+#define CACHE_SHARDS	64
+
+/* short secrets that the default secure memory should hold however the
+   cache keeps track of them */
+#define POOL_SECRETS	100
+
+/* WATCHes a connection may have at once */
+#define WATCH_LIMIT	64
+
+/* clients that may be served through rings in shared memory at once, if
+   not told otherwise */
+#define SHM_RINGS	16
+
+/* serving with several threads needs a main loop for each of them, and a
+   GLIB that can be used from all of them */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_SYS_EPOLL_H) \
+    && defined(G_THREADS_ENABLED)
+#define USE_THREADS
+#define LOCK(m)		pthread_mutex_lock(m)
+#define UNLOCK(m)	pthread_mutex_unlock(m)
+#else
+#define LOCK(m)
+#define UNLOCK(m)
+#endif
+
+/* datagrams are only answered where the kernel tells who sent them */
+#if defined(SO_PASSCRED) && defined(SCM_CREDENTIALS)
+#define USE_DGRAM
+#endif
+
+/* each client served through rings in shared memory gets a thread, which
+   sleeps on a futex while it has nothing to do */
+#if defined(USE_THREADS) && defined(HAVE_LINUX_FUTEX_H)
+#define USE_SHMRING
+#endif
+
+#ifdef USE_IO_URING
+/* how many operations the ring of a worker holds */
+#define RING_ENTRIES	256
+
+/* what requests are received into, in secure memory - a GET fits */
+#define RECV_BUFFERS	8
+#define RECV_BUFFER_SIZE 256
+#define RECV_GROUP	0
+
+/* what an operation of the ring is doing - kept in the low bits of its
+   user_data, next to the connection or worker it is for */
+#define OP_RECV		1	/* receiving requests on a connection */
+#define OP_SEND		2	/* sending replies on a connection */
+#define OP_ACCEPT	3	/* accepting connections for a worker */
+#define OP_POLL		4	/* waiting for the epoll instance of a worker */
+#define OP_CANCEL	5	/* cancelling all of the above */
+#define OP_ACCEPT_PACKET 6	/* accepting connections on packetsock */
+#define OP_MASK		7
+
+/* the server sockets a ring is accepting connections on */
+#define ACCEPT_STREAM	1	/* sock */
+#define ACCEPT_PACKET	2	/* packetsock */
+
+#define RING(worker)	((worker)->ring)
+#else
+#define RING(worker)	NULL
+#endif
+
+/* a file descriptor the main loop waits on */
+struct watch {
+  int fd;
+  int events;			/* WATCH_* that are waited for */
+  struct worker *worker;	/* whose main loop waits */
+  void (*ready)(struct watch *, int); /* called with the WATCH_* that
+					 happened */
+};
+
+/* something to be done by the main loop of a certain worker */
+struct job {
+  struct job *next;
+  void (*run)(struct job *);
+};
+
+/* a thread with a main loop of its own, serving some of the connections */
+struct worker {
+#ifdef HAVE_SYS_EPOLL_H
+  int epfd;
+  struct conn *closed;		/* freed once the events at hand are handled */
+#endif
+  char *req;			/* buffer for reading requests */
+  struct conn *conns;		/* the connections served */
+  struct job notify;		/* sends the events for its connections */
+  int notifying;		/* notify is on its way */
+  struct worker *next_notify;	/* the next one secret_changed() wakes */
+#ifdef USE_THREADS
+  pthread_t thread;
+  int kick[2];			/* pipe to wake up the main loop */
+  struct watch kicked;		/* watches the read end of kick */
+  pthread_mutex_t lock;		/* protects jobs and conns */
+  struct job *jobs;		/* handed over by other threads */
+  struct job stop;		/* makes the main loop finish */
+  int stopped;
+#endif
+#ifdef USE_IO_URING
+  struct uring *ring;		/* serves the connections, if not NULL */
+  char *bufs;			/* what the ring receives into */
+  int accepting;		/* ACCEPT_STREAM | ACCEPT_PACKET */
+  struct conn *dirty;		/* connections whose I/O has to be updated */
+#endif
+};
+
+/* replies that could not be sent right away */
+struct outbuf {
+  struct outbuf *next;
+  int secure;			/* allocated in secure memory */
+  size_t size;			/* capacity of data */
+  size_t start, end;		/* the part of data still to be sent */
+  struct large *large;		/* sent instead of data, if not NULL */
+  int last;			/* ends a reply, on a SOCK_SEQPACKET socket */
+  char data[1];
+};
+
+#define OUTBUF_DATA(o)	((o)->large ? (o)->large->data : (o)->data)
+
+/* a PUT_LARGE whose data is still coming in */
+struct upload {
+  struct secret *s;		/* what is stored, NULL if nothing is */
+  struct shard *sh;		/* where it goes */
+  int expires;			/* it has a deadline */
+  uint32_t version;		/* it replaces, or 0 */
+  char *data;			/* where the rest of the data goes */
+  size_t left;			/* bytes of data still to come */
+  size_t pad;			/* zero bytes after them still to come */
+};
+
+/* a connection to a client */
+struct conn {
+  struct watch w;
+  struct conn *next, *prev;	/* in the list of the worker */
+  int busy;			/* a reply is pending, do not read on */
+  int pending;			/* tagged GETs waiting for the user */
+  int hungup;			/* closed once those have been answered, and
+				   the replies queued have gone out */
+  int packet;			/* it is a SOCK_SEQPACKET socket */
+  int parts;			/* a reply is being sent in parts */
+  int version;			/* of the protocol the last request used */
+  uint32_t tag;			/* of the request being answered */
+  struct mget *mget;		/* the MGET being answered */
+  int large;			/* it is a GET_LARGE being answered */
+  int byfd;			/* it is a GET_FD being answered */
+  uint32_t unless;		/* the version that GET is not wanted in */
+  struct upload *upload;	/* the PUT_LARGE being received */
+  unsigned watches;		/* subscriptions of its WATCHes */
+  struct shm *shm;		/* the rings a SHM asked for, or NULL */
+  char *in;			/* unhandled input, in secure memory */
+  size_t inlen;
+  struct outbuf *out, *outtail;	/* queued replies */
+  size_t outlen;		/* bytes in the queue */
+  int outsecure;		/* buffers in the queue holding secrets */
+#ifdef HAVE_SYS_EPOLL_H
+  struct conn *next_closed;
+#endif
+#ifdef USE_IO_URING
+  int ops;			/* OP_RECV and OP_SEND in flight */
+  int direct;			/* OP_RECV receives into the upload */
+  int closing;			/* hung up, freed once nothing is in flight */
+  int dirty;			/* on the dirty list of the worker */
+  struct conn *next_dirty;
+  struct msghdr msg;		/* what the send in flight sends */
+  struct iovec iov[OUTBUF_IOV];
+#endif
+};
+
+/* an MGET, whose ids are looked up one after the other, like a GET each.
+   The reply goes out once it is known which of them are handed out. */
+struct mget {
+  unsigned count;		/* of ids */
+  unsigned next;		/* the first id not decided yet */
+  char *ids[MGET_IDS];
+  char found[MGET_IDS];		/* whether the secret is handed out */
+  char buf[MGET_LENGTH];	/* holds the ids */
+};
+
+/* a GET waiting for the user to confirm handing out the secret */
+struct insurance {
+  struct watch w;		/* watches a pidfd of the insure command */
+  pid_t pid;
+  struct conn *client;
+  uint32_t tag;			/* of the GET, 0 if the client waits */
+  char id[ID_LENGTH];
+};
+
+/* a GET waiting for the query program */
+struct waiter {
+  struct job j;			/* answers it, in the client's worker */
+  struct waiter *next;
+  struct conn *client;
+  uint32_t tag;			/* of the GET, 0 if the client waits */
+  int found;			/* whether the query came up with a secret */
+  char id[ID_LENGTH];
+};
+
+/* the query program asking the user for a secret that was not known */
+struct query {
+  struct watch w;		/* watches the program's standard output */
+  pid_t pid;
+  char id[ID_LENGTH];
+  char *out;			/* output read so far, in secure memory */
+  size_t len;
+  struct waiter *waiters;	/* GETs that want the secret */
+};
+
+/* a WATCH, which goes on until it is cancelled.  The events for it are
+   queued by whichever thread changes a secret, and sent by the worker of
+   the client. */
+struct subscription {
+  struct subscription *next;
+  struct conn *client;
+  uint32_t tag;			/* of the WATCH, and of its events */
+  int prefix;			/* PATTERN is a prefix of the ids watched */
+  int dropped;			/* events have been dropped since the last
+				   ones were sent */
+  int lost;			/* EVENT_LOST has been sent since */
+  struct event *events, **tail;	/* not sent yet */
+  size_t len;			/* of PATTERN */
+  char pattern[1];
+};
+
+/* something that has happened to a secret, to be told to a subscriber */
+struct event {
+  struct event *next;
+  reply2_event ev;
+  char id[1];
+};
+
+/* rings in shared memory, which a thread of their own serves for the
+   client whose SHM asked for them */
+struct shm {
+  struct shmrings *rings;
+#ifdef USE_THREADS
+  pthread_t thread;
+#endif
+  char *buf;			/* the request being served, in secure
+				   memory */
+  int broken;			/* the client has messed up the rings */
+};
+
+/* a child that has done its job, but not exited yet */
+struct reaper {
+  struct watch w;		/* watches a pidfd of the child */
+  pid_t pid;
 };
 
-GHashTable *cache;
-char *sockdir = NULL, *sockname = NULL;
-int sock = -1;
+GHashTable *queries;		/* queries in flight, by id */
+char *sockdir = NULL, *sockname = NULL, *packetname = NULL;
+char *dgramname = NULL;
+int sock = -1, packetsock = -1;	/* SOCK_STREAM and SOCK_SEQPACKET */
+int dgramsock = -1;		/* SOCK_DGRAM */
 int keep_going = 1;
 int debug = 0;
 char *query_options = "";
 reply failed_reply = { REPLY_MAGIC, STATUS_FAIL };
-time_t next_deadline = 0;
 flags_t supported;
 int x_enabled;
+size_t output_limit = OUTPUT_LIMIT;
+unsigned nworkers = 1;
+size_t max_id = ID_LENGTH - 1, max_comment = COMMENT_LENGTH - 1;
+size_t max_secret = DATA_LENGTH - 1;
+size_t max_large = 0;		/* for PUT_LARGE, if more than max_secret */
+size_t request_limit = MAX_REQUEST_SIZE; /* the largest request taken */
+unsigned shm_rings = SHM_RINGS;	/* clients served through rings at once */
+
+static struct worker *workers;	/* the first one runs in the main thread */
+static unsigned next_worker = 0; /* gets the next connection */
+static struct watch listener;	/* watches the server socket */
+static struct watch packet_listener; /* watches packetsock */
+static struct watch datagrams;	/* watches dgramsock */
+static struct subscription *subscriptions; /* of all connections */
+#ifdef USE_SHMRING
+static unsigned shm_count = 0;	/* clients served through rings */
+#endif
+static int accept_paused = 0;	/* out of descriptors, stopped accepting */
+static int restart_wanted = 0;	/* SIGUSR2 has asked for a hot restart */
+static int draining = 0;	/* no new requests, a successor takes them */
+static int handover_fd = -1;	/* where the predecessor hands over */
+static char *self_path;		/* the binary of the successor */
+static char **self_argv;	/* its arguments */
+#ifdef USE_THREADS
+static pthread_mutex_t queries_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t accept_lock = PTHREAD_MUTEX_INITIALIZER;
+/* protects subscriptions, their events, and notifying of the workers */
+static pthread_mutex_t subscriptions_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef USE_SHMRING
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#endif
+#ifndef HAVE_SYS_EPOLL_H
+static fd_set watched_r, watched_w;
+static struct watch *watches[FD_SETSIZE];
+static int nfds = 0;
+#endif
 
 
 #define BLIND(x) ((debug >= 2) ? (x) : "XXX")
 
+static void init_watch(struct watch *w, struct worker *worker, int fd,
+		       void (*ready)(struct watch *, int));
+static int watch_fd(struct watch *w, int events);
+static void unwatch_fd(struct watch *w);
+static void send_replyv(struct conn *c, struct iovec *iov, int n,
+			int secure);
+static void send_reply(struct conn *c, const void *data, size_t len,
+		       int secure);
+static void send_reply2_large(struct conn *c, struct iovec *iov, int n,
+			      int i, struct large *l);
+static void begin_parts(struct conn *c);
+static void end_parts(struct conn *c);
+static void update_connection(struct conn *c);
+static void resume_connection(struct conn *c);
+static void close_connection(struct conn *c);
+#ifdef USE_IO_URING
+static int dispatch_completions(struct worker *worker, int timeout);
+#endif
+
 void exit_gracefully(int sig)
 {
   keep_going = 0;
 }
 
+void restart_gracefully(int sig)
+{
+  restart_wanted = 1;
+}
+
 /* copy file descriptor old into a new slot, with error handling. */
 static void
 xdup2(int old, int new)
@@ -143,18 +517,100 @@ static int make_tmpdir()
   return 0;
 }
 
-/* initializes the communication socket and binds it to a file path */
-static int create_socket()
+/* children (query and insure programs) must not inherit the server socket
+   S, and connections are accepted until the queue runs dry */
+static int set_socket_flags(int s)
 {
-  size_t len, l;
+  if (fcntl(s, F_SETFD, FD_CLOEXEC) < 0
+      || fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) < 0) {
+    perror(_("could not set socket flags"));
+    return -1;
+  }
+  return 0;
+}
+
+/* a socket of TYPE, bound to PATH - -1 on errors */
+static int bind_at(int type, const char *path)
+{
+  size_t len;
   struct sockaddr_un *addr;
+  int s;
 
-  if (make_tmpdir() < 0)
-    return -1;
-  if (!(sock = socket(PF_UNIX, SOCK_STREAM, 0))) {
+  if ((s = socket(PF_UNIX, type, 0)) < 0) {
     perror(_("could not create socket"));
     return -1;
   }
+  if (set_socket_flags(s) < 0) {
+    close(s);
+    return -1;
+  }
+  len = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+  addr = alloca(len);
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  if (bind(s, (struct sockaddr *)addr, len) < 0) {
+    perror(_("could not bind socket"));
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+/* a server socket of TYPE, bound to PATH - -1 on errors */
+static int listen_at(int type, const char *path)
+{
+  int s;
+
+  if ((s = bind_at(type, path)) < 0)
+    return -1;
+  if (listen(s, SOMAXCONN) < 0) {
+    perror(_("could not listen to socket"));
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+/* the SOCK_DGRAM socket at PATH, which is told who sent each datagram -
+   -1 on errors, or if that cannot be told */
+static int dgram_at(const char *path)
+{
+#ifdef USE_DGRAM
+  int s, on = 1;
+
+  if ((s = bind_at(SOCK_DGRAM, path)) < 0)
+    return -1;
+  if (setsockopt(s, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+    perror(_("could not set socket options"));
+    close(s);
+    unlink(path);
+    return -1;
+  }
+  return s;
+#else
+  return -1;
+#endif
+}
+
+/* SOCKNAME with SUFFIX appended, in newly allocated memory */
+static char *suffixed(const char *suffix)
+{
+  char *s;
+
+  if ((s = malloc(strlen(sockname) + strlen(suffix) + 1)) != NULL) {
+    strcpy(s, sockname);
+    strcat(s, suffix);
+  }
+  return s;
+}
+
+/* initializes the communication sockets and binds them to file paths */
+static int create_socket()
+{
+  size_t len, l;
+
+  if (make_tmpdir() < 0)
+    return -1;
   l = strlen(sockdir);
   len = l + 1 + sizeof(SOCKET_NAME) + 1;
   if (!(sockname = malloc(len))) {
@@ -164,21 +620,89 @@ static int create_socket()
   strcpy(sockname, sockdir);
   sockname[l] = '/';
   strcpy(sockname+l+1, SOCKET_NAME);
-  len += offsetof(struct sockaddr_un, sun_path);
-  addr = alloca(len);
-  addr->sun_family = AF_UNIX;
-  strcpy(addr->sun_path, sockname);
-  if (bind(sock, (struct sockaddr *)addr, len) < 0) {
-    perror(_("could not bind socket"));
+  if (!(packetname = suffixed(PACKET_SUFFIX))
+      || !(dgramname = suffixed(DGRAM_SUFFIX))) {
+    perror(_("could not assemble socket name"));
     return -1;
   }
-  if (listen(sock, 5) < 0) {
-    perror(_("could not listen to socket"));
+  if ((sock = listen_at(SOCK_STREAM, sockname)) < 0)
     return -1;
+  /* clients make do without them */
+  if ((packetsock = listen_at(SOCK_SEQPACKET, packetname)) < 0) {
+    free(packetname);
+    packetname = NULL;
+  }
+  if ((dgramsock = dgram_at(dgramname)) < 0) {
+    free(dgramname);
+    dgramname = NULL;
   }
   return 0;
 }
 
+/* the path the Unix socket S is bound to, or NULL if there is none */
+static char *bound_path(int s)
+{
+  static struct {
+    struct sockaddr_un addr;
+    char nul;			/* in case sun_path is filled up */
+  } name;
+  socklen_t len = sizeof(name.addr);
+
+  memset(&name, 0, sizeof(name));
+  if (getsockname(s, (struct sockaddr *)&name.addr, &len) < 0
+      || name.addr.sun_family != AF_UNIX || !name.addr.sun_path[0])
+    return NULL;
+  return name.addr.sun_path;
+}
+
+/* take over the server socket a supervisor has created, and passed on the
+   first connection, as told by LISTEN_PID and LISTEN_FDS.  The socket is
+   not ours to remove.  Returns 0 if no socket has been passed, 1 if one
+   has, and -1 if it cannot be used. */
+static int inherit_socket()
+{
+  char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+  int type, listening;
+  long n;
+  socklen_t len;
+
+  if (!pid || !fds || strtol(pid, NULL, 10) != getpid())
+    return 0;
+  n = strtol(fds, NULL, 10);
+  /* the query and insure programs are not meant to see them */
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  if (n != 1) {
+    fprintf(stderr, _("%ld sockets passed, expected one\n"), n);
+    return -1;
+  }
+  len = sizeof(int);
+  if (getsockopt(LISTEN_FDS_START, SOL_SOCKET, SO_TYPE, &type, &len) < 0
+      || getsockopt(LISTEN_FDS_START, SOL_SOCKET, SO_ACCEPTCONN,
+		    &listening, &len) < 0
+      || type != SOCK_STREAM || !listening
+      || !bound_path(LISTEN_FDS_START)) {
+    fprintf(stderr, _("passed descriptor is no listening Unix socket\n"));
+    return -1;
+  }
+  sock = LISTEN_FDS_START;
+  return set_socket_flags(sock) < 0 ? -1 : 1;
+}
+
+/* where our binary is, or NULL if that is unknown.  This is where the
+   successor is run from, after the binary has been upgraded. */
+static char *binary_path()
+{
+  char buf[PATH_MAX];
+  ssize_t n;
+
+  if ((n = readlink("/proc/self/exe", buf, sizeof(buf) - 1)) <= 0)
+    return NULL;
+  buf[n] = 0;
+  return strdup(buf);
+}
+
 /* close all connections, and remove the server socket */
 static void cleanup()
 {
@@ -186,362 +710,4464 @@ static void cleanup()
     perror(_("error while closing socket"));
   if (sockname && unlink(sockname) < 0)
     perror(_("could not unlink socket"));
+  if (packetsock >= 0 && close(packetsock) < 0)
+    perror(_("error while closing socket"));
+  if (packetname && unlink(packetname) < 0)
+    perror(_("could not unlink socket"));
+  if (dgramsock >= 0 && close(dgramsock) < 0)
+    perror(_("error while closing socket"));
+  if (dgramname && unlink(dgramname) < 0)
+    perror(_("could not unlink socket"));
   if (sockdir && rmdir(sockdir) < 0)
     perror(_("could not remove socket directory"));
+  cache_wipe_fds();
   if (debug)
     secmem_dump_stats();
   secmem_term();
 }
 
-/* remove a secret from the hash table, and free it */
-void delete_secret(char *id)
+/* point IOV at the LEN bytes of S, and IOV[1] at the zero bytes that
+   pad it in a version 2 body */
+static void string2_iov(struct iovec *iov, const char *s, size_t len)
 {
-  gpointer key, val;
+  static const char zeros[8];
 
-  if (g_hash_table_lookup_extended(cache, id, &key, &val)) {
-    g_hash_table_remove(cache, id);
-    free(key);
-    secmem_free(val);
-  }
+  iov[0].iov_base = (char *)s;
+  iov[0].iov_len = len;
+  iov[1].iov_base = (char *)zeros;
+  iov[1].iov_len = STRING2_SIZE(len) - len;
 }
 
-reply_get *store(char *id, flags_t flags, time_t deadline, char *comment,
-		 char *data)
+/* the string of LEN bytes at *P in a version 2 body ending at END, which
+   is advanced past it.  NULL if it is not properly terminated. */
+static char *string2(char **p, char *end, size_t len)
 {
-  reply_get *value;
+  char *s = *p;
 
-  value = secmem_malloc(sizeof(reply_get));
-  if (value) {
-    debugmsg("storing at %p\n", value);
-    value->magic = REPLY_MAGIC;
-    value->status = STATUS_OK;
-    value->flags = flags;
-    value->deadline = deadline;
-    strcpy(value->comment, comment);
-    strcpy(value->data, data);
-    /* delete old version cleanly, since it will be overwritten anyway */
-    delete_secret(id);
-    g_hash_table_insert(cache, strdup(id), value);
-    if (deadline && (!next_deadline || deadline < next_deadline))
-      next_deadline = deadline;
-    return value;
-  } else {
-    fprintf(stderr, _("could not allocate space in secure storage\n"));
+  if (STRING2_SIZE(len) > end - s || memchr(s, 0, len) || s[len])
     return NULL;
-  }
+  *p += STRING2_SIZE(len);
+  return s;
 }
 
-/* store a secret in secure memory */
-void do_put(int client, request_put *req)
+/* fill in H as the header of a version 2 reply to C with STATUS, and a
+   body of LEN bytes */
+static void header2_init(struct conn *c, header2 *h, status_t status,
+			 size_t len)
 {
-  reply rep;
+  memset(h, 0, sizeof(header2));
+  h->magic = REPLY2_MAGIC;
+  h->type = status;
+  h->length = len;
+  h->tag = c->tag;
+}
 
-  debugmsg("PUT %s, %lx, %ld, %s, %s\n", req->id, (long)req->flags,
-	   (long)req->deadline, req->comment, BLIND(req->data));
-  rep.magic = REPLY_MAGIC;
-  if (req->flags & ~supported)
-    rep.status = STATUS_FAIL;
-  else 
-    rep.status = store(req->id, req->flags, req->deadline, req->comment,
-		       req->data) != NULL ? STATUS_OK : STATUS_FAIL;
-  if (xwrite(client, &rep, sizeof(rep)) < 0)
-    perror(_("error while replying"));
+/* send C a version 2 reply with STATUS, and the body in IOV[1] to
+   IOV[N-1] - IOV[0] is filled in with the header */
+static void send_reply2(struct conn *c, status_t status, struct iovec *iov,
+			int n, int secure)
+{
+  header2 h;
+  size_t len = 0;
+  int i;
+
+  for (i = 1; i < n; i++)
+    len += iov[i].iov_len;
+  header2_init(c, &h, status, len);
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  send_replyv(c, iov, n, secure);
 }
 
-/* fetch a secret by id */
-void do_get(int client, request_get *req)
+/* send C a version 2 reply with STATUS_OK, and the body in IOV[1] to
+   IOV[N-1], which carries FD in an SCM_RIGHTS message - IOV[0] is filled
+   in with the header.  Nothing may be queued for C, since FD goes with the
+   first byte.  Returns -1 if nothing could be sent. */
+static int send_reply2_fd(struct conn *c, struct iovec *iov, int n, int fd)
 {
-  reply *rep;
-  size_t size;
-  int do_insurance = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  header2 h;
+  size_t len = 0;
+  ssize_t sent;
+  int i;
 
-  debugmsg("GET %s\n", req->id);
-  rep = (reply *)g_hash_table_lookup(cache, req->id);
-  if (!rep) {
-    if (x_enabled) {
-      char *buf;
-      if (asprintf(&buf,
-		   _("%s %s -e 'Enter secret to store under \"%s\":'"),
-		   QUERY_PROGRAM, query_options,
-		   req->id) >= 0) {
-	FILE *f;
-	char *data;
-	debugmsg("try calling '%s'\n", buf);
-	if ((f = popen(buf, "r")) != NULL) {
-	  int deadline = 0, flags = 0;
-	  char buf[200];
-	  while (1) {
-	    char *d;
-	    if (fgets(buf, 200, f) == NULL)
-	      break;
-	    buf[strlen(buf) - 1] = 0;
-	    if (buf[0] == 0)
-	      break;
-	    if ((d = strstr(buf, ": ")) == NULL)
-	      continue;
-	    *d = 0;
-	    d += 2;
-	    debugmsg("keyword %s value %s\n", buf, d);
-	    if (strcmp(buf, "Options") == 0) {
-	      if (strcmp(d, "insure") == 0)
-		flags |= FLAGS_INSURE;
-	    } else if (strcmp(buf, "Timeout") == 0) {
-	      deadline = strtoul(d, NULL, 10);
-	      if (deadline)
-		deadline += time(NULL);
-	    }
-	  }
-	  if ((data = (char *)secmem_malloc(DATA_LENGTH)) != NULL) {
-	    size_t len;
-	    if (fgets(data, DATA_LENGTH, f) != NULL
-		&& (len = strlen(data)) > 0) {
-	      if (data[len-1] == '\n')
-		data[len-1] = 0;
-	      rep = (reply *)store(req->id, flags, deadline, "", data);
-	      do_insurance = 0;
-	    }
-	    secmem_free(data);
-	  } else {
-	    fprintf(stderr, _("could not allocate space in secure storage\n"));
-	    exit(EXIT_FAILURE);
-	  }
-	  pclose(f);
-	}
-	free(buf);
-      }
-    }
-  }
-  if (rep && ((reply_get *)rep)->flags & FLAGS_INSURE && do_insurance) {
-    int pid;
-    if ((pid = fork()) == 0) {
-      char *buf;
-      size_t len;
-      len = strlen(((reply_get *)rep)->comment);
-      asprintf(&buf, _("Hand out secret %s%s%s%s?"),
-	       req->id, len ? " (" : "",
-	       ((reply_get *)rep)->comment, len ? ")" : "");
-#ifdef HAVE_GTK
-      execlp("secret-ask", "secret-ask", "bool", buf, NULL);
-#endif
-#ifdef XMESSAGE
-      execl(XMESSAGE, "xmessage", "-nearmouse", "-default", "yes",
-	    "-buttons", "yes:2,no:3", buf, NULL);
-#endif
-      free(buf);
-      perror(_("could not exec insure command"));
-      exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-      perror(_("could not fork"));
-      rep = NULL;
-    } else {
-      int status;
-      waitpid(pid, &status, 0);
-      if (!WIFEXITED(status) || WEXITSTATUS(status) == 1) {
-	fprintf(stderr, _("call of insure command failed\n"));
-	supported &= ~FLAGS_INSURE;
-	rep = NULL;
-      } else if (WEXITSTATUS(status) == 3)
-	rep = NULL;
-    }
-  }
-  if (rep) {
-    size = sizeof(reply_get);
-    debugmsg("reply with %d bytes (%p): %s, %lx, %ld, %s, %s\n", size, rep,
-	     ((reply_get *)rep)->status==STATUS_OK ? "OK" : "FAIL",
-	     (long)((reply_get *)rep)->flags,
-	     (long)((reply_get *)rep)->deadline,
-	     ((reply_get *)rep)->comment,
-	     BLIND(((reply_get *)rep)->data));
-  } else {
-    rep = &failed_reply;
-    size = sizeof(failed_reply);
-    debugmsg("reply with %d bytes: %s\n", size,
-	     rep->status==STATUS_OK ? "OK" :"FAIL");
+  for (i = 1; i < n; i++)
+    len += iov[i].iov_len;
+  header2_init(c, &h, STATUS_OK, len);
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  while ((sent = sendmsg(c->w.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+    if (errno != EINTR)
+      return -1;
+  /* the rest goes like any other reply */
+  for (i = 0; i < n && sent >= iov[i].iov_len; i++)
+    sent -= iov[i].iov_len;
+  if (i < n) {
+    iov[i].iov_base = (char *)iov[i].iov_base + sent;
+    iov[i].iov_len -= sent;
+    send_replyv(c, iov + i, n - i, 0);
   }
-  if (xwrite(client, rep, size) < 0)
-    perror(_("error while replying"));
+  return 0;
 }
 
-/* remove a secret by id */
-void do_delete(int client, request_get *req)
+/* send C a reply with nothing but STATUS, in the version it asked in */
+static void send_status(struct conn *c, status_t status)
 {
+  struct iovec iov[1];
   reply rep;
 
-  debugmsg("DELETE %s\n", req->id);
-  delete_secret(req->id);
+  if (c->version == 2) {
+    send_reply2(c, status, iov, 1, 0);
+    return;
+  }
   rep.magic = REPLY_MAGIC;
-  rep.status = STATUS_OK;
-  if (xwrite(client, &rep, sizeof(rep)) < 0)
-    perror(_("error while replying"));
+  rep.status = status;
+  send_reply(c, &rep, sizeof(rep), 0);
 }
 
-void send_list_entry(char *key, reply_get *value, int *fd)
+/* whether strings of these lengths may be stored */
+static int within_limits(size_t idlen, size_t commentlen, size_t datalen)
 {
-  static reply_list_entry rep;
+  return idlen <= max_id && commentlen <= max_comment && datalen <= max_secret;
+}
 
-  if (*fd == -1)
-    return;
-  strncpy(rep.id, key, ID_LENGTH);
-  rep.flags = value->flags;
-  rep.deadline = value->deadline;
-  strncpy(rep.comment, value->comment, COMMENT_LENGTH);
-  debugmsg("sending entry %s\n", rep.id);
-  if (xwrite(*fd, &rep, sizeof(rep)) < 0) {
-    *fd = -1;
-    perror(_("error while replying"));
-  }
+/* store a secret in secure memory, if the one it replaces has *VERSION,
+   and return how that went.  If it is stored, its version is stored at
+   *VERSION. */
+static status_t store_secret(const char *id, flags_t flags, time_t deadline,
+			     const char *comment, const char *data,
+			     uint32_t *version)
+{
+  struct shard *sh;
+  struct value *value;
+  status_t status;
+
+  debugmsg("PUT %s, %lx, %ld, %s, %s\n", id, (long)flags, (long)deadline,
+	   comment, BLIND(data));
+  if (flags & ~supported)
+    return STATUS_FAIL;
+  sh = cache_shard(id);
+  cache_write_lock(sh);
+  if (!cache_has_version(sh, id, *version)) {
+    debugmsg("not version %lu\n", (unsigned long)*version);
+    status = STATUS_CONFLICT;
+  } else if ((value = cache_store(sh, id, flags, deadline, comment, data))) {
+    *version = cache_version(value);
+    status = STATUS_OK;
+  } else
+    status = STATUS_FAIL;
+  cache_unlock(sh);
+  return status;
 }
 
-/* list ids and comments of all known secrets */
-void do_list(int client)
+/* point IOV[1] at the body of a version 2 reply to a PUT that stored a
+   secret with VERSION, which is filled in at BODY.  Returns how many
+   elements of IOV are used. */
+static int put2_iov(struct iovec *iov, reply2_put *body, uint32_t version)
 {
-  reply_list rep;
-  int clnt;
+  memset(body, 0, sizeof(*body));
+  body->version = version;
+  iov[1].iov_base = body;
+  iov[1].iov_len = sizeof(*body);
+  return 2;
+}
 
-  debugmsg("LIST\n");
-  rep.magic = REPLY_MAGIC;
-  rep.status = STATUS_OK;
-  rep.entries = g_hash_table_size(cache);
-  if (xwrite(client, &rep, sizeof(rep)) < 0) {
-    perror(_("error while replying"));
+/* send CLIENT the reply to a PUT with STATUS, which stored a secret with
+   VERSION if that is STATUS_OK */
+static void send_put_reply(struct conn *client, status_t status,
+			   uint32_t version)
+{
+  struct iovec iov[2];
+  reply2_put body;
+
+  if (client->version == 2 && status == STATUS_OK)
+    send_reply2(client, status, iov, put2_iov(iov, &body, version), 0);
+  else
+    send_status(client, status);
+}
+
+static void put_secret(struct conn *client, const char *id, flags_t flags,
+		       time_t deadline, const char *comment, const char *data,
+		       uint32_t version)
+{
+  status_t status;
+
+  status = store_secret(id, flags, deadline, comment, data, &version);
+  send_put_reply(client, status, version);
+}
+
+void do_put(struct conn *client, request_put *req)
+{
+  if (!within_limits(strnlen(req->id, ID_LENGTH),
+		     strnlen(req->comment, COMMENT_LENGTH),
+		     strnlen(req->data, DATA_LENGTH))) {
+    fprintf(stderr, _("secret too large, not stored\n"));
+    send_status(client, STATUS_FAIL);
     return;
   }
-  clnt = client;
-  g_hash_table_foreach(cache, (GHFunc) send_list_entry, &clnt);
+  put_secret(client, req->id, req->flags, req->deadline, req->comment,
+	     req->data, 0);
 }
 
-void forget_old_stuff(char *key, reply_get *value, gpointer user_data)
+/* a version 2 PUT, taken apart */
+struct put2 {
+  request2_put *req;
+  char *id, *comment, *data;
+};
+
+/* take apart the PUT at *P, in a body ending at END, and advance *P past
+   it.  Returns 0 if it is malformed. */
+static int parse_put2(char **p, char *end, struct put2 *put)
 {
-  if (!value->deadline)
-    return;
-  if (value->deadline < time(NULL))
-    delete_secret(key);	 /* FIXME: is this dangerous from inside a foreach? */
-  else if (!next_deadline || value->deadline < next_deadline)
-    next_deadline = value->deadline;
+  if (end - *p < sizeof(request2_put))
+    return 0;
+  put->req = (request2_put *)*p;
+  *p += sizeof(request2_put);
+  return (put->id = string2(p, end, put->req->idlen)) != NULL
+    && (put->comment = string2(p, end, put->req->commentlen)) != NULL
+    && (put->data = string2(p, end, put->req->datalen)) != NULL;
 }
 
-#define HANDLE(signal) if (sigaction(signal, &sa, NULL) < 0) { \
-			 fprintf(stderr, \
-				 _("could not install %s handler: %s\n"), \
-				 #signal, strerror(errno)); \
-			 return; \
-		       }
+/* the id at *P, introduced by a request2_get, in a body ending at END.
+   *P is advanced past it.  NULL if it is malformed. */
+static char *parse_id2(char **p, char *end)
+{
+  request2_get *req = (request2_get *)*p;
 
-/* the main loop - accept connections, serve requests, protect the innocent */
-static void agent()
+  if (end - *p < sizeof(request2_get))
+    return NULL;
+  *p += sizeof(request2_get);
+  return string2(p, end, req->idlen);
+}
+
+void do_put2(struct conn *client, header2 *h)
 {
-  char *req;
-  fd_set connections, ready;
-  struct sigaction sa;
-  int c, nfds;
+  char *p = (char *)(h + 1), *end = p + h->length;
+  struct put2 put;
 
-  sa.sa_handler = exit_gracefully;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  HANDLE(SIGTERM);
-  HANDLE(SIGINT);
-  HANDLE(SIGHUP);
-  sa.sa_handler = SIG_IGN;
-  HANDLE(SIGPIPE);
-  req = secmem_malloc(MAX_REQUEST_SIZE);
-  if (!req) {
-    fprintf(stderr, _("could not allocate space in secure storage\n"));
+  if (!parse_put2(&p, end, &put) || p != end) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    send_status(client, STATUS_FAIL);
     return;
   }
-  cache = g_hash_table_new(g_str_hash, g_str_equal);
-  FD_ZERO(&connections);
-  FD_SET(sock, &connections);
-  nfds = sock + 1;
-  while (keep_going) {
-    struct timeval tv, *timeout;
-    ready = connections;
-    while (next_deadline &&
-	   (tv.tv_sec = next_deadline - time(NULL)) < 0) {
-      next_deadline = 0;	/* compute new deadline */
-      g_hash_table_foreach(cache, (GHFunc) forget_old_stuff, NULL);
-    }
-    if (next_deadline) {
-      tv.tv_usec = 0;
-      timeout = &tv;
-    } else
-      timeout = NULL;
-    if ((c = select(nfds, &ready, NULL, NULL, timeout)) < 0) {
-      if (errno == EINTR)
-	continue;
-      perror(_("error in select"));
-      return;
-    } else if (c == 0)
-      continue;
-    for (c = 0; c < nfds; c++) {
-      if (FD_ISSET(c, &ready)) {
-	if (c == sock) {
-	  int newone;
-	  socklen_t size = 0;
-	  if ((newone = accept(sock, NULL, &size)) < 0) {
-	    perror(_("could not accept connection"));
-	    return;
-	  }
-	  FD_SET(newone, &connections);
-	  if (newone >= nfds)
-	    nfds = newone + 1;
-	} else {
-	  int n;
-	  switch (n = read(c, req, MAX_REQUEST_SIZE)) {
-	  case -1:
-	    perror(_("error while receiving"));
-				/* fall through */
-	  case 0:		/* EOF */
-	    close(c);
-	    FD_CLR(c, &connections);
-	    break;
-	  default:
-	    debugmsg("read %d bytes on channel %d: ", n, c);
-	    if (((request *)req)->magic == REQUEST_MAGIC) {
-	      switch (((request *)req)->type)
-	      {
-	      case REQ_PUT:
-		do_put(c, (request_put *)req);
-		break;
-	      case REQ_GET:
-		do_get(c, (request_get *)req);
-		break;
-	      case REQ_DELETE:
-		do_delete(c, (request_get *)req);
-		break;
-	      case REQ_LIST:
-		do_list(c);
-		break;
-	      default:
-		fprintf(stderr, _("malformed message ignored\n"));
-	      }
-	    } else {
-	      fprintf(stderr, _("request with wrong magic number - "
-				"maybe an old client?\n"));
-	      if (xwrite(c, &failed_reply, sizeof(failed_reply)) < 0)
-		perror(_("error while replying"));
-	    }
-	  }
-	}  
-      }
-    }
+  if (!within_limits(put.req->idlen, put.req->commentlen,
+		     put.req->datalen)) {
+    fprintf(stderr, _("secret too large, not stored\n"));
+    send_status(client, STATUS_FAIL);
+    return;
   }
-  secmem_free(req);
+  put_secret(client, put.id, put.req->flags, put.req->deadline, put.comment,
+	     put.data, put.req->version);
 }
 
-int main(int argc, char **argv)
+/* the longest secret a PUT_LARGE may store */
+static size_t large_limit()
 {
-  int fd, opt, opt_help = 0, opt_version = 0, opt_fork = 0;
-  char *setenv = SETENV_SH;
-  struct option opts[] = { { "csh",	no_argument, NULL, 'c' },
-			   { "debug",	no_argument, NULL, 'd' },
-			   { "fork",	no_argument, &opt_fork, 1 },
+  return max_large > max_secret ? max_large : max_secret;
+}
+
+/* store a secret that may be longer than any request.  Only its start is
+   handled here - the data is received straight into secure memory by
+   receive_upload(), as it comes in. */
+void do_put_large(struct conn *client, header2 *h)
+{
+  request2_put *req = (request2_put *)(h + 1);
+  char *p = (char *)(req + 1), *end, *id, *comment, *data = NULL;
+  struct secret *s = NULL;
+  struct upload *u;
+
+  /* request_size() has checked that this much is there */
+  end = p + STRING2_SIZE(req->idlen) + STRING2_SIZE(req->commentlen);
+  if (!(id = string2(&p, end, req->idlen))
+      || !(comment = string2(&p, end, req->commentlen)))
+    fprintf(stderr, _("malformed message ignored\n"));
+  else if (req->idlen > max_id || req->commentlen > max_comment
+	   || req->datalen > large_limit())
+    fprintf(stderr, _("secret too large, not stored\n"));
+  else {
+    debugmsg("PUT_LARGE %s, %lx, %ld, %s, %lu bytes\n", id, (long)req->flags,
+	     (long)req->deadline, comment, (unsigned long)req->datalen);
+    if (!(req->flags & ~supported))
+      s = cache_prepare_large(id, req->flags, req->deadline, comment,
+			      req->datalen, &data);
+  }
+  /* the data has to be received even so, to get at the next request */
+  if (!(u = malloc(sizeof(struct upload)))) {
+    fprintf(stderr, _("out of memory\n"));
+    if (s)
+      cache_discard(s);
+    shutdown(client->w.fd, SHUT_RD);
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  u->s = s;
+  u->sh = s ? cache_shard(id) : NULL;
+  u->expires = req->deadline != 0;
+  u->version = req->version;
+  u->data = data;
+  u->left = req->datalen;
+  u->pad = STRING2_SIZE(req->datalen) - req->datalen;
+  client->upload = u;
+}
+
+/* all data of the PUT_LARGE of C has come in - store the secret */
+static void finish_upload(struct conn *c)
+{
+  struct upload *u = c->upload;
+  status_t status = STATUS_FAIL;
+  uint32_t version = 0;
+
+  c->upload = NULL;
+  if (u->s) {
+    cache_finish_large(u->s);
+    cache_write_lock(u->sh);
+    if (!cache_has_version(u->sh, cache_id(u->s), u->version)) {
+      cache_discard(u->s);
+      status = STATUS_CONFLICT;
+    } else if (cache_reserve(u->sh, 1, u->expires != 0) < 0)
+      cache_discard(u->s);
+    else {
+      cache_insert(u->sh, u->s);
+      version = cache_version(cache_value(u->s));
+      status = STATUS_OK;
+    }
+    cache_unlock(u->sh);
+  }
+  free(u);
+  send_put_reply(c, status, version);
+}
+
+/* take what belongs to the PUT_LARGE of C from the LEN bytes at BUF.
+   Returns how many bytes that is. */
+static size_t receive_upload(struct conn *c, const char *buf, size_t len)
+{
+  struct upload *u = c->upload;
+  size_t n = len < u->left ? len : u->left, pad;
+
+  if (u->data) {
+    memcpy(u->data, buf, n);
+    u->data += n;
+  }
+  u->left -= n;
+  pad = len - n < u->pad ? len - n : u->pad;
+  u->pad -= pad;
+  if (!u->left && !u->pad)
+    finish_upload(c);
+  return n + pad;
+}
+
+/* send the reply to a GET_LARGE - REP is NULL if the request failed.  The
+   data of large secrets goes out straight from the cache, and whatever the
+   socket does not take right away is queued by reference. */
+static void send_large_reply(struct conn *client, struct value *rep)
+{
+  struct iovec iov[6];
+  reply2_get body;
+  struct large *l;
+
+  if (!rep) {
+    debugmsg("reply: FAIL\n");
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  l = cache_hold(rep);
+  memset(&body, 0, sizeof(body));
+  body.deadline = rep->deadline;
+  body.flags = rep->flags;
+  body.commentlen = rep->commentlen;
+  body.datalen = l ? l->len : rep->datalen;
+  body.version = cache_version(rep);
+  debugmsg("reply (%p): OK, %lx, %ld, %s, %lu bytes\n", rep, (long)rep->flags,
+	   (long)rep->deadline, rep->comment, (unsigned long)body.datalen);
+  iov[1].iov_base = &body;
+  iov[1].iov_len = sizeof(body);
+  string2_iov(iov + 2, rep->comment, body.commentlen);
+  string2_iov(iov + 4, l ? l->data : rep->data, body.datalen);
+  if (!l) {
+    send_reply2(client, STATUS_OK, iov, 6, 1);
+    return;
+  }
+  send_reply2_large(client, iov, 6, 4, l);
+}
+
+/* point IOV[0] to IOV[4] at the body of a version 2 reply handing out
+   VALUE, whose fixed part is filled in at BODY */
+static void secret2_iov(struct iovec *iov, reply2_get *body,
+			struct value *value)
+{
+  memset(body, 0, sizeof(*body));
+  body->deadline = value->deadline;
+  body->flags = value->flags;
+  body->commentlen = value->commentlen;
+  body->datalen = value->datalen;
+  body->version = cache_version(value);
+  iov[0].iov_base = body;
+  iov[0].iov_len = sizeof(*body);
+  string2_iov(iov + 1, value->comment, body->commentlen);
+  string2_iov(iov + 3, value->data, body->datalen);
+}
+
+/* send the reply to a version 2 GET - REP is NULL if the request failed */
+static void send_get_reply2(struct conn *client, struct value *rep)
+{
+  struct iovec iov[6];
+  reply2_get body;
+
+  if (!rep) {
+    debugmsg("reply: FAIL\n");
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  debugmsg("reply (%p): OK, %lx, %ld, %s, %s\n", rep, (long)rep->flags,
+	   (long)rep->deadline, rep->comment, BLIND(rep->data));
+  secret2_iov(iov + 1, &body, rep);
+  send_reply2(client, STATUS_OK, iov, 6, 1);
+}
+
+/* send the reply to a GET_FD, with a memfd holding the data of REP - which
+   is NULL if the request failed */
+static void send_fd_reply(struct conn *client, struct value *rep)
+{
+  struct iovec iov[4];
+  reply2_get body;
+  size_t len;
+  int fd;
+
+  if (!rep) {
+    debugmsg("reply: FAIL\n");
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  if (client->outlen) {
+    debugmsg("reply: RETRY, with output queued\n");
+    send_status(client, STATUS_RETRY);
+    return;
+  }
+  if ((fd = cache_open_fd(rep, &len)) < 0) {
+    perror(_("could not put secret into a memfd"));
+    send_status(client, STATUS_RETRY);
+    return;
+  }
+  memset(&body, 0, sizeof(body));
+  body.deadline = rep->deadline;
+  body.flags = rep->flags;
+  body.commentlen = rep->commentlen;
+  body.datalen = len;
+  body.version = cache_version(rep);
+  debugmsg("reply (%p): OK, %lx, %ld, %s, %lu bytes in a memfd\n", rep,
+	   (long)rep->flags, (long)rep->deadline, rep->comment,
+	   (unsigned long)len);
+  iov[1].iov_base = &body;
+  iov[1].iov_len = sizeof(body);
+  string2_iov(iov + 2, rep->comment, body.commentlen);
+  if (send_reply2_fd(client, iov, 4, fd) < 0)
+    send_status(client, STATUS_RETRY);
+  close(fd);
+}
+
+/* what pads comments and data to the size they have in a reply_get */
+static const char zeroes[sizeof(reply_get)];
+
+/* send the reply to a version 1 GET handing out REP: a reply_get, put
+   together from its fixed part, the comment and the data, which are
+   padded with zeroes */
+static void send_get_reply1(struct conn *client, struct value *rep)
+{
+  reply_get r;
+  struct iovec iov[5];
+
+  /* only the fixed part of R goes out - the rest is never filled in */
+  memset(&r, 0, offsetof(reply_get, comment));
+  r.magic = REPLY_MAGIC;
+  r.status = STATUS_OK;
+  r.flags = rep->flags;
+  r.deadline = rep->deadline;
+  iov[0].iov_base = &r;
+  iov[0].iov_len = offsetof(reply_get, comment);
+  iov[1].iov_base = rep->comment;
+  iov[1].iov_len = rep->commentlen;
+  iov[2].iov_base = (void *)zeroes;
+  iov[2].iov_len = COMMENT_LENGTH - rep->commentlen;
+  iov[3].iov_base = rep->data;
+  iov[3].iov_len = rep->datalen;
+  iov[4].iov_base = (void *)zeroes;
+  iov[4].iov_len = sizeof(reply_get) - offsetof(reply_get, data)
+    - rep->datalen;
+  debugmsg("reply with %d bytes (%p): OK, %lx, %ld, %s, %s\n",
+	   (int)sizeof(reply_get), rep, (long)rep->flags, (long)rep->deadline,
+	   rep->comment, BLIND(rep->data));
+  send_replyv(client, iov, 5, 1);
+}
+
+/* send the reply to a GET - REP is NULL if the request failed */
+static void send_get_reply(struct conn *client, struct value *rep)
+{
+  /* only GET_LARGE hands out large secrets */
+  if (rep && rep->flags & FLAGS_LARGE && !client->large)
+    rep = NULL;
+  if (client->mget) {
+    client->mget->found[client->mget->next++] = rep != NULL;
+    return;
+  }
+  if (rep)
+    cache_renew(rep);
+  if (client->byfd) {
+    send_fd_reply(client, rep);
+    return;
+  }
+  if (client->large) {
+    send_large_reply(client, rep);
+    return;
+  }
+  if (client->version == 2) {
+    send_get_reply2(client, rep);
+    return;
+  }
+  if (rep) {
+    send_get_reply1(client, rep);
+    return;
+  }
+  debugmsg("reply with %d bytes: FAIL\n", (int)sizeof(failed_reply));
+  send_reply(client, &failed_reply, sizeof(failed_reply), 0);
+}
+
+/* send CLIENT the secret under ID, or a failure if there is none */
+static void reply_secret(struct conn *client, const char *id)
+{
+  struct shard *sh = cache_shard(id);
+
+  cache_read_lock(sh);
+  send_get_reply(client, cache_lookup(sh, id));
+  cache_unlock(sh);
+}
+
+/* get a file descriptor that becomes readable when process PID exits */
+static int open_pidfd(pid_t pid)
+{
+#if defined(HAVE_PIDFD_OPEN)
+  return pidfd_open(pid, 0);
+#elif defined(SYS_pidfd_open)
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* create a pipe, whose ends are not inherited by programs we run */
+static int cloexec_pipe(int p[2])
+{
+#ifdef HAVE_PIPE2
+  return pipe2(p, O_CLOEXEC);
+#else
+  if (pipe(p) < 0)
+    return -1;
+  fcntl(p[0], F_SETFD, FD_CLOEXEC);
+  fcntl(p[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#endif
+}
+
+/* the GET of CLIENT being handled has to wait for the user.  Returns the
+   tag it is answered with later: a tagged GET is answered apart from the
+   requests after it, which are served meanwhile; otherwise the client
+   gets nothing more until it has its answer, and 0 is returned.  The GETs
+   of an MGET, GET_LARGEs and GET_FDs are always waited for. */
+static uint32_t wait_for_user(struct conn *client)
+{
+  if (client->tag && !client->mget && !client->large) {
+    client->pending++;
+    return client->tag;
+  }
+  client->busy = 1;
+  return 0;
+}
+
+/* answer the GET for ID of CLIENT, which has waited for the user - with
+   the secret if GRANTED.  TAG is what wait_for_user() returned. */
+static void answer_get(struct conn *client, uint32_t tag, const char *id,
+		       int granted)
+{
+  struct mget *m = client->mget;
+  uint32_t current = client->tag;
+  int version = client->version, large = client->large, byfd = client->byfd;
+
+  if (!tag) {
+    if (granted)
+      reply_secret(client, id);
+    else
+      send_get_reply(client, NULL);
+    resume_connection(client);
+    return;
+  }
+  /* this is no part of whatever the client is doing meanwhile */
+  client->mget = NULL;
+  client->version = 2;
+  client->tag = tag;
+  client->large = client->byfd = 0;
+  if (granted)
+    reply_secret(client, id);
+  else
+    send_get_reply(client, NULL);
+  client->mget = m;
+  client->version = version;
+  client->tag = current;
+  client->large = large;
+  client->byfd = byfd;
+  if (!--client->pending && client->hungup)
+    close_connection(client);
+  else
+    update_connection(client);
+}
+
+/* interpret the exit STATUS of the insure command.
+   Returns nonzero if the user agreed to hand out the secret. */
+static int insured(int status)
+{
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 1) {
+    fprintf(stderr, _("call of insure command failed\n"));
+    supported &= ~FLAGS_INSURE;
+    return 0;
+  }
+  return WEXITSTATUS(status) != 3;
+}
+
+/* the insure command has finished - answer the GET that waited for it */
+static void insurance_done(struct watch *w, int events)
+{
+  struct insurance *ins = (struct insurance *)w;
+  int status, granted = 0;
+
+  switch (waitpid(ins->pid, &status, WNOHANG)) {
+  case 0:
+    return;			/* still running */
+  case -1:
+    perror(_("could not wait for insure command"));
+    break;
+  default:
+    granted = insured(status);
+  }
+  unwatch_fd(w);
+  close(w->fd);
+  debugmsg("insurance for %s on channel %d: %s\n", ins->id,
+	   ins->client->w.fd, granted ? "granted" : "denied");
+  /* look it up again, the secret may have gone in the meantime */
+  answer_get(ins->client, ins->tag, ins->id, granted);
+  free(ins);
+}
+
+enum { INSURE_GRANTED, INSURE_DENIED, INSURE_PENDING };
+
+/* what to ask the user before the secret under ID, with COMMENT, is handed
+   out.  Returns NULL if out of memory. */
+static char *insure_question(const char *id, const char *comment)
+{
+  char *buf;
+  size_t len = strlen(comment);
+
+  if (asprintf(&buf, _("Hand out secret %s%s%s%s?"),
+	       id, len ? " (" : "", comment, len ? ")" : "") < 0)
+    return NULL;
+  return buf;
+}
+
+/* ask the user QUESTION, whether the secret under ID may be handed out to
+   CLIENT.  If the answer can be awaited in the main loop, INSURE_PENDING is
+   returned, and the reply will be sent by insurance_done(). */
+static int ask_insurance(struct conn *client, char *id, char *question)
+{
+  struct insurance *ins;
+  int pid, fd, status;
+
+  if ((pid = fork()) == 0) {
+#ifdef HAVE_GTK
+    execlp("secret-ask", "secret-ask", "bool", question, NULL);
+#endif
+#ifdef XMESSAGE
+    execl(XMESSAGE, "xmessage", "-nearmouse", "-default", "yes",
+	  "-buttons", "yes:2,no:3", question, NULL);
+#endif
+    perror(_("could not exec insure command"));
+    _exit(EXIT_FAILURE);
+  } else if (pid < 0) {
+    perror(_("could not fork"));
+    return INSURE_DENIED;
+  }
+  if ((fd = open_pidfd(pid)) >= 0) {
+    if ((ins = malloc(sizeof(struct insurance))) != NULL) {
+      init_watch(&ins->w, client->w.worker, fd, insurance_done);
+      ins->pid = pid;
+      ins->client = client;
+      strncpy(ins->id, id, ID_LENGTH);
+      ins->id[ID_LENGTH-1] = 0;
+      if (watch_fd(&ins->w, WATCH_READ) == 0) {
+	ins->tag = wait_for_user(client);
+	return INSURE_PENDING;
+      }
+      free(ins);
+    } else
+      fprintf(stderr, _("out of memory\n"));
+    close(fd);
+  }
+  /* cannot wait in the background - block until the user has decided */
+  if (waitpid(pid, &status, 0) < 0) {
+    perror(_("could not wait for insure command"));
+    return INSURE_DENIED;
+  }
+  return insured(status) ? INSURE_GRANTED : INSURE_DENIED;
+}
+
+/* the child has finished - collect its exit status */
+static void reaper_done(struct watch *w, int events)
+{
+  struct reaper *r = (struct reaper *)w;
+
+  if (waitpid(r->pid, NULL, WNOHANG) == 0)
+    return;
+  unwatch_fd(w);
+  close(w->fd);
+  free(r);
+}
+
+/* get rid of a child whose exit status is of no interest - if it is still
+   running, it is reaped from the main loop of WORKER once it exits */
+static void reap_child(struct worker *worker, pid_t pid)
+{
+  struct reaper *r;
+  int fd;
+
+  if (waitpid(pid, NULL, WNOHANG) != 0)
+    return;
+  if ((fd = open_pidfd(pid)) >= 0) {
+    if ((r = malloc(sizeof(struct reaper))) != NULL) {
+      init_watch(&r->w, worker, fd, reaper_done);
+      r->pid = pid;
+      if (watch_fd(&r->w, WATCH_READ) == 0)
+	return;
+      free(r);
+    }
+    close(fd);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+/* parse what the query program Q printed, and store the secret.
+   Returns nonzero if a secret was stored. */
+static int store_query_result(struct query *q)
+{
+  char *line, *next, *d;
+  time_t deadline = 0;
+  flags_t flags = 0;
+  struct shard *sh;
+  int stored;
+
+  q->out[q->len] = 0;
+  /* header lines, terminated by an empty one */
+  for (line = q->out; ; line = next) {
+    if ((next = strchr(line, '\n')) == NULL)
+      return 0;
+    *next++ = 0;
+    if (line[0] == 0)
+      break;
+    if ((d = strstr(line, ": ")) == NULL)
+      continue;
+    *d = 0;
+    d += 2;
+    debugmsg("keyword %s value %s\n", line, d);
+    if (strcmp(line, "Options") == 0) {
+      if (strcmp(d, "insure") == 0)
+	flags |= FLAGS_INSURE;
+    } else if (strcmp(line, "Timeout") == 0) {
+      deadline = strtoul(d, NULL, 10);
+      if (deadline)
+	deadline += time(NULL);
+    }
+  }
+  /* the secret itself */
+  if ((d = strchr(next, '\n')) != NULL)
+    *d = 0;
+  if (strlen(next) >= DATA_LENGTH)
+    next[DATA_LENGTH-1] = 0;
+  if (next[0] == 0)
+    return 0;
+  sh = cache_shard(q->id);
+  cache_write_lock(sh);
+  stored = cache_store(sh, q->id, flags, deadline, "", next) != NULL;
+  cache_unlock(sh);
+  return stored;
+}
+
+#ifdef USE_THREADS
+/* wake up the main loop of WORKER */
+static void kick_worker(struct worker *worker)
+{
+  if (write(worker->kick[1], "", 1) < 0 && errno != EAGAIN)
+    perror(_("could not wake up thread"));
+}
+#endif
+
+/* have the main loop of WORKER do J - right away, if it is our own */
+static void run_job(struct worker *worker, struct job *j)
+{
+#ifdef USE_THREADS
+  if (!pthread_equal(worker->thread, pthread_self())) {
+    LOCK(&worker->lock);
+    j->next = worker->jobs;
+    worker->jobs = j;
+    UNLOCK(&worker->lock);
+    kick_worker(worker);
+    return;
+  }
+#endif
+  j->run(j);
+}
+
+#ifdef USE_THREADS
+/* do what other threads have handed over to the worker of W */
+static void run_jobs(struct watch *w, int events)
+{
+  struct worker *worker = w->worker;
+  struct job *j, *next, *todo = NULL;
+  char buf[64];
+
+  while (read(w->fd, buf, sizeof(buf)) > 0)
+    ;
+  LOCK(&worker->lock);
+  j = worker->jobs;
+  worker->jobs = NULL;
+  UNLOCK(&worker->lock);
+  /* they have been handed over latest first */
+  for (; j; j = next) {
+    next = j->next;
+    j->next = todo;
+    todo = j;
+  }
+  for (j = todo; j; j = next) {
+    next = j->next;
+    j->run(j);
+  }
+}
+#endif
+
+/* answer a GET that waited for the query program */
+static void answer_waiter(struct job *j)
+{
+  struct waiter *w = (struct waiter *)j;
+
+  /* whoever waited has just been asked, so no insurance is needed */
+  answer_get(w->client, w->tag, w->id, w->found);
+  free(w);
+}
+
+/* the query program has closed its output - answer everyone waiting */
+static void finish_query(struct query *q)
+{
+  struct waiter *w, *next;
+  int found;
+
+  unwatch_fd(&q->w);
+  close(q->w.fd);
+  found = store_query_result(q);
+  /* GETs coming in from now on find the secret, or start a new query */
+  LOCK(&queries_lock);
+  g_hash_table_remove(queries, q->id);
+  UNLOCK(&queries_lock);
+  debugmsg("query for %s finished: %s\n", q->id, found ? "OK" : "FAIL");
+  for (w = q->waiters; w; w = next) {
+    next = w->next;
+    w->found = found;
+    run_job(w->client->w.worker, &w->j);
+  }
+  reap_child(q->w.worker, q->pid);
+  secmem_free(q->out);
+  free(q);
+}
+
+/* read output of the query program */
+static void query_output(struct watch *w, int events)
+{
+  struct query *q = (struct query *)w;
+  ssize_t n;
+
+  n = read(w->fd, q->out + q->len, QUERY_OUTPUT_LENGTH - q->len);
+  if (n < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return;
+    perror(_("error while reading from query program"));
+  } else if (n > 0 && (q->len += n) < QUERY_OUTPUT_LENGTH)
+    return;
+  finish_query(q);
+}
+
+/* run the query program for ID, and wait for its output in the main loop
+   of WORKER.  The caller must hold queries_lock. */
+static struct query *new_query(struct worker *worker, char *id)
+{
+  struct query *q;
+  char *buf;
+  int p[2];
+
+  if (!(q = malloc(sizeof(struct query)))) {
+    fprintf(stderr, _("out of memory\n"));
+    return NULL;
+  }
+  if (!(q->out = secmem_malloc(QUERY_OUTPUT_LENGTH + 1))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    free(q);
+    return NULL;
+  }
+  if (asprintf(&buf,
+	       _("%s %s -e 'Enter secret to store under \"%s\":'"),
+	       QUERY_PROGRAM, query_options, id) < 0) {
+    secmem_free(q->out);
+    free(q);
+    return NULL;
+  }
+  debugmsg("try calling '%s'\n", buf);
+  if (cloexec_pipe(p) < 0) {
+    perror(_("could not create pipe"));
+    goto failed;
+  }
+  if ((q->pid = fork()) == 0) {
+    xdup2(p[1], STDOUT_FILENO);
+    execl("/bin/sh", "sh", "-c", buf, NULL);
+    perror(_("could not exec query program"));
+    _exit(127);
+  }
+  close(p[1]);
+  if (q->pid < 0) {
+    perror(_("could not fork"));
+    close(p[0]);
+    goto failed;
+  }
+  fcntl(p[0], F_SETFL, fcntl(p[0], F_GETFL) | O_NONBLOCK);
+  init_watch(&q->w, worker, p[0], query_output);
+  strncpy(q->id, id, ID_LENGTH);
+  q->id[ID_LENGTH-1] = 0;
+  q->len = 0;
+  q->waiters = NULL;
+  if (watch_fd(&q->w, WATCH_READ) < 0) {
+    close(p[0]);
+    reap_child(worker, q->pid);
+    goto failed;
+  }
+  g_hash_table_insert(queries, q->id, q);
+  free(buf);
+  return q;
+
+ failed:
+  free(buf);
+  secmem_free(q->out);
+  free(q);
+  return NULL;
+}
+
+/* let the user enter the unknown secret ID, on behalf of CLIENT.
+   Only one query per id is run at any time: if one is already asking for
+   ID, CLIENT just waits for that one.  Returns -1 if no query could be
+   started, otherwise CLIENT will be replied to by finish_query(). */
+static int start_query(struct conn *client, char *id)
+{
+  struct query *q;
+  struct waiter *w;
+
+  if (!(w = malloc(sizeof(struct waiter)))) {
+    fprintf(stderr, _("out of memory\n"));
+    return -1;
+  }
+  w->j.run = answer_waiter;
+  w->client = client;
+  strncpy(w->id, id, ID_LENGTH);
+  w->id[ID_LENGTH-1] = 0;
+  LOCK(&queries_lock);
+  if ((q = g_hash_table_lookup(queries, id)) != NULL)
+    debugmsg("joining query for %s\n", id);
+  else if ((q = new_query(client->w.worker, id)) == NULL) {
+    UNLOCK(&queries_lock);
+    free(w);
+    return -1;
+  }
+  w->next = q->waiters;
+  q->waiters = w;
+  w->tag = wait_for_user(client);
+  UNLOCK(&queries_lock);
+  return 0;
+}
+
+/* fetch a secret by id */
+static void get_secret(struct conn *client, char *id)
+{
+  struct shard *sh = cache_shard(id);
+  struct value *rep;
+  char *question = NULL;
+  int status;
+
+  debugmsg("GET %s\n", id);
+  cache_read_lock(sh);
+  rep = cache_lookup(sh, id);
+  /* the client has it already */
+  if (rep && client->unless && cache_version(rep) == client->unless) {
+    debugmsg("reply: UNCHANGED\n");
+    send_status(client, STATUS_UNCHANGED);
+    cache_unlock(sh);
+    return;
+  }
+  /* known, but not to be had like this - send_get_reply() says so */
+  if (rep && (!(rep->flags & FLAGS_INSURE)
+	      || (rep->flags & FLAGS_LARGE && !client->large))) {
+    send_get_reply(client, rep);
+    cache_unlock(sh);
+    return;
+  }
+  /* the shard must not stay locked while the user is asked */
+  if (rep)
+    question = insure_question(id, rep->comment);
+  cache_unlock(sh);
+  if (!rep) {
+    /* the reply is sent once the user has answered */
+    if (x_enabled && start_query(client, id) == 0)
+      return;
+  } else if (question) {
+    status = ask_insurance(client, id, question);
+    free(question);
+    if (status == INSURE_PENDING)
+      return;
+    if (status == INSURE_GRANTED) {
+      reply_secret(client, id);
+      return;
+    }
+  }
+  send_get_reply(client, NULL);
+}
+
+/* the version named by the version 2 GET or DELETE H, whose id
+   request2_id() has found */
+static uint32_t request2_version(header2 *h)
+{
+  return ((request2_get *)(h + 1))->version;
+}
+
+/* the id a version 2 GET or DELETE asks for - NULL if it is malformed */
+static char *request2_id(header2 *h)
+{
+  char *p = (char *)(h + 1), *end = p + h->length;
+  char *id;
+
+  if (!(id = parse_id2(&p, end)) || p != end) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    return NULL;
+  }
+  return id;
+}
+
+void do_get(struct conn *client, request_get *req)
+{
+  if (memchr(req->id, 0, ID_LENGTH))
+    get_secret(client, req->id);
+  else
+    send_get_reply(client, NULL);
+}
+
+void do_get2(struct conn *client, header2 *h)
+{
+  char *id = request2_id(h);
+
+  /* longer ids cannot be known */
+  if (id && strlen(id) <= max_id) {
+    client->unless = request2_version(h);
+    get_secret(client, id);
+  } else
+    send_get_reply(client, NULL);
+}
+
+/* the pieces of the reply to the MGET M, which has been decided */
+struct mget_reply {
+  struct iovec iov[2 + 6 * MGET_IDS]; /* IOV[0] is left for the header */
+  reply2_mget rep;
+  reply2_mget_entry entries[MGET_IDS];
+  reply2_get bodies[MGET_IDS];
+};
+
+/* point the elements of R->iov at the reply to M, and return how many of
+   them are used.  The secrets go out straight from the cache, which has
+   to stay locked until they are sent. */
+static int mget_reply_iov(struct mget *m, struct mget_reply *r)
+{
+  struct iovec *v = r->iov + 2;
+  struct value *value;
+  unsigned i;
+
+  memset(&r->rep, 0, sizeof(r->rep));
+  r->rep.entries = m->count;
+  r->iov[1].iov_base = &r->rep;
+  r->iov[1].iov_len = sizeof(r->rep);
+  memset(r->entries, 0, sizeof(r->entries));
+  for (i = 0; i < m->count; i++) {
+    value = m->found[i] ? cache_lookup(cache_shard(m->ids[i]), m->ids[i])
+      : NULL;
+    /* stored with PUT_LARGE meanwhile */
+    if (value && value->flags & FLAGS_LARGE)
+      value = NULL;
+    if (value)
+      cache_renew(value);
+    debugmsg("MGET %s: %s\n", m->ids[i], value ? "OK" : "FAIL");
+    r->entries[i].status = value ? STATUS_OK : STATUS_FAIL;
+    v->iov_base = &r->entries[i];
+    v->iov_len = sizeof(r->entries[i]);
+    v++;
+    if (!value)
+      continue;
+    secret2_iov(v, &r->bodies[i], value);
+    v += 5;
+  }
+  return v - r->iov;
+}
+
+/* send the reply to the MGET of CLIENT, which has been decided */
+static void send_mget_reply(struct conn *client)
+{
+  struct mget_reply r;
+
+  cache_lock_all();
+  send_reply2(client, STATUS_OK, r.iov, mget_reply_iov(client->mget, &r), 1);
+  cache_unlock_all();
+}
+
+/* decide on the ids of the MGET of C, until one has to wait for the user -
+   then this is called again once the user has answered */
+static void mget_next(struct conn *c)
+{
+  struct mget *m = c->mget;
+
+  while (m->next < m->count) {
+    /* longer ids cannot be known */
+    if (strlen(m->ids[m->next]) > max_id) {
+      m->found[m->next++] = 0;
+      continue;
+    }
+    /* the answer is noted by send_get_reply() */
+    get_secret(c, m->ids[m->next]);
+    if (c->busy)
+      return;
+  }
+  send_mget_reply(c);
+  c->mget = NULL;
+  free(m);
+}
+
+/* the ids the version 2 MGET H asks for, copied to M.  Returns -1 if it
+   is malformed. */
+static int parse_mget2(header2 *h, struct mget *m)
+{
+  request2_mget *req = (request2_mget *)(h + 1);
+  char *p = (char *)(req + 1), *end = (char *)(h + 1) + h->length, *s;
+  unsigned i;
+
+  if (h->length < sizeof(request2_mget) || req->count > MGET_IDS
+      || end - p > MGET_LENGTH) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    return -1;
+  }
+  memcpy(m->buf, p, end - p);
+  p = m->buf;
+  end = m->buf + (end - (char *)(req + 1));
+  for (i = 0; i < req->count; i++) {
+    if (!(s = parse_id2(&p, end)))
+      break;
+    m->ids[i] = s;
+    m->found[i] = 0;
+  }
+  if (i < req->count || p != end) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    return -1;
+  }
+  m->count = req->count;
+  m->next = 0;
+  return 0;
+}
+
+/* fetch several secrets at once - the ones that are not known, or that
+   the user does not want to hand out, are marked as such, but do not fail
+   the others */
+void do_mget2(struct conn *client, header2 *h)
+{
+  struct mget *m;
+
+  if (!(m = malloc(sizeof(struct mget)))) {
+    fprintf(stderr, _("out of memory\n"));
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  if (parse_mget2(h, m) < 0) {
+    send_status(client, STATUS_FAIL);
+    free(m);
+    return;
+  }
+  client->mget = m;
+  mget_next(client);
+}
+
+#if defined(USE_DGRAM) || defined(USE_SHMRING)
+/* where the reply to a datagram, or to a request in a ring, goes */
+struct sender {
+  struct shm *shm;		/* the rings it came through, or NULL */
+  int fd;			/* the socket it came in on, otherwise */
+  struct sockaddr_un addr;	/* bound by the client */
+  socklen_t len;
+  uint32_t tag;			/* of the request */
+};
+
+/* what a datagram, or a request in a ring, asking for ID gets: STATUS_OK if the secret is at hand,
+   which is stored at *VALUE, STATUS_RETRY if the user would have to be
+   asked, which is left to a connection, and STATUS_FAIL otherwise.  The
+   shard of ID has to be locked. */
+static status_t at_hand(const char *id, struct value **value)
+{
+  struct value *rep;
+
+  /* longer ids cannot be known */
+  if (strlen(id) > max_id)
+    return STATUS_FAIL;
+  if (!(rep = cache_lookup(cache_shard(id), id)))
+    return x_enabled ? STATUS_RETRY : STATUS_FAIL;
+  /* only GET_LARGE hands those out */
+  if (rep->flags & FLAGS_LARGE)
+    return STATUS_FAIL;
+  if (rep->flags & FLAGS_INSURE)
+    return STATUS_RETRY;
+  *value = rep;
+  return STATUS_OK;
+}
+
+/* send TO a reply with STATUS, and the body in IOV[1] to IOV[N-1] - IOV[0]
+   is filled in with the header.  A body too long for a datagram, or for
+   a ring, is left out, and STATUS_RETRY sent instead. */
+static void send_fast(struct sender *to, status_t status, struct iovec *iov,
+		      int n)
+{
+  struct msghdr msg;
+  header2 h;
+  size_t len = 0;
+  int i;
+
+  for (i = 1; i < n; i++)
+    len += iov[i].iov_len;
+  if (sizeof(h) + len > (to->shm ? SHMRING_SIZE : DGRAM_SIZE)) {
+    status = STATUS_RETRY;
+    len = 0;
+    n = 1;
+  }
+  memset(&h, 0, sizeof(h));
+  h.magic = REPLY2_MAGIC;
+  h.type = status;
+  h.length = len;
+  h.tag = to->tag;
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+#ifdef USE_SHMRING
+  /* a client has a single request in the ring at a time, so the reply
+     fits, unless the client is up to no good */
+  if (to->shm) {
+    if (shmring_put(&to->shm->rings->replies, iov, n) < 0)
+      to->shm->broken = 1;
+    return;
+  }
+#endif
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &to->addr;
+  msg.msg_namelen = to->len;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  /* a client that does not take it gives up waiting, and connects */
+  while (sendmsg(to->fd, &msg, MSG_DONTWAIT) < 0)
+    if (errno != EINTR) {
+      debugmsg("datagram reply dropped: %s\n", strerror(errno));
+      break;
+    }
+}
+
+/* answer the version 2 GET H, which came from TO */
+static void get_fast(struct sender *to, header2 *h)
+{
+  struct iovec iov[6];
+  reply2_get body;
+  struct value *value;
+  struct shard *sh;
+  status_t status;
+  char *id;
+
+  if (!(id = request2_id(h))) {
+    send_fast(to, STATUS_FAIL, iov, 1);
+    return;
+  }
+  sh = cache_shard(id);
+  cache_read_lock(sh);
+  status = at_hand(id, &value);
+  if (status == STATUS_OK && request2_version(h)
+      && request2_version(h) == cache_version(value))
+    status = STATUS_UNCHANGED;
+  debugmsg("%s GET %s: %s\n", to->shm ? "ring" : "datagram", id,
+	   status == STATUS_OK ? "OK" : status == STATUS_RETRY ? "RETRY"
+	   : status == STATUS_UNCHANGED ? "UNCHANGED" : "FAIL");
+  if (status == STATUS_OK) {
+    cache_renew(value);
+    secret2_iov(iov + 1, &body, value);
+  }
+  /* the secret goes out straight from the cache */
+  send_fast(to, status, iov, status == STATUS_OK ? 6 : 1);
+  cache_unlock(sh);
+}
+
+/* answer the version 2 MGET H, which came from TO - if any of the
+   secrets is not at hand, it is all left to a connection */
+static void mget_fast(struct sender *to, header2 *h)
+{
+  struct mget m;
+  struct mget_reply r;
+  struct value *value;
+  status_t status;
+  unsigned i;
+
+  if (parse_mget2(h, &m) < 0) {
+    send_fast(to, STATUS_FAIL, r.iov, 1);
+    return;
+  }
+  cache_lock_all();
+  for (i = 0; i < m.count; i++) {
+    if ((status = at_hand(m.ids[i], &value)) == STATUS_RETRY)
+      break;
+    m.found[i] = status == STATUS_OK;
+  }
+  if (i < m.count)
+    send_fast(to, STATUS_RETRY, r.iov, 1);
+  else
+    send_fast(to, STATUS_OK, r.iov, mget_reply_iov(&m, &r));
+  cache_unlock_all();
+}
+
+#ifdef USE_SHMRING
+/* store the secret the version 2 PUT H asks for, which came from TO */
+static void put_fast(struct sender *to, header2 *h)
+{
+  char *p = (char *)(h + 1), *end = p + h->length;
+  struct iovec iov[2];
+  reply2_put body;
+  struct put2 put;
+  uint32_t version;
+  status_t status;
+
+  if (!parse_put2(&p, end, &put) || p != end) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    send_fast(to, STATUS_FAIL, iov, 1);
+    return;
+  }
+  if (!within_limits(put.req->idlen, put.req->commentlen,
+		     put.req->datalen)) {
+    fprintf(stderr, _("secret too large, not stored\n"));
+    send_fast(to, STATUS_FAIL, iov, 1);
+    return;
+  }
+  version = put.req->version;
+  status = store_secret(put.id, put.req->flags, put.req->deadline,
+			put.comment, put.data, &version);
+  send_fast(to, status, iov,
+	    status == STATUS_OK ? put2_iov(iov, &body, version) : 1);
+}
+#endif
+
+#ifdef USE_DGRAM
+/* answer the requests that came in on the SOCK_DGRAM socket of W - a
+   bunch at a time, so that a flood of them keeps nobody else waiting */
+static void serve_datagrams(struct watch *w, int events)
+{
+  union {
+    header2 h;
+    char buf[DGRAM_SIZE];
+  } req;
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(struct ucred))];
+  } control;
+  struct sender to;
+  struct ucred cred;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+  int i, known;
+
+  to.shm = NULL;
+  to.fd = w->fd;
+  for (i = 0; i < MAX_EVENTS; i++) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &to.addr;
+    msg.msg_namelen = sizeof(to.addr);
+    iov.iov_base = req.buf;
+    iov.iov_len = sizeof(req.buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    /* with MSG_TRUNC, the whole length of the datagram is returned */
+    if ((n = recvmsg(w->fd, &msg, MSG_DONTWAIT | MSG_TRUNC)) < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	perror(_("could not receive datagram"));
+      return;
+    }
+    to.len = msg.msg_namelen;
+    known = 0;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_CREDENTIALS) {
+	memcpy(&cred, CMSG_DATA(cm), sizeof(cred));
+	known = 1;
+      }
+    /* only our own user is served, and only if the reply can be sent */
+    if (!known || cred.uid != getuid()
+	|| to.len <= offsetof(struct sockaddr_un, sun_path)) {
+      debugmsg("datagram from a stranger ignored\n");
+      continue;
+    }
+    if (n < sizeof(header2) || req.h.magic != REQUEST2_MAGIC) {
+      fprintf(stderr, _("malformed message ignored\n"));
+      continue;
+    }
+    to.tag = req.h.tag;
+    if (n > sizeof(req.buf) || req.h.length != n - sizeof(header2)
+	|| req.h.flags) {
+      fprintf(stderr, _("malformed message ignored\n"));
+      send_fast(&to, STATUS_FAIL, &iov, 1);
+      continue;
+    }
+    switch (req.h.type) {
+    case REQ_GET:
+      get_fast(&to, &req.h);
+      break;
+    case REQ_MGET:
+      mget_fast(&to, &req.h);
+      break;
+    default:			/* anything else needs a connection */
+      send_fast(&to, STATUS_RETRY, &iov, 1);
+    }
+  }
+}
+#endif
+
+#ifdef USE_SHMRING
+/* serve the requests the client of the rings of S puts into them, until
+   they are closed - which this does itself, should the client mess them
+   up.  Runs in a thread of its own, which sleeps while there is nothing
+   to do. */
+static void *serve_rings(void *arg)
+{
+  struct shm *s = arg;
+  struct shmring *in = &s->rings->requests;
+  header2 *h = (header2 *)s->buf;
+  struct sender to;
+  struct iovec iov[1];
+  ssize_t used;
+
+  memset(&to, 0, sizeof(to));
+  to.shm = s;
+  while (!s->broken
+	 && !__atomic_load_n(&s->rings->closed, __ATOMIC_SEQ_CST)) {
+    if (!shmring_wait(in, &s->rings->closed, -1))
+      break;
+    /* nothing the client may change later is relied upon */
+    if ((used = shmring_used(in)) < (ssize_t)sizeof(header2)) {
+      s->broken = 1;
+      break;
+    }
+    shmring_copy(in, 0, h, sizeof(header2));
+    if (h->magic != REQUEST2_MAGIC || h->flags || h->length % 8
+	|| h->length > request_limit - sizeof(header2)
+	|| h->length > used - sizeof(header2)) {
+      fprintf(stderr, _("malformed message ignored\n"));
+      s->broken = 1;
+      break;
+    }
+    shmring_copy(in, sizeof(header2), h + 1, h->length);
+    shmring_consume(in, sizeof(header2) + h->length);
+    to.tag = h->tag;
+    switch (h->type) {
+    case REQ_GET:
+      get_fast(&to, h);
+      break;
+    case REQ_MGET:
+      mget_fast(&to, h);
+      break;
+    case REQ_PUT:
+      put_fast(&to, h);
+      break;
+    default:			/* anything else needs a connection */
+      send_fast(&to, STATUS_RETRY, iov, 1);
+    }
+    wipe(s->buf, sizeof(header2) + h->length);
+  }
+  if (s->broken)
+    debugmsg("rings messed up, closed\n");
+  /* the client goes on over its connection */
+  shmring_close(s->rings);
+  return NULL;
+}
+#endif
+#endif
+
+/* an operation of a TXN */
+struct txn_op {
+  int type;			/* REQ_PUT or REQ_DELETE */
+  char *id;
+  struct shard *sh;
+  struct secret *s;		/* what a PUT stores */
+  int expires;			/* it has a deadline */
+  uint32_t version;		/* the secret must have, or 0 */
+};
+
+static int compare_shards(const void *a, const void *b)
+{
+  const struct shard *x = *(struct shard **)a, *y = *(struct shard **)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* apply the N operations at OPS, whose secrets have been prepared, all
+   at once.  Returns STATUS_CONFLICT if a secret has not got the version
+   an operation names, or STATUS_FAIL if there is no room - and then
+   nothing is changed. */
+static status_t apply_txn(struct txn_op *ops, unsigned n)
+{
+  struct shard *shards[TXN_OPS];
+  unsigned i, j, nshards = 0, puts, expiring;
+  status_t ret = STATUS_OK;
+
+  /* the shards are locked in the same order as by cache_lock_all() */
+  for (i = 0; i < n; i++)
+    shards[i] = ops[i].sh;
+  qsort(shards, n, sizeof(struct shard *), compare_shards);
+  for (i = 0; i < n; i++)
+    if (!nshards || shards[i] != shards[nshards - 1])
+      shards[nshards++] = shards[i];
+  for (i = 0; i < nshards; i++)
+    cache_write_lock(shards[i]);
+  for (i = 0; i < n && ret == STATUS_OK; i++)
+    if (!cache_has_version(ops[i].sh, ops[i].id, ops[i].version)) {
+      debugmsg("%s not version %lu\n", ops[i].id,
+	       (unsigned long)ops[i].version);
+      ret = STATUS_CONFLICT;
+    }
+  for (i = 0; i < nshards && ret == STATUS_OK; i++) {
+    for (j = puts = expiring = 0; j < n; j++)
+      if (ops[j].sh == shards[i] && ops[j].type == REQ_PUT) {
+	puts++;
+	if (ops[j].expires)
+	  expiring++;
+      }
+    if (puts && cache_reserve(shards[i], puts, expiring) < 0)
+      ret = STATUS_FAIL;
+  }
+  if (ret == STATUS_OK)
+    for (i = 0; i < n; i++) {
+      if (ops[i].type == REQ_PUT) {
+	cache_insert(ops[i].sh, ops[i].s);
+	ops[i].s = NULL;
+      } else
+	cache_delete(ops[i].sh, ops[i].id);
+    }
+  for (i = nshards; i-- > 0; )
+    cache_unlock(shards[i]);
+  return ret;
+}
+
+/* store and delete several secrets at once - if any of it fails, nothing
+   is changed */
+void do_txn2(struct conn *client, header2 *h)
+{
+  request2_txn *req = (request2_txn *)(h + 1);
+  request2_op *op;
+  char *p = (char *)(req + 1), *end = (char *)(h + 1) + h->length;
+  struct txn_op ops[TXN_OPS];
+  struct put2 put;
+  status_t status = STATUS_FAIL;
+  unsigned i, n = 0;
+
+  if (h->length < sizeof(request2_txn) || req->count > TXN_OPS) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  debugmsg("TXN of %u\n", (unsigned)req->count);
+  /* all secrets are prepared first, so that storing them cannot fail
+     halfway */
+  for (n = 0; n < req->count; n++) {
+    op = (request2_op *)p;
+    if (end - p < sizeof(request2_op))
+      break;
+    p += sizeof(request2_op);
+    ops[n].type = op->type;
+    ops[n].s = NULL;
+    ops[n].expires = 0;
+    ops[n].version = 0;
+    if (op->type == REQ_PUT) {
+      if (!parse_put2(&p, end, &put))
+	break;
+      debugmsg("PUT %s, %lx, %ld, %s, %s\n", put.id, (long)put.req->flags,
+	       (long)put.req->deadline, put.comment, BLIND(put.data));
+      if (!within_limits(put.req->idlen, put.req->commentlen,
+			 put.req->datalen)
+	  || put.req->flags & ~supported
+	  || !(ops[n].s = cache_prepare(put.id, put.req->flags,
+					put.req->deadline, put.comment,
+					put.data))) {
+	p = NULL;
+	break;
+      }
+      ops[n].id = put.id;
+      ops[n].expires = put.req->deadline != 0;
+      ops[n].version = put.req->version;
+    } else if (op->type == REQ_DELETE) {
+      request2_get *del = (request2_get *)p;
+      if (!(ops[n].id = parse_id2(&p, end)))
+	break;
+      ops[n].version = del->version;
+      debugmsg("DELETE %s\n", ops[n].id);
+    } else
+      break;
+    ops[n].sh = cache_shard(ops[n].id);
+  }
+  if (n < req->count || p != end) {
+    if (p)
+      fprintf(stderr, _("malformed message ignored\n"));
+  } else
+    status = apply_txn(ops, n);
+  for (i = 0; i < n; i++)
+    if (ops[i].s)
+      cache_discard(ops[i].s);
+  send_status(client, status);
+}
+
+/* remove a secret by id, if it has VERSION */
+static void delete_secret(struct conn *client, const char *id,
+			  uint32_t version)
+{
+  struct shard *sh = cache_shard(id);
+  status_t status = STATUS_OK;
+
+  debugmsg("DELETE %s\n", id);
+  cache_write_lock(sh);
+  if (cache_has_version(sh, id, version))
+    cache_delete(sh, id);
+  else
+    status = STATUS_CONFLICT;
+  cache_unlock(sh);
+  send_status(client, status);
+}
+
+void do_delete(struct conn *client, request_get *req)
+{
+  if (memchr(req->id, 0, ID_LENGTH))
+    delete_secret(client, req->id, 0);
+  else
+    send_status(client, STATUS_FAIL);
+}
+
+void do_delete2(struct conn *client, header2 *h)
+{
+  char *id = request2_id(h);
+
+  if (id)
+    delete_secret(client, id, request2_version(h));
+  else
+    send_status(client, STATUS_FAIL);
+}
+
+void do_touch2(struct conn *client, header2 *h)
+{
+  request2_touch *req = (request2_touch *)(h + 1);
+  char *p = (char *)(req + 1), *end = (char *)(h + 1) + h->length;
+  struct shard *sh;
+  char *id;
+  int n;
+
+  if (h->length < sizeof(request2_touch)
+      || !(id = string2(&p, end, req->idlen)) || p != end) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  debugmsg("TOUCH %s%s, %ld, %lu\n", id,
+	   req->flags & TOUCH_PREFIX ? "*" : "", (long)req->deadline,
+	   (unsigned long)req->slide);
+  /* there is nothing to renew it from */
+  if (req->slide && !req->deadline) {
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  if (req->flags & TOUCH_PREFIX)
+    n = cache_touch_prefix(id, req->deadline, req->slide);
+  else if (req->idlen > max_id)
+    n = 0;
+  else {
+    sh = cache_shard(id);
+    cache_write_lock(sh);
+    n = cache_touch(sh, id, req->deadline, req->slide);
+    cache_unlock(sh);
+  }
+  send_status(client, n > 0 ? STATUS_OK : STATUS_FAIL);
+}
+
+void send_list_entry(const char *key, struct value *value, void *client)
+{
+  reply_list_entry rep;
+
+  memset(&rep, 0, sizeof(rep));
+  strncpy(rep.id, key, ID_LENGTH);
+  rep.flags = value->flags;
+  rep.deadline = value->deadline;
+  strncpy(rep.comment, value->comment, COMMENT_LENGTH);
+  debugmsg("sending entry %s\n", rep.id);
+  send_reply(client, &rep, sizeof(rep), 0);
+}
+
+/* list ids and comments of all known secrets */
+void do_list(struct conn *client)
+{
+  reply_list rep;
+
+  debugmsg("LIST\n");
+  rep.magic = REPLY_MAGIC;
+  rep.status = STATUS_OK;
+  /* a consistent picture: nothing is stored or deleted in the meantime */
+  cache_lock_all();
+  rep.entries = cache_size();
+  begin_parts(client);
+  send_reply(client, &rep, sizeof(rep), 0);
+  cache_foreach(send_list_entry, client);
+  end_parts(client);
+  cache_unlock_all();
+}
+
+/* add the size of the version 2 entry for a secret to *SIZE */
+static void measure_list_entry2(const char *key, struct value *value,
+			       void *size)
+{
+  *(size_t *)size += sizeof(reply2_list_entry) + STRING2_SIZE(strlen(key))
+    + STRING2_SIZE(value->commentlen);
+}
+
+static void send_list_entry2(const char *key, struct value *value,
+			     void *client)
+{
+  struct iovec iov[5];
+  reply2_list_entry rep;
+
+  memset(&rep, 0, sizeof(rep));
+  rep.deadline = value->deadline;
+  rep.flags = value->flags;
+  rep.idlen = strlen(key);
+  rep.commentlen = value->commentlen;
+  debugmsg("sending entry %s\n", key);
+  iov[0].iov_base = &rep;
+  iov[0].iov_len = sizeof(rep);
+  string2_iov(iov + 1, key, rep.idlen);
+  string2_iov(iov + 3, value->comment, rep.commentlen);
+  send_replyv(client, iov, 5, 0);
+}
+
+/* a secret to be listed by a paged LIST */
+struct list_match {
+  const char *id;
+  struct value *value;
+};
+
+/* the secrets a paged LIST has found so far */
+struct list_page {
+  const char *pattern;
+  int glob;
+  const char *after;		/* only ids after this one, if not NULL */
+  struct list_match *m;
+  unsigned n;
+};
+
+/* take the secret under KEY into the page at ARG, if it is wanted */
+static void match_list_entry(const char *key, struct value *value, void *arg)
+{
+  struct list_page *page = arg;
+
+  if ((page->after && strcmp(key, page->after) <= 0)
+      || !id_matches(key, page->pattern, page->glob))
+    return;
+  page->m[page->n].id = key;
+  page->m[page->n++].value = value;
+}
+
+static int compare_matches(const void *a, const void *b)
+{
+  return strcmp(((const struct list_match *)a)->id,
+		((const struct list_match *)b)->id);
+}
+
+/* list the secrets matching a pattern, in order, and a page at a time.
+   The cursor is simply the last id listed, so the next page starts after
+   it, whatever has changed in the meantime. */
+static void list_page2(struct conn *client, header2 *h)
+{
+  request2_list *req = (request2_list *)(h + 1);
+  char *p = (char *)(req + 1), *end = (char *)(h + 1) + h->length;
+  struct iovec iov[4];
+  struct list_page page;
+  header2 hdr;
+  reply2_list rep;
+  size_t size = sizeof(rep);
+  char *cursor;
+  unsigned i;
+
+  if (h->length < sizeof(request2_list)
+      || req->flags & ~(LIST_GLOB | LIST_CONTINUE)
+      || !(page.pattern = string2(&p, end, req->patternlen))
+      || !(cursor = string2(&p, end, req->cursorlen)) || p != end) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  debugmsg("LIST %s%s, %u after %s\n", page.pattern,
+	   req->flags & LIST_GLOB ? "" : "*", (unsigned)req->limit,
+	   req->flags & LIST_CONTINUE ? cursor : "the start");
+  page.glob = req->flags & LIST_GLOB;
+  page.after = req->flags & LIST_CONTINUE ? cursor : NULL;
+  page.n = 0;
+  cache_lock_all();
+  if (!(page.m = malloc((cache_size() + 1) * sizeof(struct list_match)))) {
+    cache_unlock_all();
+    fprintf(stderr, _("out of memory\n"));
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  cache_foreach(match_list_entry, &page);
+  qsort(page.m, page.n, sizeof(struct list_match), compare_matches);
+  memset(&rep, 0, sizeof(rep));
+  if (req->limit && page.n > req->limit) {
+    page.n = req->limit;
+    rep.more = 1;
+  }
+  rep.entries = page.n;
+  for (i = 0; i < page.n; i++)
+    measure_list_entry2(page.m[i].id, page.m[i].value, &size);
+  if (rep.more) {
+    rep.cursorlen = strlen(page.m[page.n - 1].id);
+    size += STRING2_SIZE(rep.cursorlen);
+  }
+  header2_init(client, &hdr, STATUS_OK, size);
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = &rep;
+  iov[1].iov_len = sizeof(rep);
+  begin_parts(client);
+  send_replyv(client, iov, 2, 0);
+  for (i = 0; i < page.n; i++)
+    send_list_entry2(page.m[i].id, page.m[i].value, client);
+  if (rep.more) {
+    string2_iov(iov, page.m[page.n - 1].id, rep.cursorlen);
+    send_replyv(client, iov, 2, 0);
+  }
+  end_parts(client);
+  cache_unlock_all();
+  free(page.m);
+}
+
+void do_list2(struct conn *client, header2 *h)
+{
+  struct iovec iov[2];
+  header2 hdr;
+  reply2_list rep;
+  size_t size = sizeof(rep);
+
+  if (h->length) {
+    list_page2(client, h);
+    return;
+  }
+  debugmsg("LIST\n");
+  cache_lock_all();
+  /* the header counts the entries, which are sent one by one after it */
+  cache_foreach(measure_list_entry2, &size);
+  header2_init(client, &hdr, STATUS_OK, size);
+  memset(&rep, 0, sizeof(rep));
+  rep.entries = cache_size();
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = &rep;
+  iov[1].iov_len = sizeof(rep);
+  begin_parts(client);
+  send_replyv(client, iov, 2, 0);
+  cache_foreach(send_list_entry2, client);
+  end_parts(client);
+  cache_unlock_all();
+}
+
+/* whether S watches the secret under ID */
+static int watched(struct subscription *s, const char *id)
+{
+  return s->prefix ? !strncmp(id, s->pattern, s->len)
+    : !strcmp(id, s->pattern);
+}
+
+/* tell the subscribers that WHAT has happened to the secret under ID,
+   which is VALUE - the cache calls this, in whichever thread changes the
+   secret.  The events are queued, and sent by the workers of the
+   subscribers. */
+static void secret_changed(int what, const char *id, struct value *value)
+{
+  struct subscription *s;
+  struct worker *worker, *wake = NULL;
+  struct event *e;
+  size_t len = strlen(id);
+
+  LOCK(&subscriptions_lock);
+  for (s = subscriptions; s; s = s->next) {
+    if (!watched(s, id))
+      continue;
+    if ((e = malloc(sizeof(struct event) + len)) != NULL) {
+      memset(&e->ev, 0, sizeof(e->ev));
+      e->ev.deadline = value->deadline;
+      e->ev.flags = value->flags;
+      e->ev.type = what;
+      e->ev.idlen = len;
+      memcpy(e->id, id, len + 1);
+      e->next = NULL;
+      *s->tail = e;
+      s->tail = &e->next;
+    } else
+      s->dropped = 1;
+    worker = s->client->w.worker;
+    if (!worker->notifying) {
+      worker->notifying = 1;
+      worker->next_notify = wake;
+      wake = worker;
+    }
+  }
+  UNLOCK(&subscriptions_lock);
+  for (; wake; wake = worker) {
+    worker = wake->next_notify;
+    run_job(wake, &wake->notify);
+  }
+}
+
+/* send EV, which is about the secret under ID, to the subscriber S */
+static void send_event(struct subscription *s, reply2_event *ev,
+		       const char *id)
+{
+  struct iovec iov[4];
+  header2 h;
+
+  header2_init(s->client, &h, STATUS_OK,
+	       sizeof(reply2_event) + STRING2_SIZE(ev->idlen));
+  h.flags = REPLY2_EVENT;
+  h.tag = s->tag;
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = ev;
+  iov[1].iov_len = sizeof(reply2_event);
+  string2_iov(iov + 2, id, ev->idlen);
+  send_replyv(s->client, iov, 4, 0);
+}
+
+/* send the events queued for S.  A client that does not read its replies
+   loses them, and is told so once. */
+static void send_events(struct subscription *s)
+{
+  struct conn *c = s->client;
+  struct event *e;
+  reply2_event lost;
+
+  for (; (e = s->events) != NULL; free(e)) {
+    s->events = e->next;
+    if (c->outlen >= output_limit)
+      s->dropped = 1;
+    else {
+      send_event(s, &e->ev, e->id);
+      s->lost = 0;
+    }
+  }
+  s->tail = &s->events;
+  if (s->dropped && !s->lost) {
+    memset(&lost, 0, sizeof(lost));
+    lost.type = EVENT_LOST;
+    send_event(s, &lost, "");
+    s->lost = 1;
+  }
+  s->dropped = 0;
+  update_connection(c);
+}
+
+/* send the events queued for the connections of the worker with the
+   notify job J */
+static void deliver_events(struct job *j)
+{
+  struct worker *worker =
+    (struct worker *)((char *)j - offsetof(struct worker, notify));
+  struct subscription *s;
+
+  LOCK(&subscriptions_lock);
+  worker->notifying = 0;
+  for (s = subscriptions; s; s = s->next)
+    if (s->client->w.worker == worker && (s->events || s->dropped))
+      send_events(s);
+  UNLOCK(&subscriptions_lock);
+}
+
+/* have C told about the secrets under PATTERN, of LEN bytes - or under
+   ids starting with it, if PREFIX - with TAG in the events.  Returns -1 if
+   that is not possible. */
+static int subscribe(struct conn *c, uint32_t tag, const char *pattern,
+		     size_t len, int prefix)
+{
+  struct subscription *s;
+  int err = 0;
+
+  if (!(s = malloc(sizeof(struct subscription) + len))) {
+    fprintf(stderr, _("out of memory\n"));
+    return -1;
+  }
+  s->client = c;
+  s->tag = tag;
+  s->prefix = prefix;
+  s->dropped = s->lost = 0;
+  s->events = NULL;
+  s->tail = &s->events;
+  s->len = len;
+  memcpy(s->pattern, pattern, len);
+  s->pattern[len] = 0;
+  LOCK(&subscriptions_lock);
+  if (c->watches < WATCH_LIMIT) {
+    s->next = subscriptions;
+    subscriptions = s;
+    c->watches++;
+  } else
+    err = -1;
+  UNLOCK(&subscriptions_lock);
+  if (err < 0)
+    free(s);
+  return err;
+}
+
+/* cancel the subscriptions of C with TAG - or all of them, if ALL.
+   Returns how many there were. */
+static unsigned unsubscribe(struct conn *c, uint32_t tag, int all)
+{
+  struct subscription **p, *s;
+  struct event *e;
+  unsigned n = 0;
+
+  if (!c->watches)
+    return 0;
+  LOCK(&subscriptions_lock);
+  for (p = &subscriptions; (s = *p) != NULL;) {
+    if (s->client != c || (!all && s->tag != tag)) {
+      p = &s->next;
+      continue;
+    }
+    *p = s->next;
+    while ((e = s->events) != NULL) {
+      s->events = e->next;
+      free(e);
+    }
+    free(s);
+    n++;
+  }
+  c->watches -= n;
+  UNLOCK(&subscriptions_lock);
+  return n;
+}
+
+/* whether C has a subscription with TAG */
+static int subscribed(struct conn *c, uint32_t tag)
+{
+  struct subscription *s;
+
+  if (!c->watches)
+    return 0;
+  LOCK(&subscriptions_lock);
+  for (s = subscriptions; s && (s->client != c || s->tag != tag);
+       s = s->next)
+    ;
+  UNLOCK(&subscriptions_lock);
+  return s != NULL;
+}
+
+void do_watch2(struct conn *client, header2 *h)
+{
+  request2_watch *req = (request2_watch *)(h + 1);
+  char *p = (char *)(req + 1), *end = (char *)(h + 1) + h->length;
+  char *pattern;
+
+  if (h->length < sizeof(request2_watch)
+      || !(pattern = string2(&p, end, req->patternlen)) || p != end) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  if (req->flags & WATCH_CANCEL) {
+    debugmsg("WATCH cancel %u\n", (unsigned)h->tag);
+    send_status(client, unsubscribe(client, h->tag, 0)
+		? STATUS_OK : STATUS_FAIL);
+    return;
+  }
+  debugmsg("WATCH %s%s\n", pattern, req->flags & WATCH_PREFIX ? "*" : "");
+  /* the events need a tag of their own, which no other reply has */
+  if (!h->tag || req->patternlen > max_id || subscribed(client, h->tag)
+      || subscribe(client, h->tag, pattern, req->patternlen,
+		   req->flags & WATCH_PREFIX) < 0) {
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  send_status(client, STATUS_OK);
+}
+
+#ifdef USE_THREADS
+/* block the signals that only the main thread is to get, and store the
+   mask there was before at OLD */
+static void block_signals(sigset_t *old)
+{
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, old);
+}
+#endif
+
+/* stop serving C through rings, if it is, and wait for their thread to
+   finish */
+static void close_shm(struct conn *c)
+{
+#ifdef USE_SHMRING
+  struct shm *s = c->shm;
+
+  if (!s)
+    return;
+  c->shm = NULL;
+  shmring_close(s->rings);
+  pthread_join(s->thread, NULL);
+  shmring_unmap(s->rings);
+  secmem_free(s->buf);
+  free(s);
+  LOCK(&shm_lock);
+  shm_count--;
+  UNLOCK(&shm_lock);
+#endif
+}
+
+#ifdef USE_SHMRING
+/* set up rings for C, and a thread serving them.  Returns the memfd
+   holding them, or -1 on errors. */
+static int open_shm(struct conn *c)
+{
+  struct shm *s;
+  sigset_t old;
+  int fd, err;
+
+  if (!(s = malloc(sizeof(struct shm)))) {
+    fprintf(stderr, _("out of memory\n"));
+    return -1;
+  }
+  s->broken = 0;
+  if (!(s->buf = secmem_malloc(request_limit))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    free(s);
+    return -1;
+  }
+  if (!(s->rings = shmring_create(&fd))) {
+    perror(_("could not set up rings in shared memory"));
+    secmem_free(s->buf);
+    free(s);
+    return -1;
+  }
+  block_signals(&old);
+  err = pthread_create(&s->thread, NULL, serve_rings, s);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err) {
+    fprintf(stderr, _("could not start thread: %s\n"), strerror(err));
+    shmring_unmap(s->rings);
+    close(fd);
+    secmem_free(s->buf);
+    free(s);
+    return -1;
+  }
+  c->shm = s;
+  return fd;
+}
+#endif
+
+/* serve the client through rings in shared memory from now on, as far as
+   they go, if that is possible */
+void do_shm2(struct conn *client, header2 *h)
+{
+#ifdef USE_SHMRING
+  struct iovec iov[1];
+  int fd, full;
+
+  if (h->length) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  /* the memfd goes with the first byte of the reply, so nothing may be
+     queued before it */
+  if (client->shm || client->outlen) {
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  LOCK(&shm_lock);
+  if (!(full = shm_count >= shm_rings))
+    shm_count++;
+  UNLOCK(&shm_lock);
+  if (full) {
+    debugmsg("SHM refused, %u clients have rings\n", shm_rings);
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  if ((fd = open_shm(client)) < 0) {
+    LOCK(&shm_lock);
+    shm_count--;
+    UNLOCK(&shm_lock);
+    send_status(client, STATUS_FAIL);
+    return;
+  }
+  debugmsg("SHM for channel %d\n", client->w.fd);
+  if (send_reply2_fd(client, iov, 1, fd) < 0) {
+    close_shm(client);
+    send_status(client, STATUS_FAIL);
+  }
+  close(fd);
+#else
+  send_status(client, STATUS_FAIL);
+#endif
+}
+
+/* set up W for watching FD in the main loop of WORKER, with READY as
+   handler */
+static void init_watch(struct watch *w, struct worker *worker, int fd,
+		       void (*ready)(struct watch *, int))
+{
+  w->fd = fd;
+  w->events = 0;
+  w->worker = worker;
+  w->ready = ready;
+}
+
+/* wait for the WATCH_* EVENTS on W from now on - 0 stops watching it */
+static int watch_fd(struct watch *w, int events)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  int op, old;
+
+  if (events == w->events)
+    return 0;
+  ev.events = (events & WATCH_READ ? EPOLLIN : 0)
+    | (events & WATCH_WRITE ? EPOLLOUT : 0);
+  ev.data.ptr = w;
+  op = !w->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+  old = w->events;
+  /* once added, W may be served by another thread right away */
+  w->events = events;
+  if (epoll_ctl(w->worker->epfd, op, w->fd, &ev) < 0) {
+    perror(_("could not watch file descriptor"));
+    w->events = old;
+    return -1;
+  }
+#else
+  if (w->fd >= FD_SETSIZE) {
+    fprintf(stderr, _("too many open connections\n"));
+    return -1;
+  }
+  FD_CLR(w->fd, &watched_r);
+  FD_CLR(w->fd, &watched_w);
+  if (events & WATCH_READ)
+    FD_SET(w->fd, &watched_r);
+  if (events & WATCH_WRITE)
+    FD_SET(w->fd, &watched_w);
+  watches[w->fd] = events ? w : NULL;
+  if (w->fd >= nfds)
+    nfds = w->fd + 1;
+  w->events = events;
+#endif
+  return 0;
+}
+
+/* stop waiting for W */
+static void unwatch_fd(struct watch *w)
+{
+  watch_fd(w, 0);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* dispatch_events() with epoll */
+static int dispatch_epoll(struct worker *worker, int timeout)
+{
+  struct epoll_event ev[MAX_EVENTS];
+  struct conn *c;
+  int i, n;
+
+  if ((n = epoll_wait(worker->epfd, ev, MAX_EVENTS, timeout)) < 0) {
+    if (errno == EINTR)
+      return 0;
+    perror(_("error in epoll_wait"));
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    struct watch *w = ev[i].data.ptr;
+    int events = 0;
+    /* let the handler find out about errors by reading or writing */
+    if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      events |= WATCH_READ;
+    if (ev[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      events |= WATCH_WRITE;
+    /* nothing, if a handler before has stopped watching W - or closed
+       the connection it belongs to */
+    if ((events &= w->events) != 0)
+      w->ready(w, events);
+  }
+  while ((c = worker->closed) != NULL) {
+    worker->closed = c->next_closed;
+    free(c);
+  }
+  return 0;
+}
+#endif
+
+/* wait at most TIMEOUT milliseconds (forever if negative) for descriptors
+   watched by WORKER to become ready, and call their handlers.
+   Returns -1 on fatal errors. */
+static int dispatch_events(struct worker *worker, int timeout)
+{
+#ifdef USE_IO_URING
+  if (worker->ring)
+    return dispatch_completions(worker, timeout);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+  return dispatch_epoll(worker, timeout);
+#else
+  struct timeval tv, *tvp = NULL;
+  fd_set ready_r, ready_w;
+  int fd, n;
+
+  if (timeout >= 0) {
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    tvp = &tv;
+  }
+  ready_r = watched_r;
+  ready_w = watched_w;
+  if ((n = select(nfds, &ready_r, &ready_w, NULL, tvp)) < 0) {
+    if (errno == EINTR)
+      return 0;
+    perror(_("error in select"));
+    return -1;
+  }
+  for (fd = 0; n > 0 && fd < nfds; fd++) {
+    int events = 0;
+    if (FD_ISSET(fd, &ready_r))
+      events |= WATCH_READ;
+    if (FD_ISSET(fd, &ready_w))
+      events |= WATCH_WRITE;
+    if (events) {
+      n -= (events & WATCH_READ) + (events & WATCH_WRITE ? 1 : 0);
+      if (watches[fd] && (events &= watches[fd]->events))
+	watches[fd]->ready(watches[fd], events);
+    }
+  }
+  return 0;
+#endif
+}
+
+/* whether further requests from C are handled right now.  Secure memory
+   is scarce, so a client that does not pick up its secrets gets nothing
+   more until it does.  Before a restart, requests are left to the
+   successor. */
+static int serving(struct conn *c)
+{
+  return !draining && !c->busy && !c->hungup && c->outlen < output_limit
+    && !c->outsecure;
+}
+
+/* whether C is to be read from - the data of a PUT_LARGE is taken in
+   even when no requests are */
+static int receiving(struct conn *c)
+{
+  return serving(c) || (c->upload && !c->hungup);
+}
+
+/* free a buffer of queued output */
+static void free_outbuf(struct conn *c, struct outbuf *o)
+{
+  cache_release(o->large);
+  if (o->secure) {
+    c->outsecure--;
+    secmem_free(o);
+  } else
+    free(o);
+}
+
+/* forget all output queued for C */
+static void drop_output(struct conn *c)
+{
+  struct outbuf *o;
+
+  while ((o = c->out) != NULL) {
+    c->out = o->next;
+    free_outbuf(c, o);
+  }
+  c->outtail = NULL;
+  c->outlen = 0;
+}
+
+/* append what the N elements of IOV hold to the output queue of C,
+   except for the first SKIP bytes.  Secrets (SECURE) are kept in secure
+   memory.  Nothing is appended to a buffer that ends a reply. */
+static int queue_outputv(struct conn *c, const struct iovec *iov, int n,
+			 size_t skip, int secure)
+{
+  struct outbuf *o = c->outtail;
+  size_t size, len = 0, part;
+  int i;
+
+  for (i = 0; i < n; i++)
+    len += iov[i].iov_len;
+  if (!(len -= skip))
+    return 0;
+
+  if (!o || o->secure != secure || o->size - o->end < len || o->last) {
+    size = secure || len > OUTBUF_SIZE ? len : OUTBUF_SIZE;
+    size += offsetof(struct outbuf, data);
+    if (!(o = secure ? secmem_malloc(size) : malloc(size)))
+      return -1;
+    o->next = NULL;
+    if ((o->secure = secure))
+      c->outsecure++;
+    o->size = size - offsetof(struct outbuf, data);
+    o->start = o->end = 0;
+    o->large = NULL;
+    o->last = 0;
+    if (c->outtail)
+      c->outtail->next = o;
+    else
+      c->out = o;
+    c->outtail = o;
+  }
+  for (i = 0; i < n; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    part = iov[i].iov_len - skip;
+    memcpy(o->data + o->end, (char *)iov[i].iov_base + skip, part);
+    o->end += part;
+    skip = 0;
+  }
+  c->outlen += len;
+  return 0;
+}
+
+/* append the data of L to the output queue of C, except for the first
+   SKIP bytes, without copying it.  Takes over the hold on L. */
+static int queue_large(struct conn *c, struct large *l, size_t skip)
+{
+  struct outbuf *o;
+
+  if (!(o = secmem_malloc(sizeof(struct outbuf))))
+    return -1;
+  o->next = NULL;
+  o->secure = 1;
+  c->outsecure++;
+  /* nothing can be appended */
+  o->size = o->end = l->len;
+  o->start = skip;
+  o->large = l;
+  o->last = 0;
+  if (c->outtail)
+    c->outtail->next = o;
+  else
+    c->out = o;
+  c->outtail = o;
+  c->outlen += l->len - skip;
+  return 0;
+}
+
+/* append LEN bytes at DATA to the output queue of C */
+static int queue_output(struct conn *c, const char *data, size_t len,
+			int secure)
+{
+  struct iovec iov;
+
+  iov.iov_base = (char *)data;
+  iov.iov_len = len;
+  return queue_outputv(c, &iov, 1, 0, secure);
+}
+
+/* complain about an error while writing to C, unless it just went away */
+static void write_error(struct conn *c)
+{
+  if (errno != EPIPE && errno != ECONNRESET)
+    perror(_("error while replying"));
+  else
+    debugmsg("channel %d went away\n", c->w.fd);
+}
+
+/* the first N bytes of the output queued for C have been sent */
+static void output_sent(struct conn *c, size_t n)
+{
+  struct outbuf *o;
+
+  c->outlen -= n;
+  while ((o = c->out) != NULL && n >= o->end - o->start) {
+    n -= o->end - o->start;
+    c->out = o->next;
+    free_outbuf(c, o);
+  }
+  if (o)
+    o->start += n;
+  else
+    c->outtail = NULL;
+}
+
+/* a reply to C has been queued, as a whole - on a SOCK_SEQPACKET socket,
+   it goes out in a message of its own */
+static void end_reply(struct conn *c)
+{
+  if (c->packet && c->outtail && !c->parts)
+    c->outtail->last = 1;
+}
+
+/* point the elements of IOV at what is to be sent next of the output
+   queued for C, and return how many there are.  On a SOCK_SEQPACKET
+   socket, that is the rest of a reply, or PACKET_SIZE bytes of it. */
+static int output_iov(struct conn *c, struct iovec *iov)
+{
+  struct outbuf *o;
+  size_t len = 0;
+  int i;
+
+  for (i = 0, o = c->out; o && i < OUTBUF_IOV; i++, o = o->next) {
+    iov[i].iov_base = OUTBUF_DATA(o) + o->start;
+    iov[i].iov_len = o->end - o->start;
+    if (c->packet) {
+      if (len + iov[i].iov_len >= PACKET_SIZE) {
+	iov[i].iov_len = PACKET_SIZE - len;
+	return i + 1;
+      }
+      len += iov[i].iov_len;
+      if (o->last)
+	return i + 1;
+    }
+  }
+  return i;
+}
+
+/* send as much of the queued output of C as the socket takes */
+static void flush_output(struct conn *c)
+{
+  struct iovec iov[OUTBUF_IOV];
+  ssize_t n;
+  int i;
+
+  while (c->out) {
+    i = output_iov(c, iov);
+    if ((n = writev(c->w.fd, iov, i)) < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return;
+      write_error(c);
+      drop_output(c);
+      return;
+    }
+    output_sent(c, n);
+  }
+}
+
+/* the replies sent to C, until end_parts(), are parts of a single one */
+static void begin_parts(struct conn *c)
+{
+  c->parts = c->packet;
+}
+
+static void end_parts(struct conn *c)
+{
+  c->parts = 0;
+  if (c->packet) {
+    end_reply(c);
+    if (!RING(c->w.worker))
+      flush_output(c);
+  }
+}
+
+/* send as much of what the N elements of IOV hold to client C, as it
+   takes right away.  Returns how many bytes that is, or -1 if the
+   connection failed.  Nothing is sent if replies are queued already, or
+   if the reply is to be split into messages. */
+static ssize_t send_now(struct conn *c, struct iovec *iov, int n, int secure)
+{
+  struct msghdr msg;
+  ssize_t sent = 0;
+  size_t len = 0;
+  int i;
+
+  if (c->packet)
+    for (i = 0; i < n; i++)
+      len += iov[i].iov_len;
+  if (!c->out && (secure || !RING(c->w.worker)) && !c->parts
+      && len <= PACKET_SIZE) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    /* the sockets served by a ring block */
+    while ((sent = sendmsg(c->w.fd, &msg, MSG_DONTWAIT)) < 0
+	   && errno == EINTR)
+      ;
+    if (sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	write_error(c);
+	return -1;
+      }
+      sent = 0;
+    }
+  }
+  return sent;
+}
+
+/* what is left of a reply to C could not be queued */
+static void queue_failed(struct conn *c)
+{
+  fprintf(stderr, _("could not queue reply on channel %d, hanging up\n"),
+	  c->w.fd);
+  /* a send in flight may still use the queue - then it goes when the
+     connection is closed */
+  if (!RING(c->w.worker))
+    drop_output(c);
+  shutdown(c->w.fd, SHUT_RDWR);
+}
+
+/* send what the N elements of IOV hold to client C - whatever cannot be
+   written right away is queued, and sent when the client is ready to
+   take it.  SECURE says whether the data contains secrets.  With
+   io_uring, other replies are always queued, and the ones that piled up
+   go out together - secrets are better not kept in scarce secure memory
+   for that. */
+static void send_replyv(struct conn *c, struct iovec *iov, int n, int secure)
+{
+  ssize_t sent;
+
+  if ((sent = send_now(c, iov, n, secure)) < 0)
+    return;
+  if (queue_outputv(c, iov, n, sent, secure) < 0)
+    queue_failed(c);
+  else
+    end_reply(c);
+}
+
+/* like send_reply2() with STATUS_OK and secrets, but IOV[I] holds the
+   data of L, which is queued by reference, rather than copied, if the
+   socket does not take it right away.  Takes over the hold on L. */
+static void send_reply2_large(struct conn *c, struct iovec *iov, int n,
+			      int i, struct large *l)
+{
+  header2 h;
+  size_t len = 0, before = 0, skip;
+  ssize_t sent;
+  int j;
+
+  for (j = 1; j < n; j++)
+    len += iov[j].iov_len;
+  header2_init(c, &h, STATUS_OK, len);
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  for (j = 0; j < i; j++)
+    before += iov[j].iov_len;
+  if ((sent = send_now(c, iov, n, 1)) < 0) {
+    cache_release(l);
+    return;
+  }
+  /* queue what is left of the parts before the data, the data, and the
+     parts after it */
+  skip = sent;
+  if (skip < before) {
+    if (queue_outputv(c, iov, i, skip, 1) < 0)
+      goto failed;
+    skip = 0;
+  } else
+    skip -= before;
+  if (skip < l->len) {
+    if (queue_large(c, l, skip) < 0)
+      goto failed;
+    skip = 0;
+  } else {
+    skip -= l->len;
+    cache_release(l);
+  }
+  l = NULL;
+  if (queue_outputv(c, iov + i + 1, n - i - 1, skip, 1) < 0)
+    goto failed;
+  end_reply(c);
+  return;
+
+ failed:
+  cache_release(l);
+  queue_failed(c);
+}
+
+/* send LEN bytes at DATA to client C */
+static void send_reply(struct conn *c, const void *data, size_t len,
+		       int secure)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  send_replyv(c, &iov, 1, secure);
+}
+
+/* wait for whatever C needs to go on */
+static void update_connection(struct conn *c)
+{
+#ifdef USE_IO_URING
+  struct worker *worker = c->w.worker;
+
+  /* the ring is told before the worker waits next */
+  if (worker->ring) {
+    if (!c->dirty) {
+      c->dirty = 1;
+      c->next_dirty = worker->dirty;
+      worker->dirty = c;
+    }
+    return;
+  }
+#endif
+  watch_fd(&c->w,
+	   (receiving(c) ? WATCH_READ : 0) | (c->out ? WATCH_WRITE : 0));
+}
+
+#ifdef USE_IO_URING
+static void arm_accept(struct worker *worker);
+#endif
+
+/* watch the server sockets for connections */
+static int watch_listeners()
+{
+  if (watch_fd(&listener, WATCH_READ) < 0
+      || (packetsock >= 0 && watch_fd(&packet_listener, WATCH_READ) < 0))
+    return -1;
+  return 0;
+}
+
+/* stop taking connections on the server sockets */
+static void unwatch_listeners()
+{
+  unwatch_fd(&listener);
+  if (packetsock >= 0)
+    unwatch_fd(&packet_listener);
+}
+
+/* add C to the connections of its worker.  Other threads may accept
+   connections for it, and the main thread walks all of them before a
+   restart. */
+static void link_connection(struct conn *c)
+{
+  struct worker *worker = c->w.worker;
+
+  LOCK(&worker->lock);
+  c->prev = NULL;
+  if ((c->next = worker->conns) != NULL)
+    c->next->prev = c;
+  worker->conns = c;
+  UNLOCK(&worker->lock);
+}
+
+/* remove C from the connections of its worker */
+static void unlink_connection(struct conn *c)
+{
+  struct worker *worker = c->w.worker;
+
+  LOCK(&worker->lock);
+  if (c->next)
+    c->next->prev = c->prev;
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    worker->conns = c->next;
+  UNLOCK(&worker->lock);
+}
+
+/* release a connection that is no longer watched */
+static void free_connection(struct conn *c)
+{
+#if defined(HAVE_SYS_EPOLL_H) || defined(USE_IO_URING)
+  struct worker *worker = c->w.worker;
+#endif
+
+  unlink_connection(c);
+  unsubscribe(c, 0, 1);
+  close_shm(c);
+  close(c->w.fd);
+  secmem_free(c->in);
+  drop_output(c);
+  free(c->mget);
+  if (c->upload) {
+    if (c->upload->s)
+      cache_discard(c->upload->s);
+    free(c->upload);
+  }
+#ifdef HAVE_SYS_EPOLL_H
+  /* C may be closed by the handler of another descriptor, such as that of
+     the insure command - an event for it may be yet to be dispatched */
+  if (!RING(worker)) {
+    c->next_closed = worker->closed;
+    worker->closed = c;
+  } else
+#endif
+    free(c);
+#ifdef USE_IO_URING
+  if (worker->ring) {
+    if (!draining)
+      arm_accept(worker);
+    return;
+  }
+#endif
+  LOCK(&accept_lock);
+  if (accept_paused && !draining && watch_listeners() == 0)
+    accept_paused = 0;
+  UNLOCK(&accept_lock);
+}
+
+/* hang up on a client */
+static void close_connection(struct conn *c)
+{
+  /* no one listens to events anymore, nor puts requests into rings */
+  unsubscribe(c, 0, 1);
+  close_shm(c);
+  /* GETs waiting for the user still refer to C, and the replies queued
+     for it still go out - a client may just have stopped sending.  Then
+     C's own handler has close_if_done() close it. */
+  if (c->pending || c->out) {
+    debugmsg("channel %d hung up, %d replies pending\n", c->w.fd,
+	     c->pending);
+    c->hungup = 1;
+    update_connection(c);
+    return;
+  }
+  debugmsg("closing channel %d\n", c->w.fd);
+#ifdef USE_IO_URING
+  if (c->w.worker->ring) {
+    /* the ring may still use C - have what is in flight finish early */
+    c->closing = 1;
+    if (c->ops)
+      shutdown(c->w.fd, SHUT_RDWR);
+    update_connection(c);
+    return;
+  }
+#endif
+  unwatch_fd(&c->w);
+  free_connection(c);
+}
+
+/* close C if it has hung up, and has got all of its replies.  Returns
+   nonzero if it has been closed. */
+static int close_if_done(struct conn *c)
+{
+  if (!c->hungup || c->pending || c->out)
+    return 0;
+  close_connection(c);
+  return 1;
+}
+
+/* how much of the PUT_LARGE at H, of which LEN bytes are there, is taken
+   as a request - the data after that is taken by receive_upload().
+   Returns 0 if that cannot be told yet, and -1 if it is malformed. */
+static ssize_t put_large_size(header2 *h, size_t len)
+{
+  request2_put *req = (request2_put *)(h + 1);
+  size_t size;
+
+  if (h->length < sizeof(request2_put)) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    return -1;
+  }
+  if (len < sizeof(header2) + sizeof(request2_put))
+    return 0;
+  size = sizeof(header2) + sizeof(request2_put) + STRING2_SIZE(req->idlen)
+    + STRING2_SIZE(req->commentlen);
+  /* there is at least one zero byte after the data */
+  if (size > request_limit || req->datalen >= h->length
+      || h->length != size - sizeof(header2) + STRING2_SIZE(req->datalen)) {
+    fprintf(stderr, _("malformed message ignored\n"));
+    return -1;
+  }
+  return size;
+}
+
+/* how many bytes the request at the start of BUF, of which LEN bytes are
+   there, takes.  Returns 0 if that cannot be told yet, and -1 if the
+   request is malformed. */
+static ssize_t request_size(char *buf, size_t len)
+{
+  request *r = (request *)buf;
+  header2 *h = (header2 *)buf;
+
+  if (len >= sizeof(h->magic) && h->magic == REQUEST2_MAGIC) {
+    if (len < sizeof(header2))
+      return 0;
+    /* bodies keep everything in them aligned */
+    if (h->flags || h->length % 8
+	|| (h->length > request_limit - sizeof(header2)
+	    && h->type != REQ_PUT_LARGE)) {
+      fprintf(stderr, _("malformed message ignored\n"));
+      return -1;
+    }
+    switch (h->type) {
+    case REQ_PUT_LARGE:
+      return put_large_size(h, len);
+    case REQ_PUT:
+    case REQ_GET:
+    case REQ_DELETE:
+    case REQ_LIST:
+    case REQ_MGET:
+    case REQ_TXN:
+    case REQ_GET_LARGE:
+    case REQ_WATCH:
+    case REQ_SHM:
+    case REQ_GET_FD:
+    case REQ_TOUCH:
+      return sizeof(header2) + h->length;
+    default:
+      fprintf(stderr, _("malformed message ignored\n"));
+      return -1;
+    }
+  }
+  if (len < sizeof(request))
+    return 0;
+  if (r->magic != REQUEST_MAGIC) {
+    fprintf(stderr, _("request with wrong magic number - "
+		      "maybe an old client?\n"));
+    return -1;
+  }
+  switch (r->type) {
+  case REQ_PUT:
+    return sizeof(request_put);
+  case REQ_GET:
+  case REQ_DELETE:
+    return sizeof(request_get);
+  case REQ_LIST:
+    return sizeof(request);
+  default:
+    fprintf(stderr, _("malformed message ignored\n"));
+    return -1;
+  }
+}
+
+/* hand a complete request to the right handler */
+static void handle_request(struct conn *c, char *req)
+{
+  header2 *h = (header2 *)req;
+
+  if (c->version == 2) {
+    switch (h->type) {
+    case REQ_PUT:
+      do_put2(c, h);
+      break;
+    case REQ_GET:
+      do_get2(c, h);
+      break;
+    case REQ_DELETE:
+      do_delete2(c, h);
+      break;
+    case REQ_LIST:
+      do_list2(c, h);
+      break;
+    case REQ_MGET:
+      do_mget2(c, h);
+      break;
+    case REQ_TXN:
+      do_txn2(c, h);
+      break;
+    case REQ_PUT_LARGE:
+      do_put_large(c, h);
+      break;
+    case REQ_GET_LARGE:		/* send_get_reply() knows */
+    case REQ_GET_FD:
+      do_get2(c, h);
+      break;
+    case REQ_WATCH:
+      do_watch2(c, h);
+      break;
+    case REQ_SHM:
+      do_shm2(c, h);
+      break;
+    case REQ_TOUCH:
+      do_touch2(c, h);
+      break;
+    }
+    return;
+  }
+  switch (((request *)req)->type) {
+  case REQ_PUT:
+    do_put(c, (request_put *)req);
+    break;
+  case REQ_GET:
+    do_get(c, (request_get *)req);
+    break;
+  case REQ_DELETE:
+    do_delete(c, (request_get *)req);
+    break;
+  case REQ_LIST:
+    do_list(c);
+    break;
+  case REQ_MGET:		/* refused by request_size() */
+  case REQ_TXN:
+  case REQ_PUT_LARGE:
+  case REQ_GET_LARGE:
+  case REQ_WATCH:
+  case REQ_SHM:
+  case REQ_GET_FD:
+  case REQ_TOUCH:
+    break;
+  }
+}
+
+/* handle the complete requests at the start of BUF, which holds *LEN bytes
+   received from C.  Handled requests are removed from BUF, and so is the
+   data of a PUT_LARGE.  Stops early if a reply is pending, since replies
+   have to go out in order, or if too much output is queued already. */
+static void handle_requests(struct conn *c, char *buf, size_t *len)
+{
+  ssize_t size;
+
+  for (;;) {
+    if (c->upload) {
+      if (!*len)
+	return;
+      size = receive_upload(c, buf, *len);
+    } else {
+      if (!serving(c) || (size = request_size(buf, *len)) == 0)
+	return;
+      /* reply in the version that was asked in */
+      c->unless = 0;
+      if (((request *)buf)->magic == REQUEST2_MAGIC) {
+	c->version = 2;
+	c->tag = ((header2 *)buf)->tag;
+	c->byfd = ((header2 *)buf)->type == REQ_GET_FD;
+	c->large = ((header2 *)buf)->type == REQ_GET_LARGE || c->byfd;
+      } else {
+	c->version = 1;
+	c->tag = 0;
+	c->large = c->byfd = 0;
+      }
+      if (size < 0) {
+	/* cannot tell where the next request starts - drop all of it */
+	send_status(c, STATUS_FAIL);
+	wipe(buf, *len);
+	*len = 0;
+	return;
+      }
+      if (size > *len)
+	return;			/* wait for the rest */
+      handle_request(c, buf);
+    }
+    /* move the next request to the start, where it is properly aligned */
+    *len -= size;
+    memmove(buf, buf + size, *len);
+  }
+}
+
+/* keep the LEN bytes at BUF that were received from C, but not handled */
+static void save_input(struct conn *c, char *buf, size_t len)
+{
+  if (len && !c->in) {
+    if (!(c->in = secmem_malloc(request_limit))) {
+      fprintf(stderr, _("could not allocate space in secure storage\n"));
+      /* there is no way to serve the rest, so hear nothing more */
+      shutdown(c->w.fd, SHUT_RD);
+      len = 0;
+    } else
+      memcpy(c->in, buf, len);
+  } else if (!len && c->in) {
+    secmem_free(c->in);
+    c->in = NULL;
+  }
+  c->inlen = len;
+}
+
+/* handle what C has sent earlier, but could not be served then */
+static void serve_saved_input(struct conn *c)
+{
+  size_t len = c->inlen;
+
+  if (c->in) {
+    handle_requests(c, c->in, &len);
+    save_input(c, c->in, len);
+  }
+}
+
+/* a pending reply has been sent - go on with the client's requests */
+static void resume_connection(struct conn *c)
+{
+  c->busy = 0;
+  if (c->mget)
+    mget_next(c);
+  serve_saved_input(c);
+  update_connection(c);
+}
+
+/* handle LEN bytes of requests at BUF, received from C, and keep what is
+   left over */
+static void got_requests(struct conn *c, char *buf, size_t len)
+{
+  debugmsg("read %d bytes on channel %d\n", len - c->inlen, c->w.fd);
+  handle_requests(c, buf, &len);
+  save_input(c, buf, len);
+}
+
+/* the data of the PUT_LARGE of C has been received up to N more bytes */
+static void uploaded(struct conn *c, size_t n)
+{
+  struct upload *u = c->upload;
+
+  if (u->data)
+    u->data += n;
+  u->left -= n;
+}
+
+/* read requests from a client, or notice that it hung up.  The data of a
+   PUT_LARGE is read straight to where it is stored, and what comes after
+   it as usual.  From a SOCK_SEQPACKET socket, a message is read at once,
+   or the connection is closed.  Returns -1 if the connection has been
+   closed. */
+static int read_requests(struct conn *c)
+{
+  char *buf = c->in ? c->in : c->w.worker->req;
+  size_t len = c->inlen, size = request_limit - len, direct = 0;
+  struct upload *u = c->upload;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t n;
+
+  /* a ring has no buffer of its own for SOCK_SEQPACKET sockets - the
+     message gets one until it has been handled */
+  if (!buf && !(buf = c->in = secmem_malloc(request_limit))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    close_connection(c);
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  if (u && u->left && u->data && !len) {
+    direct = u->left;
+    iov[0].iov_base = u->data;
+    iov[0].iov_len = direct;
+    msg.msg_iovlen = 2;
+  }
+  iov[msg.msg_iovlen - 1].iov_base = buf + len;
+  iov[msg.msg_iovlen - 1].iov_len = size;
+  /* with MSG_TRUNC, the whole length of a message is returned */
+  n = recvmsg(c->w.fd, &msg, MSG_DONTWAIT | (c->packet ? MSG_TRUNC : 0));
+  if (n > (ssize_t)(direct + size)) {
+    fprintf(stderr, _("oversized message on channel %d, hanging up\n"),
+	    c->w.fd);
+    wipe(buf + len, size);
+    n = -1;
+    errno = EMSGSIZE;
+  }
+  switch (n) {
+  case -1:
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+      save_input(c, buf, len);
+      return 0;
+    }
+    if (errno != EMSGSIZE)
+      perror(_("error while receiving"));
+				/* fall through */
+  case 0:			/* EOF */
+    if (len || u)
+      fprintf(stderr, _("incomplete request on channel %d dropped\n"),
+	      c->w.fd);
+    close_connection(c);
+    return -1;
+  default:
+    if (direct) {
+      uploaded(c, n < direct ? n : direct);
+      if ((size_t)n <= direct) {
+	save_input(c, buf, len);
+	return 0;
+      }
+      n -= direct;
+    }
+    got_requests(c, buf, len + n);
+    return 0;
+  }
+}
+
+/* talk to a client that is ready to receive replies or send requests */
+static void serve_client(struct watch *w, int events)
+{
+  struct conn *c = (struct conn *)w;
+
+  if (events & WATCH_WRITE) {
+    flush_output(c);
+    if (close_if_done(c))
+      return;
+    serve_saved_input(c);
+  }
+  if (events & WATCH_READ && receiving(c) && read_requests(c) < 0)
+    return;
+  update_connection(c);
+}
+
+/* serve the client on the new connection FD in the main loop of WORKER -
+   a SOCK_SEQPACKET socket if PACKET.  Returns NULL if that is not
+   possible, and FD has been closed. */
+static struct conn *new_connection(struct worker *worker, int fd, int packet)
+{
+  struct conn *c;
+
+  if (!(c = malloc(sizeof(struct conn)))) {
+    fprintf(stderr, _("out of memory\n"));
+    close(fd);
+    return NULL;
+  }
+  init_watch(&c->w, worker, fd, serve_client);
+  c->busy = c->pending = c->hungup = 0;
+  c->packet = packet;
+  c->parts = 0;
+  c->version = 1;
+  c->tag = 0;
+  c->mget = NULL;
+  c->large = c->byfd = 0;
+  c->unless = 0;
+  c->upload = NULL;
+  c->watches = 0;
+  c->shm = NULL;
+  c->in = NULL;
+  c->inlen = 0;
+  c->out = c->outtail = NULL;
+  c->outlen = 0;
+  c->outsecure = 0;
+#ifdef USE_IO_URING
+  c->ops = c->closing = c->dirty = c->direct = 0;
+#endif
+  /* before it is watched, since it may be freed right away then */
+  link_connection(c);
+  if (RING(worker))
+    update_connection(c);
+  else if (watch_fd(&c->w, WATCH_READ) < 0) {
+    unlink_connection(c);
+    close(fd);
+    free(c);
+    return NULL;
+  }
+  debugmsg("accepted channel %d for worker %u\n", fd,
+	   (unsigned)(worker - workers));
+  return c;
+}
+
+/* take all pending connections off the server socket */
+static void accept_connections(struct watch *l, int events)
+{
+  unsigned worker;
+  int newone;
+
+  while (1) {
+#ifdef HAVE_ACCEPT4
+    newone = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    if ((newone = accept(l->fd, NULL, NULL)) >= 0) {
+      fcntl(newone, F_SETFD, FD_CLOEXEC);
+      fcntl(newone, F_SETFL, fcntl(newone, F_GETFL) | O_NONBLOCK);
+    }
+#endif
+    if (newone < 0) {
+      switch (errno) {
+      case EINTR:
+      case ECONNABORTED:
+	continue;
+      case EMFILE:
+      case ENFILE:
+	/* try again once some connection has been closed */
+	fprintf(stderr, _("out of file descriptors, "
+			  "not accepting connections for now\n"));
+	LOCK(&accept_lock);
+	unwatch_listeners();
+	accept_paused = 1;
+	UNLOCK(&accept_lock);
+	return;
+      case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+	return;
+      default:
+	perror(_("could not accept connection"));
+	return;
+      }
+    }
+    /* the workers take turns */
+    worker = next_worker;
+    next_worker = (next_worker + 1) % nworkers;
+    new_connection(&workers[worker], newone, l == &packet_listener);
+  }
+}
+
+#ifdef USE_IO_URING
+/* the next entry of the ring of WORKER, for operation OP on P */
+static struct io_uring_sqe *ring_op(struct worker *worker, void *p, int op)
+{
+  struct io_uring_sqe *sqe;
+
+  if (!(sqe = uring_get_sqe(worker->ring))) {
+    perror(_("could not submit to io_uring"));
+    return NULL;
+  }
+  sqe->user_data = (uintptr_t)p | op;
+  return sqe;
+}
+
+/* have the ring of WORKER accept connections on the server sockets it
+   is not accepting on yet, until that fails */
+static void arm_accept(struct worker *worker)
+{
+  struct io_uring_sqe *sqe;
+  int which;
+
+  for (which = ACCEPT_STREAM; which <= ACCEPT_PACKET; which <<= 1) {
+    if (worker->accepting & which
+	|| (which == ACCEPT_PACKET && packetsock < 0)
+	|| !(sqe = ring_op(worker, worker, which == ACCEPT_STREAM
+			   ? OP_ACCEPT : OP_ACCEPT_PACKET)))
+      continue;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = which == ACCEPT_STREAM ? sock : packetsock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    /* nothing but the ring reads or writes, and it may block */
+    sqe->accept_flags = SOCK_CLOEXEC;
+    worker->accepting |= which;
+  }
+}
+
+/* have the ring of WORKER give up all operations in flight - they
+   complete with -ECANCELED */
+static void cancel_all(struct worker *worker)
+{
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = ring_op(worker, worker, OP_CANCEL)) != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  }
+}
+
+/* have the ring of WORKER tell when its epoll instance has news */
+static void arm_poll(struct worker *worker)
+{
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = ring_op(worker, worker, OP_POLL)) != NULL) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = worker->epfd;
+    sqe->poll32_events = POLLIN;
+  }
+}
+
+/* start receiving requests and sending replies on C, as far as it needs */
+static void start_io(struct conn *c)
+{
+  struct worker *worker = c->w.worker;
+  struct upload *u = c->upload;
+  struct io_uring_sqe *sqe;
+
+  if (receiving(c) && !(c->ops & OP_RECV)
+      && (sqe = ring_op(worker, c, OP_RECV)) != NULL) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->w.fd;
+    if (c->packet) {
+      /* a message has to be received whole, into a buffer that is only
+	 needed then - it is read as with epoll, once it is in */
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = POLLIN;
+      c->direct = 0;
+    }
+    /* the data of a PUT_LARGE goes straight to where it is stored */
+    else if ((c->direct = u && u->left && u->data && !c->inlen)) {
+      sqe->addr = (uintptr_t)u->data;
+      sqe->len = u->left;
+    } else {
+      sqe->len = request_limit - c->inlen;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = RECV_GROUP;
+    }
+    c->ops |= OP_RECV;
+  }
+  /* while draining, that is left to the successor */
+  if (c->out && !draining && !(c->ops & OP_SEND)
+      && (sqe = ring_op(worker, c, OP_SEND)) != NULL) {
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = output_iov(c, c->iov);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->w.fd;
+    sqe->addr = (uintptr_t)&c->msg;
+    sqe->len = 1;
+    c->ops |= OP_SEND;
+  }
+}
+
+/* start the I/O the connections of WORKER need now, and free those that
+   have been closed, once the ring is done with them.  While draining,
+   what is queued is left to the successor. */
+static void start_pending_io(struct worker *worker)
+{
+  struct conn *c;
+
+  while ((c = worker->dirty) != NULL) {
+    worker->dirty = c->next_dirty;
+    c->dirty = 0;
+    if (!c->closing) {
+      if (!draining || c->upload)
+	start_io(c);
+    }
+    else if (!c->ops)
+      free_connection(c);
+  }
+}
+
+/* RES bytes of requests have been received on C, into buffer FLAGS says */
+static void received(struct conn *c, int res, unsigned flags)
+{
+  struct uring *ring = c->w.worker->ring;
+  char *buf = NULL;
+  unsigned short id = 0;
+
+  c->ops &= ~OP_RECV;
+  if (flags & IORING_CQE_F_BUFFER) {
+    id = flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = uring_buffer(ring, id);
+  }
+  if (c->closing)
+    ;
+  else if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN
+	   || res == -ECANCELED)
+    ;				/* try again */
+  else if (c->packet) {
+    /* polled - a hangup, or an error, is noticed when reading */
+    if (receiving(c))
+      read_requests(c);
+  }
+  else if (res <= 0) {
+    if (res < 0) {
+      errno = -res;
+      perror(_("error while receiving"));
+    }
+    if (c->inlen || c->upload)
+      fprintf(stderr, _("incomplete request on channel %d dropped\n"),
+	      c->w.fd);
+    close_connection(c);
+  } else if (c->direct)
+    uploaded(c, res);
+  else if (c->in) {
+    /* no more was asked for than fits */
+    memcpy(c->in + c->inlen, buf, res);
+    got_requests(c, c->in, c->inlen + res);
+  } else
+    got_requests(c, buf, res);
+  if (buf)
+    uring_recycle(ring, id);
+  update_connection(c);
+}
+
+/* RES bytes of the queued replies have been sent on C */
+static void sent(struct conn *c, int res)
+{
+  c->ops &= ~OP_SEND;
+  if (res >= 0)
+    output_sent(c, res);
+  else if (res != -EINTR && res != -EAGAIN && res != -ECANCELED) {
+    if (!c->closing) {
+      errno = -res;
+      write_error(c);
+    }
+    drop_output(c);
+  }
+  if (!c->closing) {
+    if (close_if_done(c))
+      return;
+    serve_saved_input(c);
+  }
+  update_connection(c);
+}
+
+/* the ring of WORKER has accepted the connection RES, on the server socket
+   WHICH stands for */
+static void accepted(struct worker *worker, int res, unsigned flags,
+		     int which)
+{
+  if (!(flags & IORING_CQE_F_MORE))
+    worker->accepting &= ~which;
+  if (res >= 0)
+    new_connection(worker, res, which == ACCEPT_PACKET);
+  else if (res == -EMFILE || res == -ENFILE) {
+    /* try again once some connection has been closed */
+    fprintf(stderr, _("out of file descriptors, "
+		      "not accepting connections for now\n"));
+    return;
+  } else if (res != -ECONNABORTED && res != -EINTR && res != -ECANCELED) {
+    errno = -res;
+    perror(_("could not accept connection"));
+  }
+  if (!draining)
+    arm_accept(worker);
+}
+
+/* dispatch_events() with io_uring - the connections are served by the ring,
+   all other descriptors are watched by epoll, which the ring polls */
+static int dispatch_completions(struct worker *worker, int timeout)
+{
+  struct io_uring_cqe *cqe;
+  uint64_t data;
+  unsigned flags;
+  int res;
+
+  start_pending_io(worker);
+  if (uring_wait(worker->ring, timeout) < 0) {
+    perror(_("error in io_uring_enter"));
+    return -1;
+  }
+  while ((cqe = uring_peek(worker->ring)) != NULL) {
+    data = cqe->user_data;
+    res = cqe->res;
+    flags = cqe->flags;
+    uring_seen(worker->ring);
+    switch (data & OP_MASK) {
+    case OP_RECV:
+      received((struct conn *)(uintptr_t)(data & ~OP_MASK), res, flags);
+      break;
+    case OP_SEND:
+      sent((struct conn *)(uintptr_t)(data & ~OP_MASK), res);
+      break;
+    case OP_ACCEPT:
+      accepted(worker, res, flags, ACCEPT_STREAM);
+      break;
+    case OP_ACCEPT_PACKET:
+      accepted(worker, res, flags, ACCEPT_PACKET);
+      break;
+    case OP_POLL:
+      if (dispatch_epoll(worker, 0) < 0)
+	return -1;
+      arm_poll(worker);
+      break;
+    case OP_CANCEL:
+      break;
+    }
+  }
+  return 0;
+}
+
+/* set up a ring to serve the connections of WORKER.  Returns -1 if the
+   kernel is not up to it. */
+static int init_ring(struct worker *worker)
+{
+  if (!(worker->ring = uring_new(RING_ENTRIES)))
+    return -1;
+  if (!(worker->bufs = secmem_malloc(RECV_BUFFERS * RECV_BUFFER_SIZE))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    uring_free(worker->ring);
+    worker->ring = NULL;
+    return -1;
+  }
+  /* kernels with buffer rings also accept multishot */
+  if (uring_add_buffers(worker->ring, RECV_GROUP, worker->bufs,
+			RECV_BUFFERS, RECV_BUFFER_SIZE) < 0) {
+    secmem_free(worker->bufs);
+    uring_free(worker->ring);
+    worker->ring = NULL;
+    return -1;
+  }
+  worker->accepting = 0;
+  worker->dirty = NULL;
+  return 0;
+}
+
+/* give up the ring of WORKER */
+static void free_ring(struct worker *worker)
+{
+  uring_free(worker->ring);
+  secmem_free(worker->bufs);
+  worker->ring = NULL;
+}
+#endif
+
+/* use as many file descriptors as we are allowed to */
+static void raise_fd_limit()
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+      perror(_("could not raise file descriptor limit"));
+  }
+#endif
+}
+
+#ifdef USE_THREADS
+/* the main loop of a worker thread - serve connections the main thread has
+   accepted */
+static void *serve(void *arg)
+{
+  struct worker *worker = arg;
+
+  while (!worker->stopped)
+    if (dispatch_events(worker, -1) < 0) {
+      /* the agent cannot go on with some of its clients left hanging -
+	 have the main thread shut down, as if told so */
+      kill(getpid(), SIGTERM);
+      break;
+    }
+  return NULL;
+}
+
+/* finish the main loop of the worker that runs J */
+static void stop_worker(struct job *j)
+{
+  struct worker *worker;
+
+  worker = (struct worker *)((char *)j - offsetof(struct worker, stop));
+  worker->stopped = 1;
+}
+
+/* have the main thread look at the deadlines again */
+static void wake_main()
+{
+  if (!pthread_equal(workers[0].thread, pthread_self()))
+    kick_worker(workers);
+}
+
+/* start a thread for each worker but the first, which is run by the main
+   thread.  Only the main thread gets signals. */
+static int start_workers()
+{
+  sigset_t old;
+  unsigned i;
+  int err = 0;
+
+  workers[0].thread = pthread_self();
+  block_signals(&old);
+  for (i = 1; i < nworkers; i++)
+    if ((err = pthread_create(&workers[i].thread, NULL, serve,
+			      &workers[i])) != 0) {
+      fprintf(stderr, _("could not start thread: %s\n"), strerror(err));
+      nworkers = i;
+      break;
+    }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return err ? -1 : 0;
+}
+
+/* make all worker threads finish */
+static void stop_workers()
+{
+  unsigned i;
+
+  for (i = 1; i < nworkers; i++)
+    run_job(&workers[i], &workers[i].stop);
+  for (i = 1; i < nworkers; i++)
+    pthread_join(workers[i].thread, NULL);
+}
+#endif
+
+/* set up the main loop of WORKER */
+static int init_worker(struct worker *worker)
+{
+  /* a ring receives into buffers of its own */
+  if (!RING(worker) && !(worker->req = secmem_malloc(request_limit))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return -1;
+  }
+#ifdef HAVE_SYS_EPOLL_H
+  if ((worker->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror(_("could not create epoll instance"));
+    return -1;
+  }
+#endif
+#ifdef USE_IO_URING
+  if (worker->ring) {
+    arm_poll(worker);
+    arm_accept(worker);
+  }
+#endif
+  worker->notify.run = deliver_events;
+  worker->notifying = 0;
+#ifdef USE_THREADS
+  worker->jobs = NULL;
+  worker->stop.run = stop_worker;
+  worker->stopped = 0;
+  pthread_mutex_init(&worker->lock, NULL);
+  if (cloexec_pipe(worker->kick) < 0) {
+    perror(_("could not create pipe"));
+    return -1;
+  }
+  fcntl(worker->kick[0], F_SETFL, O_NONBLOCK);
+  fcntl(worker->kick[1], F_SETFL, O_NONBLOCK);
+  init_watch(&worker->kicked, worker, worker->kick[0], run_jobs);
+  if (watch_fd(&worker->kicked, WATCH_READ) < 0)
+    return -1;
+#endif
+  return 0;
+}
+
+/* what a successor is told first - followed by DIRLEN bytes of sockdir,
+   NAMELEN bytes of sockname, PACKETLEN bytes of packetname, DGRAMLEN bytes
+   of dgramname, a request_put and a handover_secret for each secret - and
+   the data of a large one - and the connections.  If
+   PACKET, packetsock is passed on after sock, and then dgramsock, if
+   DGRAM. */
+struct handover_header {
+  uint32_t magic;
+  uint32_t version;		/* given to a secret last */
+  unsigned secrets;
+  unsigned conns;
+  int packet, dgram;		/* the server sockets that come along */
+  size_t dirlen, namelen, packetlen, dgramlen;
+};
+
+/* what a successor is told about a secret, besides its request_put */
+struct handover_secret {
+  uint32_t version;
+  uint32_t slide;
+};
+
+/* what a successor is told about a connection - followed by INLEN bytes
+   of requests not handled yet, OUTBUFS queued replies, and WATCHES
+   subscriptions */
+struct handover_conn {
+  size_t inlen;
+  unsigned outbufs;
+  unsigned watches;
+  int packet;			/* a SOCK_SEQPACKET socket */
+};
+
+/* a queued reply, or part of one - followed by its LEN bytes */
+struct handover_output {
+  int secure;
+  int last;			/* ends the reply */
+  size_t len;
+};
+
+/* a subscription - followed by the LEN bytes of its pattern */
+struct handover_watch {
+  uint32_t tag;
+  int prefix;
+  size_t len;
+};
+
+/* what hand_over_secret() needs */
+struct secret_handover {
+  struct handover *h;
+  request_put *put;		/* scratch space, in secure memory */
+  int err;
+};
+
+/* whether nothing is in flight anymore that could not be handed over:
+   GETs waiting for the user, PUT_LARGEs still receiving their data,
+   events not sent yet, and operations of the rings */
+static int drained()
+{
+  struct subscription *s;
+  struct conn *c;
+  unsigned i;
+
+  for (s = subscriptions; s; s = s->next)
+    if (s->events || s->dropped)
+      return 0;
+  for (i = 0; i < nworkers; i++) {
+#ifdef USE_IO_URING
+    if (workers[i].ring) {
+      /* frees the connections the ring is done with */
+      start_pending_io(&workers[i]);
+      if (workers[i].accepting)
+	return 0;
+    }
+#endif
+    for (c = workers[i].conns; c; c = c->next) {
+      if (c->busy || c->pending || c->upload)
+	return 0;
+#ifdef USE_IO_URING
+      if (c->ops)
+	return 0;
+#endif
+    }
+  }
+  return 1;
+}
+
+/* serve all workers from the main thread, taking no new connections or
+   requests, until drained().  Returns -1 if that takes too long, or the
+   agent is to finish. */
+static int drain()
+{
+  time_t give_up = time(NULL) + DRAIN_TIMEOUT;
+  unsigned i;
+
+#ifdef USE_IO_URING
+  if (RING(workers)) {
+    for (i = 0; i < nworkers; i++)
+      cancel_all(&workers[i]);
+  } else
+#endif
+    unwatch_listeners();
+  while (!drained()) {
+    if (!keep_going)
+      return -1;
+    if (time(NULL) >= give_up) {
+      fprintf(stderr, _("replies still pending, giving up restart\n"));
+      return -1;
+    }
+    cache_expire();
+    for (i = 0; i < nworkers; i++)
+      if (dispatch_events(&workers[i], i ? 0 : DRAIN_WAIT) < 0)
+	return -1;
+  }
+  return 0;
+}
+
+/* go on serving after a restart has failed */
+static void undrain()
+{
+  struct conn *c;
+  unsigned i;
+
+  draining = 0;
+  for (i = 0; i < nworkers; i++) {
+    for (c = workers[i].conns; c; c = c->next)
+      update_connection(c);
+#ifdef USE_IO_URING
+    if (workers[i].ring)
+      arm_accept(&workers[i]);
+#endif
+  }
+  if (!RING(workers) && !accept_paused)
+    watch_listeners();
+}
+
+/* write the secret under ID to the handover in ARG.  The data of a large
+   one follows, after its length. */
+static void hand_over_secret(const char *id, struct value *value, void *arg)
+{
+  struct secret_handover *sh = arg;
+  request_put *put = sh->put;
+  struct handover_secret hs;
+  struct large *l;
+
+  memset(put, 0, sizeof(request_put));
+  put->magic = REQUEST_MAGIC;
+  put->type = REQ_PUT;
+  strncpy(put->id, id, ID_LENGTH - 1);
+  put->flags = value->flags;
+  put->deadline = value->deadline;
+  memcpy(put->comment, value->comment, value->commentlen);
+  memcpy(put->data, value->data, value->datalen);
+  hs.version = cache_version(value);
+  hs.slide = cache_slide(value);
+  if (handover_write(sh->h, put, sizeof(request_put)) < 0
+      || handover_write(sh->h, &hs, sizeof(hs)) < 0)
+    sh->err = -1;
+  if ((l = cache_hold(value)) != NULL) {
+    if (handover_write(sh->h, &l->len, sizeof(l->len)) < 0
+	|| handover_write(sh->h, l->data, l->len) < 0)
+      sh->err = -1;
+    cache_release(l);
+  }
+}
+
+/* write what the successor needs to serve C to H */
+static int hand_over_connection(struct handover *h, struct conn *c)
+{
+  struct handover_conn hc;
+  struct handover_output ho;
+  struct handover_watch hw;
+  struct subscription *s;
+  struct outbuf *o;
+
+  memset(&hc, 0, sizeof(hc));
+  hc.inlen = c->inlen;
+  hc.watches = c->watches;
+  hc.packet = c->packet;
+  for (o = c->out; o; o = o->next)
+    hc.outbufs++;
+  if (handover_write(h, &hc, sizeof(hc)) < 0
+      || handover_write(h, c->in, c->inlen) < 0)
+    return -1;
+  for (o = c->out; o; o = o->next) {
+    memset(&ho, 0, sizeof(ho));
+    ho.secure = o->secure;
+    ho.last = o->last;
+    ho.len = o->end - o->start;
+    if (handover_write(h, &ho, sizeof(ho)) < 0
+	|| handover_write(h, OUTBUF_DATA(o) + o->start, ho.len) < 0)
+      return -1;
+  }
+  for (s = subscriptions; s; s = s->next) {
+    if (s->client != c)
+      continue;
+    memset(&hw, 0, sizeof(hw));
+    hw.tag = s->tag;
+    hw.prefix = s->prefix;
+    hw.len = s->len;
+    if (handover_write(h, &hw, sizeof(hw)) < 0
+	|| handover_write(h, s->pattern, hw.len) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* hand the server socket, the secrets and the connections over to a new
+   agent binary, which takes our place and pid.  Only returns if that
+   fails. */
+static void hand_over()
+{
+  struct handover_header hdr;
+  struct secret_handover sh;
+  struct conn *c;
+  unsigned i, nfds = 1;
+  int *fds = NULL, sp[2] = { -1, -1 };
+  char env[32];
+
+  if (!(sh.h = handover_new())) {
+    perror(_("could not start handover"));
+    return;
+  }
+  sh.err = 0;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = HANDOVER_MAGIC;
+  /* drained() has freed all connections that were closed */
+  for (i = 0; i < nworkers; i++)
+    for (c = workers[i].conns; c; c = c->next)
+      hdr.conns++;
+  hdr.packet = packetsock >= 0;
+  hdr.dgram = dgramsock >= 0;
+  hdr.dirlen = sockdir ? strlen(sockdir) : 0;
+  hdr.namelen = sockname ? strlen(sockname) : 0;
+  hdr.packetlen = packetname ? strlen(packetname) : 0;
+  hdr.dgramlen = dgramname ? strlen(dgramname) : 0;
+  if (!(fds = malloc((hdr.conns + 3) * sizeof(int)))) {
+    fprintf(stderr, _("out of memory\n"));
+    goto failed;
+  }
+  fds[0] = sock;
+  if (hdr.packet)
+    fds[nfds++] = packetsock;
+  if (hdr.dgram)
+    fds[nfds++] = dgramsock;
+  if (!(sh.put = secmem_malloc(sizeof(request_put)))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    goto failed;
+  }
+  cache_lock_all();
+  hdr.secrets = cache_size();
+  hdr.version = cache_last_version();
+  if (handover_write(sh.h, &hdr, sizeof(hdr)) < 0
+      || handover_write(sh.h, sockdir, hdr.dirlen) < 0
+      || handover_write(sh.h, sockname, hdr.namelen) < 0
+      || handover_write(sh.h, packetname, hdr.packetlen) < 0
+      || handover_write(sh.h, dgramname, hdr.dgramlen) < 0)
+    sh.err = -1;
+  else
+    cache_foreach(hand_over_secret, &sh);
+  cache_unlock_all();
+  secmem_free(sh.put);
+  for (i = 0; i < nworkers; i++)
+    for (c = workers[i].conns; c && !sh.err; c = c->next) {
+      sh.err = hand_over_connection(sh.h, c);
+      fds[nfds++] = c->w.fd;
+    }
+  if (sh.err < 0) {
+    perror(_("could not write handover"));
+    goto failed;
+  }
+  /* the other end is left open for the successor */
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sp) < 0
+      || fcntl(sp[1], F_SETFD, 0) < 0) {
+    perror(_("could not create socket pair"));
+    goto failed;
+  }
+  if (handover_send(sh.h, sp[0], fds, nfds) < 0) {
+    perror(_("could not send handover"));
+    goto failed;
+  }
+  sprintf(env, "%d", sp[1]);
+  setenv(HANDOVER_ENV, env, 1);
+  /* the successor does not know about them */
+  cache_wipe_fds();
+  debugmsg("handing %u secrets and %u connections over to %s\n",
+	   hdr.secrets, hdr.conns, self_path ? self_path : self_argv[0]);
+  if (self_path)
+    execv(self_path, self_argv);
+  else
+    execvp(self_argv[0], self_argv);
+  perror(_("could not exec new agent"));
+  unsetenv(HANDOVER_ENV);
+
+ failed:
+  if (sp[0] >= 0) {
+    close(sp[0]);
+    close(sp[1]);
+  }
+  free(fds);
+  handover_free(sh.h);
+}
+
+#ifdef USE_SHMRING
+/* stop serving clients through rings - they go on over their
+   connections.  The worker threads have to be stopped. */
+static void close_all_shm()
+{
+  struct conn *c;
+  unsigned i;
+
+  for (i = 0; i < nworkers; i++)
+    for (c = workers[i].conns; c; c = c->next)
+      close_shm(c);
+}
+#endif
+
+/* hand over to a new agent binary, keeping clients waiting no longer than
+   it takes to answer the GETs still pending.  If that fails, go on
+   serving them. */
+static void hot_restart()
+{
+#ifdef USE_THREADS
+  unsigned i;
+#endif
+
+  debugmsg("restarting\n");
+#ifdef USE_THREADS
+  stop_workers();
+#endif
+#ifdef USE_SHMRING
+  /* the successor does not take them over */
+  close_all_shm();
+#endif
+  draining = 1;
+  if (drain() == 0)
+    hand_over();
+  undrain();
+#ifdef USE_THREADS
+  for (i = 1; i < nworkers; i++)
+    workers[i].stopped = 0;
+  if (start_workers() < 0)
+    keep_going = 0;
+#endif
+}
+
+/* a copy of the LEN bytes of H that come next, with a 0 appended */
+static char *read_string(struct handover *h, size_t len)
+{
+  char *s;
+
+  if (!(s = malloc(len + 1)))
+    return NULL;
+  if (handover_read(h, s, len) < 0) {
+    free(s);
+    return NULL;
+  }
+  s[len] = 0;
+  return s;
+}
+
+/* take over the server sockets from the predecessor that hands over on
+   FD.  The secrets and connections are left for resume() in what is
+   returned, and counted in HDR - the descriptors of the connections are
+   stored at *FDS, after the server sockets.  Returns NULL on errors. */
+static struct handover *take_over(int fd, struct handover_header *hdr,
+				  int **fds)
+{
+  struct handover *h;
+  unsigned nfds, i, n;
+
+  h = handover_receive(fd, fds, &nfds);
+  close(fd);
+  if (!h) {
+    perror(_("could not receive handover"));
+    return NULL;
+  }
+  if (handover_read(h, hdr, sizeof(*hdr)) < 0
+      || hdr->magic != HANDOVER_MAGIC
+      || nfds != hdr->conns + 1 + !!hdr->packet + !!hdr->dgram) {
+    fprintf(stderr, _("handover not understood\n"));
+    for (i = 0; i < nfds; i++)
+      close((*fds)[i]);
+    goto failed;
+  }
+  /* from here on, the connections are closed when we exit */
+  sock = (*fds)[0];
+  n = 1;
+  if (hdr->packet)
+    packetsock = (*fds)[n++];
+  if (hdr->dgram)
+    dgramsock = (*fds)[n++];
+  if (set_socket_flags(sock) < 0
+      || (packetsock >= 0 && set_socket_flags(packetsock) < 0)
+      || (dgramsock >= 0 && set_socket_flags(dgramsock) < 0))
+    goto failed;
+  if ((hdr->dirlen && !(sockdir = read_string(h, hdr->dirlen)))
+      || (hdr->namelen && !(sockname = read_string(h, hdr->namelen)))
+      || (hdr->packetlen
+	  && !(packetname = read_string(h, hdr->packetlen)))
+      || (hdr->dgramlen && !(dgramname = read_string(h, hdr->dgramlen)))) {
+    perror(_("could not read handover"));
+    goto failed;
+  }
+  return h;
+
+ failed:
+  free(*fds);
+  handover_free(h);
+  return NULL;
+}
+
+/* store the secret S, which had what HS tells, in SH - unless there is
+   no room for it */
+static void resume_secret(struct shard *sh, struct secret *s,
+			  struct handover_secret *hs)
+{
+  cache_keep_version(s, hs->version);
+  cache_write_lock(sh);
+  if (cache_reserve(sh, 1, cache_value(s)->deadline != 0) < 0)
+    cache_discard(s);
+  else {
+    cache_insert(sh, s);
+    /* it has the deadline already, and needs no more room */
+    if (hs->slide)
+      cache_touch(sh, cache_id(s), cache_value(s)->deadline, hs->slide);
+  }
+  cache_unlock(sh);
+}
+
+/* store the large secret PUT, which had what HS tells, and whose data
+   comes next in H, in SH.  If there is no room for it, it is skipped.
+   Returns -1 if H ends early. */
+static int resume_large(struct handover *h, struct shard *sh,
+			request_put *put, struct handover_secret *hs)
+{
+  struct secret *s;
+  char *data;
+  size_t len, n;
+
+  if (handover_read(h, &len, sizeof(len)) < 0)
+    return -1;
+  if (!(s = cache_prepare_large(put->id, put->flags, put->deadline,
+				put->comment, len, &data))) {
+    /* the rest of PUT is not needed anymore */
+    for (; len; len -= n) {
+      n = len < sizeof(put->data) ? len : sizeof(put->data);
+      if (handover_read(h, put->data, n) < 0)
+	return -1;
+    }
+    return 0;
+  }
+  if (handover_read(h, data, len) < 0) {
+    cache_discard(s);
+    return -1;
+  }
+  resume_secret(sh, s, hs);
+  return 0;
+}
+
+/* store the secrets in H, and serve the connections with the descriptors
+   at FDS as they were left by the predecessor.  HDR counts them. */
+static int resume(struct handover *h, struct handover_header *hdr, int *fds)
+{
+  struct handover_conn hc;
+  struct handover_output ho;
+  struct handover_watch hw;
+  struct worker *worker;
+  struct shard *sh;
+  struct conn *c;
+  request_put *put;
+  struct handover_secret hs;
+  struct secret *s;
+  char *buf;
+  size_t len;
+  unsigned i, j;
+  int flags, queued;
+
+  /* room for a secret, and for a request */
+  if (!(buf = secmem_malloc(request_limit))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return -1;
+  }
+  put = (request_put *)buf;
+  for (i = 0; i < hdr->secrets; i++) {
+    if (handover_read(h, put, sizeof(request_put)) < 0
+	|| handover_read(h, &hs, sizeof(hs)) < 0) {
+      perror(_("could not read handover"));
+      secmem_free(buf);
+      return -1;
+    }
+    put->id[ID_LENGTH-1] = 0;
+    put->comment[COMMENT_LENGTH-1] = 0;
+    put->data[DATA_LENGTH-1] = 0;
+    sh = cache_shard(put->id);
+    if (put->flags & FLAGS_LARGE) {
+      if (resume_large(h, sh, put, &hs) < 0) {
+	perror(_("could not read handover"));
+	secmem_free(buf);
+	return -1;
+      }
+      continue;
+    }
+    if ((s = cache_prepare(put->id, put->flags, put->deadline, put->comment,
+			   put->data)))
+      resume_secret(sh, s, &hs);
+  }
+  cache_resume_versions(hdr->version);
+  for (i = 0; i < hdr->conns; i++) {
+    /* the workers take turns */
+    worker = &workers[next_worker];
+    next_worker = (next_worker + 1) % nworkers;
+    /* the sockets served by a ring block */
+    flags = fcntl(fds[i], F_GETFL);
+    fcntl(fds[i], F_SETFL,
+	  RING(worker) ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+    if (handover_read(h, &hc, sizeof(hc)) < 0) {
+      close(fds[i]);
+      goto failed;
+    }
+    /* what was handed over has to be read anyway */
+    c = new_connection(worker, fds[i], hc.packet);
+    if (hc.inlen > request_limit || handover_read(h, buf, hc.inlen) < 0)
+      goto failed;
+    if (c)
+      save_input(c, buf, hc.inlen);
+    for (j = 0, queued = c != NULL; j < hc.outbufs; j++) {
+      if (handover_read(h, &ho, sizeof(ho)) < 0)
+	goto failed;
+      for (; ho.len; ho.len -= len) {
+	len = ho.len < request_limit ? ho.len : request_limit;
+	if (handover_read(h, buf, len) < 0)
+	  goto failed;
+	if (queued && queue_output(c, buf, len, ho.secure) < 0) {
+	  fprintf(stderr,
+		  _("could not queue reply on channel %d, hanging up\n"),
+		  c->w.fd);
+	  drop_output(c);
+	  shutdown(c->w.fd, SHUT_RDWR);
+	  queued = 0;
+	}
+      }
+      if (queued && ho.last)
+	end_reply(c);
+    }
+    for (j = 0; j < hc.watches; j++) {
+      if (handover_read(h, &hw, sizeof(hw)) < 0 || hw.len >= request_limit
+	  || handover_read(h, buf, hw.len) < 0)
+	goto failed;
+      if (c)
+	subscribe(c, hw.tag, buf, hw.len, hw.prefix);
+    }
+    if (c) {
+      serve_saved_input(c);
+      update_connection(c);
+    }
+  }
+  secmem_free(buf);
+  debugmsg("took over %u secrets and %u connections\n", hdr->secrets,
+	   hdr->conns);
+  return 0;
+
+ failed:
+  perror(_("could not read handover"));
+  while (++i < hdr->conns)
+    close(fds[i]);
+  secmem_free(buf);
+  return -1;
+}
+
+#define HANDLE(signal) if (sigaction(signal, &sa, NULL) < 0) { \
+			 fprintf(stderr, \
+				 _("could not install %s handler: %s\n"), \
+				 #signal, strerror(errno)); \
+			 return; \
+		       }
+
+/* the main loop - accept connections, serve requests, protect the innocent */
+static void agent()
+{
+  struct sigaction sa;
+  struct handover_header hdr;
+  struct handover *h = NULL;
+  int *fds = NULL, resumed;
+  unsigned i;
+
+  sa.sa_handler = exit_gracefully;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  HANDLE(SIGTERM);
+  HANDLE(SIGINT);
+  HANDLE(SIGHUP);
+  sa.sa_handler = restart_gracefully;
+  HANDLE(SIGUSR2);
+  sa.sa_handler = SIG_IGN;
+  HANDLE(SIGPIPE);
+  queries = g_hash_table_new(g_str_hash, g_str_equal);
+#ifdef USE_THREADS
+  if (cache_init(nworkers > 1 ? CACHE_SHARDS : 1, wake_main,
+		 secret_changed) < 0)
+    return;
+#else
+  if (cache_init(1, NULL, secret_changed) < 0)
+    return;
+#endif
+  if (!(workers = calloc(nworkers, sizeof(struct worker)))) {
+    fprintf(stderr, _("out of memory\n"));
+    return;
+  }
+  raise_fd_limit();
+  /* the workers need the server socket */
+  if (handover_fd >= 0 && !(h = take_over(handover_fd, &hdr, &fds)))
+    return;
+#ifndef HAVE_SYS_EPOLL_H
+  FD_ZERO(&watched_r);
+  FD_ZERO(&watched_w);
+#endif
+#ifdef USE_IO_URING
+  /* all workers get a ring, or none */
+  for (i = 0; i < nworkers; i++)
+    if (init_ring(&workers[i]) < 0) {
+      debugmsg("io_uring not available, falling back on epoll\n");
+      while (i-- > 0)
+	free_ring(&workers[i]);
+      break;
+    }
+#endif
+  for (i = 0; i < nworkers; i++)
+    if (init_worker(&workers[i]) < 0)
+      return;
+  init_watch(&listener, workers, sock, accept_connections);
+  init_watch(&packet_listener, workers, packetsock, accept_connections);
+  /* a ring accepts connections itself */
+  if (!RING(workers) && watch_listeners() < 0)
+    return;
+#ifdef USE_DGRAM
+  init_watch(&datagrams, workers, dgramsock, serve_datagrams);
+  if (dgramsock >= 0 && watch_fd(&datagrams, WATCH_READ) < 0)
+    return;
+#endif
+  if (h) {
+    resumed = resume(h, &hdr, fds + 1 + !!hdr.packet + !!hdr.dgram);
+    handover_free(h);
+    free(fds);
+    if (resumed < 0)
+      return;
+  }
+#ifdef USE_THREADS
+  if (start_workers() < 0)
+    keep_going = 0;
+#endif
+  while (keep_going) {
+    int timeout = -1;
+    time_t deadline;
+
+    if (restart_wanted) {
+      restart_wanted = 0;
+      hot_restart();
+      continue;
+    }
+    if ((deadline = cache_expire())) {
+      struct timeval now;
+      long long t;
+      /* wake up as soon as the deadline has passed */
+      gettimeofday(&now, NULL);
+      t = (long long)(deadline + 1 - now.tv_sec) * 1000 - now.tv_usec / 1000;
+      timeout = t < 0 ? 0 : t > INT_MAX ? INT_MAX : t;
+    }
+    if (dispatch_events(workers, timeout) < 0)
+      break;
+  }
+#ifdef USE_THREADS
+  stop_workers();
+#endif
+#ifdef USE_SHMRING
+  close_all_shm();
+#endif
+  for (i = 0; i < nworkers; i++) {
+#ifdef USE_IO_URING
+    if (workers[i].ring)
+      free_ring(&workers[i]);
+#endif
+    secmem_free(workers[i].req);
+  }
+}
+
+/* the limit on a length OPTARG asks for, which must not be above
+   CAPACITY */
+static size_t parse_limit(const char *optarg, size_t capacity)
+{
+  char *err;
+  unsigned long n = strtoul(optarg, &err, 10);
+
+  if (*err || !*optarg || n > capacity) {
+    fprintf(stderr, _("%s: invalid length limit - at most %lu is possible\n"),
+	    optarg, (unsigned long)capacity);
+    exit(EXIT_FAILURE);
+  }
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  int fd, opt, opt_help = 0, opt_version = 0, opt_fork = 0;
+  char *setenv = SETENV_SH, *handover;
+  size_t size, reserved;
+  size_t secure_memory = 1;	/* 1 is too small, so default size is used */
+  struct option opts[] = { { "csh",	no_argument, NULL, 'c' },
+			   { "debug",	no_argument, NULL, 'd' },
+			   { "fork",	no_argument, &opt_fork, 1 },
 			   { "nofork",	no_argument, NULL, 1001 },
+			   { "output-limit", required_argument, NULL, 1002 },
+			   { "threads",	required_argument, NULL, 1003 },
+			   { "max-id-length", required_argument, NULL, 1004 },
+			   { "max-comment-length", required_argument, NULL,
+			     1005 },
+			   { "max-secret-length", required_argument, NULL,
+			     1006 },
+			   { "max-large-secret-length", required_argument,
+			     NULL, 1007 },
+			   { "secure-memory", required_argument, NULL, 1008 },
+			   { "shm-rings", required_argument, NULL, 1009 },
 			   { "query-options", required_argument, NULL, 'q' },
 			   { "help",	no_argument, &opt_help, 1 },
 			   { "version", no_argument, &opt_version, 1 },
 			   { NULL, 0, NULL, 0 } };
 
   lower_privs();
+  self_path = binary_path();
+  self_argv = argv;
   setlocale(LC_ALL, "");
   bindtextdomain(PACKAGE, LOCALEDIR);
   textdomain(PACKAGE);
@@ -561,6 +5187,55 @@ int main(int argc, char **argv)
       fprintf(stderr,
 	      _("Warning: not forking is the default now, and --nofork has been deprecated\n"));
       break;
+    case 1002: {
+      char *err;
+      output_limit = strtoul(optarg, &err, 10);
+      if (*err || !output_limit) {
+	fprintf(stderr, _("%s: invalid output limit\n"), optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 1003: {
+      char *err;
+      nworkers = strtoul(optarg, &err, 10);
+      if (*err || !nworkers) {
+	fprintf(stderr, _("%s: invalid number of threads\n"), optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 1004:
+      max_id = parse_limit(optarg, ID_LENGTH - 1);
+      break;
+    case 1005:
+      max_comment = parse_limit(optarg, COMMENT_LENGTH - 1);
+      break;
+    case 1006:
+      max_secret = parse_limit(optarg, DATA_LENGTH - 1);
+      break;
+    case 1007:
+      /* the length is sent in 32 bits, with zeros after the data */
+      max_large = parse_limit(optarg, (uint32_t)-1 - 8);
+      break;
+    case 1008: {
+      char *err;
+      secure_memory = strtoul(optarg, &err, 10);
+      if (*err || !secure_memory) {
+	fprintf(stderr, _("%s: invalid size of secure memory\n"), optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 1009: {
+      char *err;
+      shm_rings = strtoul(optarg, &err, 10);
+      if (*err || !*optarg) {
+	fprintf(stderr, _("%s: invalid number of rings\n"), optarg);
+	exit(EXIT_FAILURE);
+      }
+      break;
+    }
     case 0:
     case '?':
       break;
@@ -579,17 +5254,73 @@ int main(int argc, char **argv)
   -d, --debug          turn on debugging output\n\
       --fork           fork into the background - keep in mind that this\n\
                        will cause the agent to run until explicitly killed\n\
+      --output-limit N stop reading from a client while more than N bytes\n\
+                       of replies are waiting to be sent to it\n\
+      --threads N      serve clients with N threads\n\
+      --max-id-length N, --max-comment-length N, --max-secret-length N\n\
+                       refuse to store secrets with longer ids, comments,\n\
+                       or data, in bytes\n\
+      --max-large-secret-length N\n\
+                       store secrets of up to N bytes that are sent in\n\
+                       chunks\n\
+      --secure-memory N  keep secrets in N bytes of memory that is locked\n\
+                       against swapping\n\
+      --shm-rings N    serve up to N clients at once through rings in\n\
+                       shared memory, 0 for none\n\
       --help           display this help and exit\n\
       --version        output version information and exit\n"));
     exit(EXIT_SUCCESS);
   }
-
-  if (create_socket() < 0) {
-    cleanup();
+  size = sizeof(header2) + sizeof(request2_put) + STRING2_SIZE(max_id)
+    + STRING2_SIZE(max_comment) + STRING2_SIZE(max_secret);
+  if (request_limit < size)
+    request_limit = size;
+  if (request_limit < sizeof(header2) + sizeof(request2_mget) + MGET_LENGTH)
+    request_limit = sizeof(header2) + sizeof(request2_mget) + MGET_LENGTH;
+#ifdef USE_THREADS
+  if (nworkers > 1 || shm_rings)
+    g_thread_init(NULL);
+#else
+  if (nworkers > 1) {
+    fprintf(stderr, _("Warning: threads are not supported, serving with one\n"));
+    nworkers = 1;
+  }
+#endif
+  /* every worker receives requests into a buffer of its own in secure
+     memory, which should not take the room meant for secrets - and
+     neither should the tables of the cache, when they are in there too */
+  reserved = nworkers * secmem_block_size(request_limit);
+  if (secure_memory == 1)
+    secure_memory = SECMEM_DEFAULT_POOLSIZE + reserved
+      + cache_memory(nworkers > 1 ? CACHE_SHARDS : 1, POOL_SECRETS);
+  else if (secure_memory <= reserved
+	   /* the pool is never smaller than that */
+	   && SECMEM_DEFAULT_POOLSIZE <= reserved) {
+    fprintf(stderr,
+	    _("%lu bytes of secure memory are too few for %u threads\n"),
+	    (unsigned long)secure_memory, nworkers);
     exit(EXIT_FAILURE);
   }
-  printf(setenv, sockname);
-  fflush(stdout);
+
+  if ((handover = getenv(HANDOVER_ENV)) != NULL) {
+    /* the clients know where to find us already, and nobody waits for us
+       to fork */
+    handover_fd = strtol(handover, NULL, 10);
+    unsetenv(HANDOVER_ENV);
+    opt_fork = 0;
+  } else {
+    switch (inherit_socket()) {
+    case 0:
+      if (create_socket() == 0)
+	break;
+				/* fall through */
+    case -1:
+      cleanup();
+      exit(EXIT_FAILURE);
+    }
+    printf(setenv, sockname ? sockname : bound_path(sock));
+    fflush(stdout);
+  }
   if (opt_fork) {
     switch (fork()) {
     case -1:
@@ -620,7 +5351,7 @@ int main(int argc, char **argv)
   }
   move_fd(fd, STDIN_FILENO);
   raise_privs();
-  secmem_init(1);		/* 1 is too small, so default size is used */
+  secmem_init(secure_memory);
   secmem_set_flags(SECMEM_WARN);
   drop_privs();
   supported = 0;
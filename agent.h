@@ -35,10 +35,32 @@ typedef unsigned long uint32_t;
 #else
 #error No unsigned type of width 32 known
 #endif
+typedef unsigned short uint16_t;
+typedef long long int64_t;
 #endif /* HAVE_INTTYPES_H */
 
 #define SOCKET_NAME	"agent-socket"
 
+/* Next to the stream socket, at its path with PACKET_SUFFIX appended, the
+   agent listens on a SOCK_SEQPACKET socket, which keeps messages apart.
+   There, each request is sent in a message of its own, and received with
+   a single call - only the data of a PUT_LARGE may follow in further
+   messages.  Each reply comes in a message of its own too, unless it is
+   longer than PACKET_SIZE - then it is split into messages of that
+   size. */
+#define PACKET_SUFFIX	".seqpacket"
+#define PACKET_SIZE	4096
+
+/* At its path with DGRAM_SUFFIX appended, the agent takes a version 2 GET
+   or MGET in a single datagram, from a client whose socket is bound to an
+   address, and sends the reply there.  Only what is at hand is answered
+   like that: if the user would have to be asked, the reply has
+   STATUS_RETRY, and no body, and the request is to be sent over a
+   connection instead.  So are replies longer than DGRAM_SIZE.  Datagrams
+   from other users are ignored. */
+#define DGRAM_SUFFIX	".dgram"
+#define DGRAM_SIZE	4096
+
 #define ID_LENGTH	100
 #define COMMENT_LENGTH	100
 #define DATA_LENGTH	1000
@@ -50,12 +72,17 @@ typedef unsigned long uint32_t;
 
 /* request types */
 typedef enum _req_type {
-  REQ_PUT, REQ_GET, REQ_DELETE, REQ_LIST
+  REQ_PUT, REQ_GET, REQ_DELETE, REQ_LIST,
+  REQ_MGET, REQ_TXN,		/* version 2 only */
+  REQ_PUT_LARGE, REQ_GET_LARGE,
+  REQ_WATCH, REQ_SHM, REQ_GET_FD, REQ_TOUCH
 } req_type;
 
 typedef int flags_t;
 #define FLAGS_INSURE	1	/* whether the agent should ask before
 				   handing out secrets */
+#define FLAGS_LARGE	2	/* the secret is too long for a GET, or
+				   binary - set by the agent */
 
 /* generic part of requests */
 typedef struct _request {
@@ -85,7 +112,13 @@ typedef struct _request_get {
 #define MAX_REQUEST_SIZE	(sizeof(request_put))
 
 typedef enum _status_t {
-  STATUS_OK, STATUS_FAIL, STATUS_COMM_ERR
+  STATUS_OK, STATUS_FAIL, STATUS_COMM_ERR,
+  STATUS_RETRY,			/* only sent in reply to datagrams, requests
+				   in rings, and GET_FDs */
+  STATUS_UNCHANGED,		/* the secret still has the version a version
+				   2 GET names */
+  STATUS_CONFLICT		/* the secret has not got the version a
+				   version 2 PUT or DELETE names */
 } status_t;
 
 /* generic part of replies */
@@ -121,4 +154,242 @@ typedef struct _reply_list {
   reply_list_entry entry[0]; /* the dark entries */
 } reply_list;
 
+/* Version 2 of the protocol: every message starts with a header telling
+   the length of the body that follows.  Integers have a fixed width, and
+   strings are sent at their real length, followed by 1 to 8 zero bytes so
+   that the next field is aligned.  The agent tells the versions apart by
+   their magic numbers, and replies in the version it was asked in.
+
+   Replies come in the order the requests were sent, except for GETs with
+   a nonzero tag: if one of those has to wait for the user, the requests
+   after it are served meanwhile, and its reply follows whenever the user
+   has decided.  Clients that keep several requests in flight tell the
+   replies apart by the tags, which are echoed. */
+#define REQUEST2_MAGIC	0xa8e42302
+#define REPLY2_MAGIC	0xa8f42302
+
+/* the room a string of LEN bytes takes in a version 2 body */
+#define STRING2_SIZE(len)	(((size_t)(len) + 8) & ~(size_t)7)
+
+/* header of all version 2 requests and replies */
+typedef struct _header2 {
+  uint32_t magic;		/* magic number */
+  uint16_t type;		/* request type, or status of a reply */
+  uint16_t flags;		/* REPLY2_EVENT, or 0 */
+  uint32_t length;		/* bytes of body that follow */
+  uint32_t tag;			/* chosen by the client, echoed in the reply */
+} header2;
+
+/* Every secret the agent stores gets a version, which is higher than that
+   of all stored before it, and is never VERSION_NONE.  A version 2 GET
+   (or GET_LARGE, or GET_FD) may name the version the client has seen: if
+   the secret still has it, the reply is STATUS_UNCHANGED, with no body.
+   A PUT (or PUT_LARGE) or DELETE, and those in a TXN, may name the
+   version the secret has to have for them to be done - VERSION_NONE if
+   there must be none.  Otherwise the reply is STATUS_CONFLICT, and
+   nothing changes.  0 names no version. */
+#define VERSION_NONE	0xffffffff
+
+/* body of a version 2 PUT, followed by <id>, <comment> and <data> */
+typedef struct _request2_put {
+  int64_t deadline;		/* will forget after this deadline */
+  uint32_t flags;		/* miscellaneous flags - see above */
+  uint32_t datalen;		/* length of the secret */
+  uint16_t idlen;		/* length of the identifier */
+  uint16_t commentlen;		/* length of the comment */
+  uint32_t version;		/* only replace this version, or 0 */
+} request2_put;
+
+/* body of a version 2 GET or DELETE, followed by <id> */
+typedef struct _request2_get {
+  uint16_t idlen;		/* length of the identifier */
+  uint16_t spare;		/* must be 0 */
+  uint32_t version;		/* GET: unless it has this version, DELETE:
+				   only if it has it - or 0 */
+} request2_get, request2_delete;
+
+/* body of a version 2 MGET, followed by <count> ids, each introduced by a
+   request2_get like in a GET */
+typedef struct _request2_mget {
+  uint32_t count;		/* number of ids that follow */
+  uint32_t spare;		/* must be 0 */
+} request2_mget;
+
+/* how many bytes of ids an MGET may carry at most - more have to be asked
+   for with several */
+#define MGET_LENGTH	1024
+#define MGET_IDS	(MGET_LENGTH / (sizeof(request2_get) + 8))
+
+/* body of a version 2 TXN, followed by <count> operations, which are
+   applied all together, or not at all.  Each is a request2_op, followed by
+   the body of a PUT or DELETE. */
+typedef struct _request2_txn {
+  uint32_t count;		/* number of operations that follow */
+  uint32_t spare;		/* must be 0 */
+} request2_txn;
+
+typedef struct _request2_op {
+  uint16_t type;		/* REQ_PUT or REQ_DELETE */
+  uint16_t spare[3];		/* must be 0 */
+} request2_op;
+
+/* how many bytes of operations a TXN may carry at most - any agent takes
+   that many */
+#define TXN_LENGTH	(MAX_REQUEST_SIZE - sizeof(header2) \
+			 - sizeof(request2_txn))
+#define TXN_OPS		(TXN_LENGTH / (sizeof(request2_op) \
+				       + sizeof(request2_get) + 8))
+
+/* body of a version 2 LIST, followed by <pattern> and <cursor>.  It may
+   be left out, to list all secrets in no particular order.  Otherwise only
+   the ids matching the pattern are listed, sorted, and at most <limit> of
+   them, unless that is 0.  If there are more, the reply ends with a cursor
+   to be passed back with LIST_CONTINUE, which goes on after the entries
+   listed so far - secrets stored or deleted in the meantime do not upset
+   that. */
+#define LIST_GLOB	1	/* the pattern is a glob(7), not a prefix */
+#define LIST_CONTINUE	2	/* go on where <cursor> says */
+
+typedef struct _request2_list {
+  uint32_t limit;		/* how many entries to list at most */
+  uint16_t flags;		/* LIST_* */
+  uint16_t patternlen;		/* length of the pattern */
+  uint16_t cursorlen;		/* length of the cursor */
+  uint16_t spare[3];		/* must be 0 */
+} request2_list;
+
+/* Secrets that are longer than DATA_LENGTH - 1 bytes, or contain zero
+   bytes, are stored with PUT_LARGE, and fetched with GET_LARGE.  Their
+   bodies are those of a PUT and of a GET, and so are those of the replies,
+   but <data> may be longer than any other request, and is not checked for
+   zero bytes.  The agent moves it between the socket and secure memory as
+   it comes, so a client should send or receive it in chunks, too.  A GET
+   or MGET fails for secrets with FLAGS_LARGE, which only GET_LARGE hands
+   out; GET_LARGE hands out the others as well.  GET_LARGE is answered in
+   order, whatever its tag. */
+
+/* body of a version 2 WATCH, followed by <pattern>.  After its reply, the
+   connection is told whenever a secret whose id is the pattern - or starts
+   with it, with WATCH_PREFIX - is stored, deleted, or expires.  This goes
+   on until a WATCH with WATCH_CANCEL, and the same tag, or until the
+   client hangs up.  The events are replies with REPLY2_EVENT in the flags
+   of their header, and the tag of the WATCH, which come in between the
+   others at any time.  They carry no comment, and never any data.  The
+   tag must not be 0, nor that of another WATCH going on. */
+#define WATCH_PREFIX	1	/* the pattern is a prefix, not an id */
+#define WATCH_CANCEL	2	/* stop watching, the pattern is ignored */
+
+typedef struct _request2_watch {
+  uint16_t flags;		/* WATCH_* */
+  uint16_t patternlen;		/* length of the pattern */
+  uint16_t spare[2];		/* must be 0 */
+} request2_watch;
+
+/* A SHM has no body.  Unless the agent refuses, the reply carries a memfd
+   in an SCM_RIGHTS message, which holds the rings of shmring.h.  Version
+   2 GETs, MGETs and PUTs may be put into the one of them for requests,
+   and their replies come back through the other, like those to datagrams:
+   whatever else, and what is not at hand, gets STATUS_RETRY, and is to be
+   sent over a connection instead.  A client has a single request in
+   there at a time.  The rings are served until the connection the SHM
+   came over is closed, or the agent sets their <closed> - then the
+   client goes on over a connection. */
+
+/* A GET_FD looks like a GET, and hands out secrets like GET_LARGE, but
+   the data does not come in the body of the reply: that carries the
+   comment only, and the data is in a memfd passed in an SCM_RIGHTS
+   message with the first byte of the reply.  <datalen> is its size.  The
+   memfd is sealed, so that it can be read and mapped, but neither
+   written to nor resized, and it has no name in any file system.  The
+   agent wipes it when it forgets the secret, or the secret is replaced.
+   If the agent cannot hand out the memfd right now, the reply is
+   STATUS_RETRY, and GET_LARGE still works. */
+
+/* body of a version 2 TOUCH, followed by <id> - or by a prefix of ids,
+   with TOUCH_PREFIX.  The secrets under it get a new <deadline>, without
+   being sent again, and keep their version.  With a <slide>, whenever one
+   of them is handed out, its deadline moves on to <slide> seconds after
+   that, if that is later - so it expires once it has not been used for
+   that long.  A <slide> needs a <deadline>.  The reply is STATUS_FAIL if
+   there is no such secret. */
+#define TOUCH_PREFIX	1	/* the id is a prefix */
+
+typedef struct _request2_touch {
+  int64_t deadline;		/* will forget after this deadline, or never
+				   if it is 0 */
+  uint32_t slide;		/* seconds a hand-out renews it for, or 0 */
+  uint16_t flags;		/* TOUCH_* */
+  uint16_t idlen;		/* length of the id */
+} request2_touch;
+
+/* the replies to DELETE, TXN, WATCH, SHM and TOUCH have no body, and
+   neither do those to PUT and PUT_LARGE that fail */
+
+/* body of the reply to a version 2 PUT or PUT_LARGE that succeeded */
+typedef struct _reply2_put {
+  uint32_t version;		/* that the secret has been stored with */
+  uint32_t spare;
+} reply2_put;
+
+/* body of the reply to a version 2 GET, followed by <comment> and <data> -
+   or by <comment> alone, if it answers a GET_FD */
+typedef struct _reply2_get {
+  int64_t deadline;		/* will forget after this deadline */
+  uint32_t flags;		/* miscellaneous flags - see above */
+  uint32_t datalen;		/* length of the secret */
+  uint16_t commentlen;		/* length of the comment */
+  uint16_t spare;
+  uint32_t version;		/* of the secret */
+} reply2_get;
+
+/* body of the reply to a version 2 LIST, followed by <entries> entries,
+   and <cursor> if there are more */
+typedef struct _reply2_list {
+  uint32_t entries;		/* number of entries that follow */
+  uint16_t more;		/* whether more ids match */
+  uint16_t cursorlen;		/* length of the cursor */
+} reply2_list;
+
+/* an entry of the version 2 LIST reply, followed by <id> and <comment> */
+typedef struct _reply2_list_entry {
+  int64_t deadline;		/* will forget after this deadline */
+  uint32_t flags;		/* miscellaneous flags - see above */
+  uint16_t idlen;		/* length of the identifier */
+  uint16_t commentlen;		/* length of the comment */
+} reply2_list_entry;
+
+/* body of the reply to a version 2 MGET, followed by one entry for every id
+   asked for, in order */
+typedef struct _reply2_mget {
+  uint32_t entries;		/* number of entries that follow */
+  uint32_t spare;
+} reply2_mget;
+
+/* an entry of the MGET reply.  If its status is STATUS_OK, the body of a
+   reply to a GET for that id follows.  The versions of the ids asked for
+   are ignored. */
+typedef struct _reply2_mget_entry {
+  uint16_t status;		/* whether the secret is handed out */
+  uint16_t spare[3];
+} reply2_mget_entry;
+
+/* in the header of a reply, which is an event of a WATCH */
+#define REPLY2_EVENT	1
+
+/* what an event tells about a secret */
+#define EVENT_PUT	0	/* it has been stored, or replaced */
+#define EVENT_DELETE	1	/* it has been deleted */
+#define EVENT_EXPIRE	2	/* its deadline has passed */
+#define EVENT_LOST	3	/* events have been dropped, since the client
+				   did not read them - <id> is empty */
+
+/* body of an event, followed by <id> - the flags and deadline are those of
+   the secret stored, or of the one that is gone */
+typedef struct _reply2_event {
+  int64_t deadline;		/* will forget after this deadline */
+  uint32_t flags;		/* miscellaneous flags - see above */
+  uint16_t type;		/* EVENT_* */
+  uint16_t idlen;		/* length of the identifier */
+} reply2_event;
+
 #endif
@@ -23,10 +23,12 @@
 #include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>	/* must be before sys/stat.h due to Ultrix-breakage */
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -38,34 +40,225 @@
 
 #include "i18n.h"
 #include "agentlib.h"
+#include "shmring.h"
 #include "util.h"
 #include "memory.h"
 
-static int sock = -1;
+/* what transact2 returns if the agent does not know version 2 */
+#define OLD_AGENT	(-1)
 
-int agent_init()
+/* how many bytes of a streamed secret are moved at once */
+#define STREAM_CHUNK	4096
+
+/* how many milliseconds the reply to a datagram is waited for, before the
+   request is sent over a connection instead */
+#define DGRAM_TIMEOUT	1000
+
+/* how many milliseconds the reply to a request in a ring is waited for,
+   before the rings are given up */
+#define SHM_TIMEOUT	1000
+
+/* a GET started by agent_get_start(), whose reply has not been picked up
+   yet */
+struct pending_get {
+  struct pending_get *next;
+  unsigned tag;
+  int status;			/* of the reply, -1 until it is in */
+  char *body;			/* of the reply, in secure memory */
+  size_t len;
+  char id[1];			/* to ask again, should the agent be old */
+};
+
+/* an event of a WATCH, which came in while a reply was waited for */
+struct pending_event {
+  struct pending_event *next;
+  agent_event ev;
+};
+
+static char *sockname;		/* where the agent is */
+static int sock = -1;		/* connected once it is needed */
+static int packet;		/* sock is a SOCK_SEQPACKET socket */
+static int dgram = -1;		/* single GETs go there, if the agent takes
+				   datagrams */
+static struct shmrings *shm;	/* GETs, MGETs and PUTs go there, if
+				   agent_use_shm() has set them up */
+static int shm_sock = -1;	/* the connection they came over */
+static char *msg;		/* the message received last on it, in secure
+				   memory */
+static size_t msglen, msgpos;	/* its length, and how much has been read */
+static int version = 2;		/* of the protocol the agent speaks */
+static struct pending_get *pending; /* oldest first */
+static unsigned last_tag;	/* of the last GET or WATCH started */
+/* events not picked up yet, oldest first */
+static struct pending_event *events, **events_tail = &events;
+
+/* a socket of TYPE connected to the agent at SOCKNAME, with SUFFIX
+   appended.  -1 on errors, which are reported if LOUD. */
+static int connect_to(int type, const char *sockname, const char *suffix,
+		      int loud)
 {
-  char *sockname;
   struct sockaddr_un *addr;
   socklen_t len;
+  int s;
+
+  if ((s = socket(PF_UNIX, type, 0)) < 0) {
+    if (loud)
+      perror(_("could not create socket"));
+    return -1;
+  }
+  len = offsetof(struct sockaddr_un, sun_path) + strlen(sockname)
+    + strlen(suffix) + 1;
+  addr = alloca(len);
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, sockname);
+  strcat(addr->sun_path, suffix);
+  if (connect(s, (struct sockaddr *)addr, len) < 0) {
+    if (loud)
+      perror(_("could not connect to server"));
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+/* a SOCK_DGRAM socket that sends to the agent, and is bound to an address
+   for the replies - -1 if the agent takes no datagrams */
+static int open_dgram()
+{
+  struct sockaddr_un addr;
+  int s;
+
+  if ((s = connect_to(SOCK_DGRAM, sockname, DGRAM_SUFFIX, 0)) < 0)
+    return -1;
+  /* without a path, an unused abstract address is picked */
+  addr.sun_family = AF_UNIX;
+  if (bind(s, (struct sockaddr *)&addr, sizeof(sa_family_t)) < 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
 
+/* connect to the agent, unless that has been done already */
+static int connect_agent()
+{
   if (sock != -1)
     return 0;
-  if ((sockname = getenv("AGENT_SOCKET")) == NULL) {
+  /* the SOCK_SEQPACKET socket is preferred, if the agent has one -
+     agents that only speak the old protocol do not */
+  msglen = msgpos = 0;
+  if (version == 2
+      && (sock = connect_to(SOCK_SEQPACKET, sockname, PACKET_SUFFIX, 0)) >= 0)
+    packet = 1;
+  else if ((sock = connect_to(SOCK_STREAM, sockname, "", 1)) >= 0)
+    packet = 0;
+  else
+    return -1;
+  return 0;
+}
+
+int agent_init()
+{
+  char *name;
+
+  if (sock != -1 || dgram != -1)
+    return 0;
+  if ((name = getenv("AGENT_SOCKET")) == NULL) {
     fprintf(stderr, _("AGENT_SOCKET is not set\n"));
     /* IDEA: should we try guessing sockets? */
     return -1;
   }
-  if (!(sock = socket(PF_UNIX, SOCK_STREAM, 0))) {
-    perror(_("could not create socket"));
+  free(sockname);
+  if (!(sockname = strdup(name))) {
+    fprintf(stderr, _("out of memory\n"));
     return -1;
   }
-  len = offsetof(struct sockaddr_un, sun_path) + strlen(sockname) + 1;
-  addr = alloca(len);
-  addr->sun_family = AF_UNIX;
-  strcpy(addr->sun_path, sockname);
-  if (connect(sock, (struct sockaddr *)addr, len) < 0) {
-    perror(_("could not connect to server"));
+  /* if single GETs can be sent as datagrams, the connection waits until
+     something else is asked */
+  if (version == 2 && (dgram = open_dgram()) >= 0)
+    return 0;
+  return connect_agent();
+}
+
+/* give up the rings, and go on over the connection */
+static void drop_shm()
+{
+  if (shm) {
+    shmring_unmap(shm);
+    shm = NULL;
+  }
+  if (shm_sock != -1) {
+    close(shm_sock);
+    shm_sock = -1;
+  }
+}
+
+/* read LEN bytes from the socket S into BUF, and store the descriptor
+   that comes with them at *FD, which is left alone if none does.  Returns
+   how many bytes were read - fewer only on errors. */
+static size_t receive_fd(int s, void *buf, size_t len, int *fd)
+{
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr *cm;
+  struct msghdr msg;
+  struct iovec iov;
+  size_t got = 0;
+  ssize_t n;
+  int flags = 0;
+
+#ifdef MSG_CMSG_CLOEXEC
+  flags = MSG_CMSG_CLOEXEC;
+#endif
+  while (got < len) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (char *)buf + got;
+    iov.iov_len = len - got;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if ((n = recvmsg(s, &msg, flags)) < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS
+	  && *fd == -1 && cm->cmsg_len >= CMSG_LEN(sizeof(int)))
+	memcpy(fd, CMSG_DATA(cm), sizeof(int));
+    got += n;
+  }
+  return got;
+}
+
+int agent_use_shm()
+{
+  header2 req, rep;
+  int fd = -1;
+
+  if (shm)
+    return 0;
+  if (version != 2 || !sockname
+      || (shm_sock = connect_to(SOCK_STREAM, sockname, "", 0)) < 0)
+    return -1;
+  memset(&req, 0, sizeof(req));
+  req.magic = REQUEST2_MAGIC;
+  req.type = REQ_SHM;
+  if (xwrite(shm_sock, &req, sizeof(req)) < 0) {
+    drop_shm();
+    return -1;
+  }
+  /* the memfd comes with the first byte of the reply */
+  if (receive_fd(shm_sock, &rep, sizeof(rep), &fd) == sizeof(rep)
+      && rep.magic == REPLY2_MAGIC
+      && rep.type == STATUS_OK && !rep.length && fd != -1)
+    shm = shmring_map(fd);
+  if (fd != -1)
+    close(fd);
+  if (!shm) {
+    drop_shm();
     return -1;
   }
   return 0;
@@ -73,10 +266,629 @@ int agent_init()
 
 int agent_done()
 {
+  struct pending_get *p;
+  struct pending_event *e;
   int ret;
 
-  ret = close(sock);
+  while ((p = pending) != NULL) {
+    pending = p->next;
+    if (p->body)
+      secmem_free(p->body);
+    free(p);
+  }
+  while ((e = events) != NULL) {
+    events = e->next;
+    free(e);
+  }
+  events_tail = &events;
+  if (msg) {
+    secmem_free(msg);
+    msg = NULL;
+  }
+  drop_shm();
+  ret = sock != -1 ? close(sock) : 0;
+  sock = -1;
+  if (dgram != -1) {
+    close(dgram);
+    dgram = -1;
+  }
+  return ret;
+}
+
+/* the agent only speaks the old protocol - reconnect, so that nothing is
+   left over from the requests it did not understand, and use that.  GETs
+   that were started are asked for again when their replies are wanted. */
+static int old_agent()
+{
+  version = 1;
+  close(sock);
   sock = -1;
+  return connect_agent();
+}
+
+/* receive the next message from a SOCK_SEQPACKET socket, in one go -
+   the agent sends none longer than PACKET_SIZE */
+static int receive_message()
+{
+  ssize_t n;
+
+  if (!msg && !(msg = secmem_malloc(PACKET_SIZE))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return -1;
+  }
+  /* with MSG_TRUNC, the whole length of the message is returned */
+  while ((n = recv(sock, msg, PACKET_SIZE, MSG_TRUNC)) < 0 && errno == EINTR)
+    ;
+  msglen = msgpos = 0;
+  if (n < 0)
+    perror(_("error receiving reply"));
+  else if (!n)
+    fprintf(stderr, _("agent hung up\n"));
+  else if (n > PACKET_SIZE)
+    fprintf(stderr, _("oversized reply\n"));
+  else {
+    msglen = n;
+    return 0;
+  }
+  return -1;
+}
+
+/* read LEN bytes of a reply into BUF */
+static int receive(void *buf, size_t len)
+{
+  ssize_t n;
+
+  if (packet) {
+    for (; len; len -= n, buf = (char *)buf + n) {
+      if (msgpos == msglen && receive_message() < 0)
+	return -1;
+      n = msglen - msgpos < len ? msglen - msgpos : len;
+      memcpy(buf, msg + msgpos, n);
+      msgpos += n;
+    }
+    return 0;
+  }
+  if ((n = xread(sock, buf, len)) == len)
+    return 0;
+  if (n < 0)
+    perror(_("error receiving reply"));
+  else
+    fprintf(stderr, _("agent hung up\n"));
+  return -1;
+}
+
+/* fill in the header of the version 2 request at REQ, with TYPE and TAG,
+   and a body of LEN bytes */
+static void header2_init(header2 *req, req_type type, size_t len,
+			 unsigned tag)
+{
+  memset(req, 0, sizeof(header2));
+  req->magic = REQUEST2_MAGIC;
+  req->type = type;
+  req->length = len;
+  req->tag = tag;
+}
+
+/* send the version 2 request at REQ, with TYPE and TAG, and a body of LEN
+   bytes following the header, which is filled in */
+static int send2(header2 *req, req_type type, size_t len, unsigned tag)
+{
+  if (connect_agent() < 0)
+    return STATUS_COMM_ERR;
+  header2_init(req, type, len, tag);
+  if (xwrite(sock, req, sizeof(header2) + len) < 0) {
+    perror(_("could not send request"));
+    return STATUS_COMM_ERR;
+  }
+  return STATUS_OK;
+}
+
+/* read the header of the next reply into REP.  Returns STATUS_OK,
+   STATUS_COMM_ERR or OLD_AGENT. */
+static int receive_header2(header2 *rep)
+{
+  if (receive(rep, sizeof(reply)) < 0)
+    return STATUS_COMM_ERR;
+  if (rep->magic == REPLY_MAGIC)
+    return OLD_AGENT;
+  if (rep->magic != REPLY2_MAGIC) {
+    fprintf(stderr,
+	    _("wrong magic number on reply - maybe your agent is old?\n"));
+    return STATUS_COMM_ERR;
+  }
+  if (receive((char *)rep + sizeof(reply), sizeof(*rep) - sizeof(reply)) < 0)
+    return STATUS_COMM_ERR;
+  return STATUS_OK;
+}
+
+/* read the body of the reply REP.  If BODY is not NULL, it is returned
+   there, in secure memory if SECURE, and its size in *BODYLEN; otherwise
+   it is skipped.  Returns STATUS_OK or STATUS_COMM_ERR. */
+static int receive_body2(header2 *rep, char **body, size_t *bodylen,
+			 int secure)
+{
+  char skip[256], *buf;
+  size_t n;
+
+  if (!body) {
+    for (; rep->length; rep->length -= n) {
+      n = rep->length < sizeof(skip) ? rep->length : sizeof(skip);
+      if (receive(skip, n) < 0)
+	return STATUS_COMM_ERR;
+    }
+    return STATUS_OK;
+  }
+  /* never mind the size of an empty body */
+  buf = secure ? secmem_malloc(rep->length + 1) : malloc(rep->length + 1);
+  if (!buf) {
+    fprintf(stderr, secure
+	    ? _("could not allocate space in secure storage\n")
+	    : _("out of memory\n"));
+    return STATUS_COMM_ERR;
+  }
+  if (receive(buf, rep->length) < 0) {
+    if (secure)
+      secmem_free(buf);
+    else
+      free(buf);
+    return STATUS_COMM_ERR;
+  }
+  *body = buf;
+  *bodylen = rep->length;
+  return STATUS_OK;
+}
+
+/* the string of LEN bytes at *P in a version 2 body ending at END, which
+   is advanced past it.  NULL if it does not fit into SIZE bytes, or is
+   not properly terminated. */
+static const char *string2(const char **p, const char *end, size_t len,
+			   size_t size)
+{
+  const char *s = *p;
+
+  if (len >= size || STRING2_SIZE(len) > end - s || s[len])
+    return NULL;
+  *p += STRING2_SIZE(len);
+  return s;
+}
+
+/* take apart the event REP, whose body comes next, into EV */
+static int receive_event(header2 *rep, agent_event *ev)
+{
+  const reply2_event *body;
+  const char *p, *end, *id;
+  char *b;
+  size_t len;
+  int ret;
+
+  if ((ret = receive_body2(rep, &b, &len, 0)) != STATUS_OK)
+    return ret;
+  body = (const reply2_event *)b;
+  p = (const char *)(body + 1);
+  end = b + len;
+  if (len < sizeof(reply2_event)
+      || !(id = string2(&p, end, body->idlen, ID_LENGTH))) {
+    fprintf(stderr, _("malformed reply\n"));
+    free(b);
+    return STATUS_COMM_ERR;
+  }
+  ev->tag = rep->tag;
+  ev->type = body->type;
+  ev->flags = body->flags;
+  ev->deadline = body->deadline;
+  strcpy(ev->id, id);
+  free(b);
+  return STATUS_OK;
+}
+
+/* REP is the reply to a GET started earlier, or an event of a WATCH -
+   keep it, until it is picked up by agent_get_finish(), or
+   agent_next_event() */
+static int keep_reply(header2 *rep)
+{
+  struct pending_get *p;
+  struct pending_event *e;
+  int ret;
+
+  if (rep->flags & REPLY2_EVENT) {
+    if (!(e = malloc(sizeof(struct pending_event)))) {
+      fprintf(stderr, _("out of memory\n"));
+      return STATUS_COMM_ERR;
+    }
+    if ((ret = receive_event(rep, &e->ev)) != STATUS_OK) {
+      free(e);
+      return ret;
+    }
+    e->next = NULL;
+    *events_tail = e;
+    events_tail = &e->next;
+    return STATUS_OK;
+  }
+  for (p = pending; p && p->tag != rep->tag; p = p->next)
+    ;
+  if (!p || p->status != -1) {
+    fprintf(stderr, _("reply to a request that was not sent\n"));
+    return STATUS_COMM_ERR;
+  }
+  if ((ret = receive_body2(rep, &p->body, &p->len, 1)) != STATUS_OK)
+    return ret;
+  p->status = rep->type;
+  return STATUS_OK;
+}
+
+/* read the header of the reply to the request sent last, which has TAG,
+   into REP.  Replies to GETs started earlier, and events, that come in
+   before it, are kept.  Returns STATUS_OK, STATUS_COMM_ERR or
+   OLD_AGENT. */
+static int receive_tagged2(header2 *rep, unsigned tag)
+{
+  int ret;
+
+  for (;;) {
+    if ((ret = receive_header2(rep)) != STATUS_OK)
+      return ret;
+    if (rep->tag == tag && !(rep->flags & REPLY2_EVENT))
+      return STATUS_OK;
+    if ((ret = keep_reply(rep)) != STATUS_OK)
+      return ret;
+  }
+}
+
+/* like receive_tagged2(), for an untagged request */
+static int receive_reply2(header2 *rep)
+{
+  return receive_tagged2(rep, 0);
+}
+
+/* like transact2(), but through the rings, and the body is only returned
+   with STATUS_OK.  STATUS_RETRY is returned if the request has to go over
+   the connection instead. */
+static int shm_transact2(header2 *req, req_type type, size_t len,
+			 char **body, size_t *bodylen, int secure)
+{
+  struct shmring *in = &shm->replies;
+  struct iovec iov;
+  header2 rep;
+  ssize_t used;
+  char *buf;
+
+  header2_init(req, type, len, 0);
+  iov.iov_base = req;
+  iov.iov_len = sizeof(header2) + len;
+  if (shmring_put(&shm->requests, &iov, 1) < 0)
+    return STATUS_RETRY;
+  /* the agent has stopped serving them, or takes too long */
+  if (!shmring_wait(in, &shm->closed, SHM_TIMEOUT)) {
+    drop_shm();
+    return STATUS_RETRY;
+  }
+  used = shmring_used(in);
+  if (used < (ssize_t)sizeof(rep)) {
+    fprintf(stderr, _("malformed reply\n"));
+    drop_shm();
+    return STATUS_COMM_ERR;
+  }
+  shmring_copy(in, 0, &rep, sizeof(rep));
+  if (rep.magic != REPLY2_MAGIC || rep.length > used - sizeof(rep)) {
+    fprintf(stderr, _("malformed reply\n"));
+    drop_shm();
+    return STATUS_COMM_ERR;
+  }
+  if (rep.type == STATUS_OK && body) {
+    /* never mind the size of an empty body */
+    buf = secure ? secmem_malloc(rep.length + 1) : malloc(rep.length + 1);
+    if (!buf) {
+      fprintf(stderr, secure
+	      ? _("could not allocate space in secure storage\n")
+	      : _("out of memory\n"));
+      shmring_consume(in, sizeof(rep) + rep.length);
+      return STATUS_COMM_ERR;
+    }
+    shmring_copy(in, sizeof(rep), buf, rep.length);
+    *body = buf;
+    *bodylen = rep.length;
+  }
+  shmring_consume(in, sizeof(rep) + rep.length);
+  return rep.type;
+}
+
+/* send the version 2 request at REQ, with TYPE, and a body of LEN bytes
+   following the header, which is filled in.  Its reply is received as by
+   receive_body2(); replies to GETs started earlier, that come in before
+   it, are kept.  Returns the status of the reply, or OLD_AGENT. */
+static int transact2(header2 *req, req_type type, size_t len, char **body,
+		     size_t *bodylen, int secure)
+{
+  header2 rep;
+  int ret;
+
+  /* what the agent has at hand comes back through the rings */
+  if (shm && (type == REQ_GET || type == REQ_MGET || type == REQ_PUT)
+      && (ret = shm_transact2(req, type, len, body, bodylen, secure))
+      != STATUS_RETRY)
+    return ret;
+  if ((ret = send2(req, type, len, 0)) != STATUS_OK
+      || (ret = receive_reply2(&rep)) != STATUS_OK)
+    return ret;
+  if ((ret = receive_body2(&rep, body, bodylen, secure)) != STATUS_OK)
+    return ret;
+  return rep.type;
+}
+
+/* append the string S to a version 2 request at *P, and advance that */
+static void add_string2(char **p, const char *s, size_t len)
+{
+  memcpy(*p, s, len);
+  memset(*p + len, 0, STRING2_SIZE(len) - len);
+  *p += STRING2_SIZE(len);
+}
+
+/* send the version 2 LIST at REQ, with a body of LEN bytes, and store the
+   entries of the reply at *REP.  If the reply ends with a cursor, a copy
+   of it is stored at *CURSOR, otherwise NULL. */
+static int list2(header2 *req, size_t len, reply_list **rep, char **cursor)
+{
+  reply2_list *list;
+  reply2_list_entry *e;
+  reply_list_entry *entry;
+  const char *p, *end, *id, *comment;
+  char *body;
+  unsigned i;
+  int ret;
+
+  *cursor = NULL;
+  if ((ret = transact2(req, REQ_LIST, len, &body, &len, 0)) != STATUS_OK) {
+    if (ret != OLD_AGENT)
+      (*rep)->status = ret;
+    return ret;
+  }
+  list = (reply2_list *)body;
+  if (len < sizeof(reply2_list)
+      || !(*rep = realloc(*rep, sizeof(reply_list)
+			  + list->entries * sizeof(reply_list_entry)))) {
+    fprintf(stderr, len < sizeof(reply2_list)
+	    ? _("malformed reply\n") : _("out of memory\n"));
+    free(body);
+    return STATUS_COMM_ERR;
+  }
+  (*rep)->magic = REPLY_MAGIC;
+  (*rep)->status = STATUS_OK;
+  (*rep)->entries = list->entries;
+  p = (const char *)(list + 1);
+  end = body + len;
+  for (i = 0; i < list->entries; i++) {
+    e = (reply2_list_entry *)p;
+    p += sizeof(*e);
+    entry = (*rep)->entry + i;
+    if (p > end || !(id = string2(&p, end, e->idlen, ID_LENGTH))
+	|| !(comment = string2(&p, end, e->commentlen, COMMENT_LENGTH))) {
+      fprintf(stderr, _("malformed reply\n"));
+      (*rep)->entries = i;
+      break;
+    }
+    strcpy(entry->id, id);
+    entry->flags = e->flags;
+    entry->deadline = e->deadline;
+    strcpy(entry->comment, comment);
+  }
+  if (i == list->entries && list->more) {
+    if (!(id = string2(&p, end, list->cursorlen, len))) {
+      fprintf(stderr, _("malformed reply\n"));
+      ret = STATUS_COMM_ERR;
+    } else if (!(*cursor = malloc(list->cursorlen + 1))) {
+      fprintf(stderr, _("out of memory\n"));
+      ret = STATUS_COMM_ERR;
+    } else
+      strcpy(*cursor, id);
+  }
+  free(body);
+  return ret;
+}
+
+/* the size of the body of a version 2 PUT */
+static size_t put2_size(const char *id, const char *comment, const char *data)
+{
+  return sizeof(request2_put) + STRING2_SIZE(strlen(id))
+    + STRING2_SIZE(strlen(comment)) + STRING2_SIZE(strlen(data));
+}
+
+/* append the body of a version 2 PUT, which only replaces VER, to a
+   request at *P, and advance that */
+static void add_put2(char **p, const char *id, const flags_t flags,
+		     const time_t deadline, const char *comment,
+		     const char *data, unsigned ver)
+{
+  request2_put *put = (request2_put *)*p;
+
+  memset(put, 0, sizeof(*put));
+  put->deadline = deadline;
+  put->flags = flags;
+  put->version = ver;
+  put->idlen = strlen(id);
+  put->commentlen = strlen(comment);
+  put->datalen = strlen(data);
+  *p += sizeof(*put);
+  add_string2(p, id, put->idlen);
+  add_string2(p, comment, put->commentlen);
+  add_string2(p, data, put->datalen);
+}
+
+/* a version 2 PUT, which only replaces *VER, unless VER is NULL.
+   The version the secret is stored with replaces it. */
+static int put2(const char *id, const flags_t flags, const time_t deadline,
+		const char *comment, const char *data, unsigned *ver)
+{
+  size_t len = put2_size(id, comment, data);
+  header2 *req;
+  char *p, *b = NULL;
+  int ret;
+
+  if (!(req = secmem_malloc(sizeof(header2) + len))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return STATUS_FAIL;
+  }
+  p = (char *)(req + 1);
+  add_put2(&p, id, flags, deadline, comment, data, ver ? *ver : 0);
+  ret = transact2(req, REQ_PUT, len, ver ? &b : NULL, &len, 0);
+  secmem_free(req);
+  if (ret == STATUS_OK && ver) {
+    if (len != sizeof(reply2_put)) {
+      fprintf(stderr, _("malformed reply\n"));
+      ret = STATUS_COMM_ERR;
+    } else
+      *ver = ((reply2_put *)b)->version;
+  }
+  free(b);
+  return ret;
+}
+
+/* a version 2 GET for ID, unless it has VER, whose body is LEN bytes
+   long */
+static header2 *get2_request(const char *id, unsigned ver, size_t *len)
+{
+  size_t idlen = strlen(id);
+  header2 *req;
+  request2_get *get;
+  char *p;
+
+  *len = sizeof(request2_get) + STRING2_SIZE(idlen);
+  if (!(req = malloc(sizeof(header2) + *len))) {
+    fprintf(stderr, _("out of memory\n"));
+    return NULL;
+  }
+  get = (request2_get *)(req + 1);
+  memset(get, 0, sizeof(*get));
+  get->idlen = idlen;
+  get->version = ver;
+  p = (char *)(get + 1);
+  add_string2(&p, id, idlen);
+  return req;
+}
+
+/* take apart the LEN bytes of the body B of a successful reply to a
+   version 2 GET into REP, and the version of the secret into *VER,
+   unless that is NULL */
+static int parse_get2(const char *b, size_t len, reply_get *rep,
+		      unsigned *ver)
+{
+  const reply2_get *body = (const reply2_get *)b;
+  const char *p = (const char *)(body + 1), *end = b + len;
+  const char *comment, *data;
+
+  if (len < sizeof(reply2_get)
+      || !(comment = string2(&p, end, body->commentlen, COMMENT_LENGTH))
+      || !(data = string2(&p, end, body->datalen, DATA_LENGTH))) {
+    fprintf(stderr, _("malformed reply\n"));
+    return STATUS_COMM_ERR;
+  }
+  rep->magic = REPLY_MAGIC;
+  rep->flags = body->flags;
+  rep->deadline = body->deadline;
+  strcpy(rep->comment, comment);
+  strcpy(rep->data, data);
+  if (ver)
+    *ver = body->version;
+  return STATUS_OK;
+}
+
+/* like parse_get2(), but B is freed */
+static int get2_reply(char *b, size_t len, reply_get *rep, unsigned *ver)
+{
+  int ret = parse_get2(b, len, rep, ver);
+
+  wipe(b, len);
+  secmem_free(b);
+  return ret;
+}
+
+/* a version 2 GET for ID, unless it still has *VER - if VER is
+   not NULL, that is, and then the version it has replaces it */
+static int get2(const char *id, reply_get *rep, unsigned *ver)
+{
+  header2 *req;
+  char *b;
+  size_t len;
+  int ret;
+
+  if (!(req = get2_request(id, ver ? *ver : 0, &len)))
+    return STATUS_FAIL;
+  ret = transact2(req, REQ_GET, len, &b, &len, 1);
+  free(req);
+  if (ret != STATUS_OK)
+    return ret;
+  return get2_reply(b, len, rep, ver);
+}
+
+/* like get2(), but in a single datagram.  Returns the status of the
+   reply, or STATUS_RETRY if it has to be asked over a connection
+   instead. */
+static int dgram_get2(const char *id, reply_get *rep, unsigned *ver)
+{
+  struct pollfd pfd;
+  header2 *req, *h;
+  char *buf;
+  size_t len;
+  ssize_t n;
+  int ret = STATUS_RETRY;
+
+  if (!(buf = secmem_malloc(DGRAM_SIZE))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return STATUS_COMM_ERR;
+  }
+  if (!(req = get2_request(id, ver ? *ver : 0, &len))) {
+    secmem_free(buf);
+    return STATUS_FAIL;
+  }
+  /* a late reply to an earlier one is told apart by the tag */
+  if (!++last_tag)
+    ++last_tag;
+  header2_init(req, REQ_GET, len, last_tag);
+  n = send(dgram, req, sizeof(header2) + len, MSG_DONTWAIT);
+  free(req);
+  pfd.fd = dgram;
+  pfd.events = POLLIN;
+  while (n >= 0 && poll(&pfd, 1, DGRAM_TIMEOUT) > 0) {
+    /* with MSG_TRUNC, the whole length of the datagram is returned */
+    if ((n = recv(dgram, buf, DGRAM_SIZE, MSG_TRUNC)) < 0)
+      break;
+    h = (header2 *)buf;
+    if (n < sizeof(header2) || n > DGRAM_SIZE || h->magic != REPLY2_MAGIC
+	|| h->length != n - sizeof(header2)) {
+      fprintf(stderr, _("malformed reply\n"));
+      break;
+    }
+    if (h->tag != last_tag)
+      continue;
+    ret = h->type == STATUS_OK
+      ? parse_get2((char *)(h + 1), h->length, rep, ver) : h->type;
+    break;
+  }
+  secmem_free(buf);
+  return ret;
+}
+
+/* a version 2 DELETE for ID, only if it has VER, unless that is 0 */
+static int delete2(const char *id, unsigned ver)
+{
+  size_t idlen = strlen(id), len;
+  header2 *req;
+  request2_delete *del;
+  char *p;
+  int ret;
+
+  len = sizeof(request2_delete) + STRING2_SIZE(idlen);
+  if (!(req = malloc(sizeof(header2) + len))) {
+    fprintf(stderr, _("out of memory\n"));
+    return STATUS_FAIL;
+  }
+  del = (request2_delete *)(req + 1);
+  memset(del, 0, sizeof(*del));
+  del->idlen = idlen;
+  del->version = ver;
+  p = (char *)(del + 1);
+  add_string2(&p, id, idlen);
+  ret = transact2(req, REQ_DELETE, len, NULL, NULL, 0);
+  free(req);
   return ret;
 }
 
@@ -96,6 +908,8 @@ send_request(request *req, size_t size, reply **re, size_t *rsize)
     r = &tmp;
     s = sizeof(reply);
   }
+  if (connect_agent() < 0)
+    return r->status = STATUS_COMM_ERR;
   if (xwrite(sock, req, size) >= 0) {
     if ((n = read(sock, r, s)) >= 0) {
       if (r->magic == REPLY_MAGIC) {
@@ -114,10 +928,19 @@ send_request(request *req, size_t size, reply **re, size_t *rsize)
 
 status_t agent_list(reply_list **rep)
 {
-  status_t ret;
+  int ret;
   request req;
+  header2 req2;
   size_t rs;
+  char *cursor;
 
+  if (version == 2) {
+    memset(&req2, 0, sizeof(req2));
+    if ((ret = list2(&req2, 0, rep, &cursor)) != OLD_AGENT)
+      return ret;
+    if (old_agent() < 0)
+      return (*rep)->status = STATUS_COMM_ERR;
+  }
   req.type = REQ_LIST;
   rs = sizeof(reply_list);
   ret = send_request(&req, sizeof(req), (reply **)rep, &rs);
@@ -141,12 +964,90 @@ status_t agent_list(reply_list **rep)
   return ret;
 }
 
+static int compare_entries(const void *a, const void *b)
+{
+  return strcmp(((const reply_list_entry *)a)->id,
+		((const reply_list_entry *)b)->id);
+}
+
+status_t agent_list_page(const char *pattern, int glob, unsigned limit,
+			 char **cursor, reply_list **rep)
+{
+  size_t patternlen = strlen(pattern), cursorlen, len;
+  header2 *req;
+  request2_list *list;
+  reply_list_entry *e;
+  char *p, *next;
+  unsigned i, n;
+  int ret;
+
+  if (version == 2) {
+    cursorlen = *cursor ? strlen(*cursor) : 0;
+    len = sizeof(request2_list) + STRING2_SIZE(patternlen)
+      + STRING2_SIZE(cursorlen);
+    if (!(req = malloc(sizeof(header2) + len))) {
+      fprintf(stderr, _("out of memory\n"));
+      return (*rep)->status = STATUS_FAIL;
+    }
+    list = (request2_list *)(req + 1);
+    memset(list, 0, sizeof(*list));
+    list->limit = limit;
+    list->flags = (glob ? LIST_GLOB : 0) | (*cursor ? LIST_CONTINUE : 0);
+    list->patternlen = patternlen;
+    list->cursorlen = cursorlen;
+    p = (char *)(list + 1);
+    add_string2(&p, pattern, patternlen);
+    add_string2(&p, *cursor ? *cursor : "", cursorlen);
+    ret = list2(req, len, rep, &next);
+    free(req);
+    if (ret != OLD_AGENT) {
+      free(*cursor);
+      *cursor = next;
+      return ret;
+    }
+    if (old_agent() < 0)
+      return (*rep)->status = STATUS_COMM_ERR;
+  }
+  /* an old agent lists everything, and the page is picked out here */
+  if ((ret = agent_list(rep)) != STATUS_OK)
+    return ret;
+  e = (*rep)->entry;
+  for (i = n = 0; i < (*rep)->entries; i++)
+    if ((!*cursor || strcmp(e[i].id, *cursor) > 0)
+	&& id_matches(e[i].id, pattern, glob))
+      e[n++] = e[i];
+  qsort(e, n, sizeof(reply_list_entry), compare_entries);
+  free(*cursor);
+  *cursor = NULL;
+  if (limit && n > limit) {
+    n = limit;
+    if (!(*cursor = malloc(strlen(e[n - 1].id) + 1))) {
+      fprintf(stderr, _("out of memory\n"));
+      return (*rep)->status = STATUS_FAIL;
+    }
+    strcpy(*cursor, e[n - 1].id);
+  }
+  (*rep)->entries = n;
+  return STATUS_OK;
+}
+
 status_t agent_put(const char *id, const flags_t flags, const time_t deadline,
 		   const char *comment, const char *data)
 {
-  status_t ret;
+  int ret;
   request_put *req;
 
+  if (version == 2) {
+    if ((ret = put2(id, flags, deadline, comment, data, NULL)) != OLD_AGENT)
+      return ret;
+    if (old_agent() < 0)
+      return STATUS_COMM_ERR;
+  }
+  if (strlen(id) >= ID_LENGTH || strlen(comment) >= COMMENT_LENGTH
+      || strlen(data) >= DATA_LENGTH) {
+    fprintf(stderr, _("secret too large for the agent\n"));
+    return STATUS_FAIL;
+  }
   if (!(req = secmem_malloc(sizeof(request_put)))) {
     fprintf(stderr, _("could not allocate space in secure storage\n"));
     return STATUS_FAIL;
@@ -162,26 +1063,736 @@ status_t agent_put(const char *id, const flags_t flags, const time_t deadline,
   return ret;
 }
 
+status_t agent_put_if(const char *id, const flags_t flags,
+		      const time_t deadline, const char *comment,
+		      const char *data, unsigned *ver)
+{
+  int ret;
+
+  if (version == 2
+      && (ret = put2(id, flags, deadline, comment, data, ver)) != OLD_AGENT)
+    return ret;
+  fprintf(stderr, _("the agent is too old for versions\n"));
+  return version == 2 && old_agent() < 0 ? STATUS_COMM_ERR : STATUS_FAIL;
+}
+
 status_t agent_get(const char *id, reply_get **rep)
+{
+  return agent_get_if(id, NULL, rep);
+}
+
+status_t agent_get_if(const char *id, unsigned *ver, reply_get **rep)
 {
   request_get req;
   size_t rs;
+  int ret;
 
-  req.type = REQ_GET;
-  strcpy(req.id, id);
   rs = sizeof(reply_get);
   if (!(*rep = secmem_malloc(rs))) {
     fprintf(stderr, _("could not allocate space in secure storage\n"));
     return STATUS_FAIL;
   }
+  if (version == 2) {
+    /* what the agent has at hand comes back in a datagram - unless the
+       rings are there to ask */
+    if (dgram != -1 && !shm
+	&& (ret = dgram_get2(id, *rep, ver)) != STATUS_RETRY)
+      return (*rep)->status = ret;
+    if ((ret = get2(id, *rep, ver)) != OLD_AGENT)
+      return (*rep)->status = ret;
+    if (old_agent() < 0)
+      return (*rep)->status = STATUS_COMM_ERR;
+  }
+  /* an old agent knows of no versions */
+  if (ver)
+    *ver = 0;
+  if (strlen(id) >= ID_LENGTH)
+    return (*rep)->status = STATUS_FAIL;
+  req.type = REQ_GET;
+  strcpy(req.id, id);
   return send_request((request *)&req, sizeof(req), (reply **)rep, &rs);
 }
 
+unsigned agent_get_start(const char *id)
+{
+  struct pending_get *p, **last;
+  header2 *req;
+  size_t len;
+  int ret;
+
+  if (!(p = malloc(offsetof(struct pending_get, id) + strlen(id) + 1))) {
+    fprintf(stderr, _("out of memory\n"));
+    return 0;
+  }
+  /* tag 0 would have the reply come in order */
+  if (!++last_tag)
+    ++last_tag;
+  p->next = NULL;
+  p->tag = last_tag;
+  p->status = -1;
+  p->body = NULL;
+  strcpy(p->id, id);
+  /* an old agent is asked once the reply is wanted */
+  if (version == 2) {
+    if (!(req = get2_request(id, 0, &len))) {
+      free(p);
+      return 0;
+    }
+    ret = send2(req, REQ_GET, len, p->tag);
+    free(req);
+    if (ret != STATUS_OK) {
+      free(p);
+      return 0;
+    }
+  }
+  for (last = &pending; *last; last = &(*last)->next)
+    ;
+  *last = p;
+  return p->tag;
+}
+
+status_t agent_get_finish(unsigned *tag, reply_get **rep)
+{
+  struct pending_get *p, **pp;
+  header2 h;
+  int ret;
+
+  *rep = NULL;
+  for (;;) {
+    for (pp = &pending; (p = *pp) != NULL; pp = &p->next)
+      if (*tag ? p->tag == *tag : p->status != -1)
+	break;
+    if (p && (p->status != -1 || version != 2))
+      break;
+    if (*tag ? !p : !pending) {
+      fprintf(stderr, _("no such GET has been started\n"));
+      return STATUS_FAIL;
+    }
+    if (version != 2) {
+      /* nothing is answered early by an old agent */
+      pp = &pending;
+      p = pending;
+      break;
+    }
+    ret = receive_header2(&h);
+    if (ret == OLD_AGENT) {
+      if (old_agent() < 0)
+	return STATUS_COMM_ERR;
+      continue;
+    }
+    if (ret != STATUS_OK || (ret = keep_reply(&h)) != STATUS_OK)
+      return ret;
+  }
+  *pp = p->next;
+  *tag = p->tag;
+  if (p->status == -1)
+    ret = agent_get(p->id, rep);
+  else if (!(*rep = secmem_malloc(sizeof(reply_get)))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    if (p->body)
+      secmem_free(p->body);
+    ret = STATUS_COMM_ERR;
+  } else if (p->status == STATUS_OK)
+    ret = (*rep)->status = get2_reply(p->body, p->len, *rep, NULL);
+  else {
+    secmem_free(p->body);
+    ret = (*rep)->status = p->status;
+  }
+  free(p);
+  if (ret == STATUS_COMM_ERR && *rep) {
+    secmem_free(*rep);
+    *rep = NULL;
+  }
+  return ret;
+}
+
 status_t agent_delete(const char *id)
 {
   request_get req;
+  int ret;
 
+  if (version == 2) {
+    if ((ret = delete2(id, 0)) != OLD_AGENT)
+      return ret;
+    if (old_agent() < 0)
+      return STATUS_COMM_ERR;
+  }
+  if (strlen(id) >= ID_LENGTH)
+    return STATUS_FAIL;
   req.type = REQ_DELETE;
   strcpy(req.id, id);
   return send_request((request *)&req, sizeof(req), NULL, 0);
 }
+
+status_t agent_delete_if(const char *id, unsigned ver)
+{
+  int ret;
+
+  if (version == 2 && (ret = delete2(id, ver)) != OLD_AGENT)
+    return ret;
+  fprintf(stderr, _("the agent is too old for versions\n"));
+  return version == 2 && old_agent() < 0 ? STATUS_COMM_ERR : STATUS_FAIL;
+}
+
+status_t agent_touch(const char *id, int prefix, time_t deadline,
+		     unsigned slide)
+{
+  size_t idlen = strlen(id), len;
+  header2 *req;
+  request2_touch *touch;
+  char *p;
+  int ret;
+
+  if (version != 2) {
+    fprintf(stderr, _("the agent is too old for touching secrets\n"));
+    return STATUS_FAIL;
+  }
+  len = sizeof(request2_touch) + STRING2_SIZE(idlen);
+  if (!(req = malloc(sizeof(header2) + len))) {
+    fprintf(stderr, _("out of memory\n"));
+    return STATUS_FAIL;
+  }
+  touch = (request2_touch *)(req + 1);
+  memset(touch, 0, sizeof(*touch));
+  touch->deadline = deadline;
+  touch->slide = slide;
+  touch->flags = prefix ? TOUCH_PREFIX : 0;
+  touch->idlen = idlen;
+  p = (char *)(touch + 1);
+  add_string2(&p, id, idlen);
+  ret = transact2(req, REQ_TOUCH, len, NULL, NULL, 0);
+  free(req);
+  if (ret == OLD_AGENT) {
+    fprintf(stderr, _("the agent is too old for touching secrets\n"));
+    return old_agent() < 0 ? STATUS_COMM_ERR : STATUS_FAIL;
+  }
+  return ret;
+}
+
+/* ask for as many of the N IDS as fit into one MGET, starting at *DONE,
+   and note the secrets in REP.  *DONE is advanced past them. */
+static int mget2(const char *const *ids, unsigned n, unsigned *done,
+		 reply_mget *rep)
+{
+  header2 *req;
+  request2_mget *mget;
+  request2_get *get;
+  reply2_mget *list;
+  reply2_mget_entry *e;
+  reply2_get *body;
+  agent_secret *entry;
+  const char *p, *end;
+  char *q, *buf;
+  size_t idlen, len;
+  unsigned i, first = *done;
+  int ret;
+
+  if (!(req = malloc(sizeof(header2) + sizeof(request2_mget)
+		     + MGET_LENGTH))) {
+    fprintf(stderr, _("out of memory\n"));
+    return STATUS_FAIL;
+  }
+  mget = (request2_mget *)(req + 1);
+  q = (char *)(mget + 1);
+  for (i = first; i < n && i - first < MGET_IDS; i++) {
+    idlen = strlen(ids[i]);
+    if (sizeof(request2_get) + STRING2_SIZE(idlen)
+	> MGET_LENGTH - (q - (char *)(mget + 1)))
+      break;
+    get = (request2_get *)q;
+    memset(get, 0, sizeof(*get));
+    get->idlen = idlen;
+    q += sizeof(*get);
+    memcpy(q, ids[i], idlen);
+    memset(q + idlen, 0, STRING2_SIZE(idlen) - idlen);
+    q += STRING2_SIZE(idlen);
+  }
+  if (i == first) {
+    /* too long to be known to any agent */
+    free(req);
+    rep->entry[(*done)++].status = STATUS_FAIL;
+    return STATUS_OK;
+  }
+  memset(mget, 0, sizeof(*mget));
+  mget->count = i - first;
+  ret = transact2(req, REQ_MGET, q - (char *)mget, &buf, &len, 1);
+  free(req);
+  if (ret != STATUS_OK)
+    return ret;
+  rep->bufs[rep->nbufs++] = buf;
+  list = (reply2_mget *)buf;
+  p = (const char *)(list + 1);
+  end = buf + len;
+  if (len < sizeof(reply2_mget) || list->entries != i - first) {
+    fprintf(stderr, _("malformed reply\n"));
+    return STATUS_COMM_ERR;
+  }
+  for (i = first; i < first + list->entries; i++) {
+    e = (reply2_mget_entry *)p;
+    p += sizeof(*e);
+    entry = rep->entry + i;
+    if (p > end)
+      break;
+    entry->status = e->status;
+    if (e->status != STATUS_OK)
+      continue;
+    body = (reply2_get *)p;
+    p += sizeof(*body);
+    if (p > end
+	|| !(entry->comment = string2(&p, end, body->commentlen, len))
+	|| !(entry->data = string2(&p, end, body->datalen, len)))
+      break;
+    entry->flags = body->flags;
+    entry->deadline = body->deadline;
+    entry->version = body->version;
+  }
+  if (i < first + list->entries || p != end) {
+    fprintf(stderr, _("malformed reply\n"));
+    return STATUS_COMM_ERR;
+  }
+  *done = i;
+  return STATUS_OK;
+}
+
+status_t agent_mget(const char *const *ids, unsigned n, reply_mget **rep)
+{
+  reply_mget *r;
+  reply_get *get;
+  unsigned done = 0;
+  int ret = STATUS_OK;
+
+  if (!(r = calloc(1, sizeof(reply_mget) + n * sizeof(agent_secret)))
+      || !(r->bufs = calloc(n + 1, sizeof(char *)))) {
+    fprintf(stderr, _("out of memory\n"));
+    free(r);
+    return STATUS_FAIL;
+  }
+  r->entries = n;
+  while (done < n) {
+    if (version == 2) {
+      if ((ret = mget2(ids, n, &done, r)) == STATUS_OK)
+	continue;
+      if (ret != OLD_AGENT || old_agent() < 0)
+	break;
+    }
+    /* an old agent is asked for one after the other */
+    ret = agent_get(ids[done], &get);
+    if (ret == STATUS_COMM_ERR) {
+      secmem_free(get);
+      break;
+    }
+    r->entry[done].status = ret;
+    if (ret == STATUS_OK) {
+      r->bufs[r->nbufs++] = (char *)get;
+      r->entry[done].flags = get->flags;
+      r->entry[done].deadline = get->deadline;
+      r->entry[done].comment = get->comment;
+      r->entry[done].data = get->data;
+    } else
+      secmem_free(get);
+    done++;
+  }
+  if (done < n) {
+    agent_mget_free(r);
+    return ret == STATUS_OK || ret == OLD_AGENT ? STATUS_COMM_ERR : ret;
+  }
+  *rep = r;
+  return STATUS_OK;
+}
+
+void agent_mget_free(reply_mget *rep)
+{
+  unsigned i;
+
+  for (i = 0; i < rep->nbufs; i++)
+    secmem_free(rep->bufs[i]);
+  free(rep->bufs);
+  free(rep);
+}
+
+status_t agent_txn(const agent_op *ops, unsigned n)
+{
+  size_t len = sizeof(request2_txn), idlen;
+  header2 *req;
+  request2_txn *txn;
+  request2_op *op;
+  char *p;
+  unsigned i;
+  int ret;
+
+  for (i = 0; i < n; i++)
+    len += sizeof(request2_op) + (ops[i].type == REQ_PUT
+				  ? put2_size(ops[i].id, ops[i].comment,
+					      ops[i].data)
+				  : sizeof(request2_delete)
+				  + STRING2_SIZE(strlen(ops[i].id)));
+  if (n > TXN_OPS || len > sizeof(request2_txn) + TXN_LENGTH) {
+    fprintf(stderr, _("transaction too large for the agent\n"));
+    return STATUS_FAIL;
+  }
+  if (version != 2) {
+    fprintf(stderr, _("the agent is too old for transactions\n"));
+    return STATUS_FAIL;
+  }
+  if (!(req = secmem_malloc(sizeof(header2) + len))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return STATUS_FAIL;
+  }
+  txn = (request2_txn *)(req + 1);
+  memset(txn, 0, sizeof(*txn));
+  txn->count = n;
+  p = (char *)(txn + 1);
+  for (i = 0; i < n; i++) {
+    op = (request2_op *)p;
+    memset(op, 0, sizeof(*op));
+    op->type = ops[i].type;
+    p += sizeof(*op);
+    if (ops[i].type == REQ_PUT)
+      add_put2(&p, ops[i].id, ops[i].flags, ops[i].deadline, ops[i].comment,
+	       ops[i].data, ops[i].version);
+    else {
+      idlen = strlen(ops[i].id);
+      memset(p, 0, sizeof(request2_delete));
+      ((request2_delete *)p)->idlen = idlen;
+      ((request2_delete *)p)->version = ops[i].version;
+      p += sizeof(request2_delete);
+      add_string2(&p, ops[i].id, idlen);
+    }
+  }
+  ret = transact2(req, REQ_TXN, len, NULL, NULL, 0);
+  secmem_free(req);
+  if (ret == OLD_AGENT) {
+    fprintf(stderr, _("the agent is too old for transactions\n"));
+    return old_agent() < 0 ? STATUS_COMM_ERR : STATUS_FAIL;
+  }
+  return ret;
+}
+
+/* a streamed secret was cut short, so that the agent cannot tell where the
+   next request starts - go on with a new connection.  GETs that have been
+   started, but not answered yet, are sent again. */
+static int reconnect()
+{
+  struct pending_get *p;
+  header2 *req;
+  size_t len;
+  int ret;
+
+  close(sock);
+  sock = -1;
+  if (connect_agent() < 0)
+    return -1;
+  for (p = pending; p; p = p->next)
+    if (p->status == -1) {
+      if (!(req = get2_request(p->id, 0, &len)))
+	return -1;
+      ret = send2(req, REQ_GET, len, p->tag);
+      free(req);
+      if (ret != STATUS_OK)
+	return -1;
+    }
+  return 0;
+}
+
+status_t agent_put_stream(const char *id, flags_t flags, time_t deadline,
+			  const char *comment, int fd, size_t len)
+{
+  static const char zeros[8];
+  size_t idlen = strlen(id), commentlen = strlen(comment), size, n;
+  struct pollfd pfd;
+  header2 *req, rep;
+  request2_put *put;
+  char *p, *buf = NULL;
+  int ret;
+
+  if (version != 2) {
+    fprintf(stderr, _("the agent is too old for streamed secrets\n"));
+    return STATUS_FAIL;
+  }
+  if (connect_agent() < 0)
+    return STATUS_COMM_ERR;
+  /* the length is sent in 32 bits, with zeros after the data */
+  if (len > (uint32_t)-1 - 8) {
+    fprintf(stderr, _("secret too large for the agent\n"));
+    return STATUS_FAIL;
+  }
+  size = sizeof(request2_put) + STRING2_SIZE(idlen)
+    + STRING2_SIZE(commentlen);
+  if (!(req = malloc(sizeof(header2) + size))) {
+    fprintf(stderr, _("out of memory\n"));
+    return STATUS_FAIL;
+  }
+  if (!(buf = secmem_malloc(STREAM_CHUNK))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    free(req);
+    return STATUS_FAIL;
+  }
+  put = (request2_put *)(req + 1);
+  memset(put, 0, sizeof(*put));
+  put->deadline = deadline;
+  put->flags = flags;
+  put->datalen = len;
+  put->idlen = idlen;
+  put->commentlen = commentlen;
+  p = (char *)(put + 1);
+  add_string2(&p, id, idlen);
+  add_string2(&p, comment, commentlen);
+  /* the header tells the length of all that follows, data included */
+  memset(req, 0, sizeof(header2));
+  req->magic = REQUEST2_MAGIC;
+  req->type = REQ_PUT_LARGE;
+  req->length = size + STRING2_SIZE(len);
+  if (xwrite(sock, req, sizeof(header2) + size) < 0) {
+    perror(_("could not send request"));
+    ret = STATUS_COMM_ERR;
+    goto cut;
+  }
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  for (; len; len -= n) {
+    /* only a GET started earlier is answered meanwhile - unless the agent
+       cannot take the data */
+    while (poll(&pfd, 1, 0) > 0) {
+      if ((ret = receive_header2(&rep)) != STATUS_OK)
+	goto cut;
+      if (!rep.tag) {
+	ret = rep.type != STATUS_OK ? rep.type : STATUS_COMM_ERR;
+	goto cut;
+      }
+      if ((ret = keep_reply(&rep)) != STATUS_OK)
+	goto cut;
+    }
+    n = len < STREAM_CHUNK ? len : STREAM_CHUNK;
+    if (xread(fd, buf, n) != n) {
+      fprintf(stderr, _("could not read all of the secret\n"));
+      ret = STATUS_FAIL;
+      goto cut;
+    }
+    if (xwrite(sock, buf, n) < 0) {
+      perror(_("could not send request"));
+      ret = STATUS_COMM_ERR;
+      goto cut;
+    }
+  }
+  if (xwrite(sock, zeros, STRING2_SIZE(put->datalen) - put->datalen) < 0) {
+    perror(_("could not send request"));
+    ret = STATUS_COMM_ERR;
+    goto cut;
+  }
+  if ((ret = receive_reply2(&rep)) != STATUS_OK)
+    goto cut;
+  ret = receive_body2(&rep, NULL, NULL, 0) == STATUS_OK
+    ? rep.type : STATUS_COMM_ERR;
+  goto done;
+
+ cut:
+  if (ret == OLD_AGENT) {
+    fprintf(stderr, _("the agent is too old for streamed secrets\n"));
+    ret = old_agent() < 0 ? STATUS_COMM_ERR : STATUS_FAIL;
+  } else if (reconnect() < 0)
+    ret = STATUS_COMM_ERR;
+ done:
+  secmem_free(buf);
+  free(req);
+  return ret;
+}
+
+/* what an old agent says to a GET_LARGE, which it does not know */
+static int get_stream1(const char *id, int fd)
+{
+  reply_get *rep;
+  int ret;
+
+  ret = agent_get(id, &rep);
+  if (ret == STATUS_OK && xwrite(fd, rep->data, strlen(rep->data)) < 0) {
+    perror(_("could not write the secret"));
+    ret = STATUS_FAIL;
+  }
+  if (rep)
+    secmem_free(rep);
+  return ret;
+}
+
+status_t agent_get_stream(const char *id, int fd)
+{
+  header2 *req, rep;
+  reply2_get body;
+  char *buf;
+  size_t len, n;
+  int ret, failed = 0;
+
+  if (version != 2)
+    return get_stream1(id, fd);
+  if (!(req = get2_request(id, 0, &len)))
+    return STATUS_FAIL;
+  ret = send2(req, REQ_GET_LARGE, len, 0);
+  free(req);
+  if (ret != STATUS_OK || (ret = receive_reply2(&rep)) == STATUS_COMM_ERR)
+    return ret;
+  if (ret == OLD_AGENT)
+    return old_agent() < 0 ? STATUS_COMM_ERR : get_stream1(id, fd);
+  if (rep.type != STATUS_OK)
+    return receive_body2(&rep, NULL, NULL, 0) == STATUS_OK
+      ? rep.type : STATUS_COMM_ERR;
+  if (rep.length >= sizeof(body) && receive(&body, sizeof(body)) < 0)
+    return STATUS_COMM_ERR;
+  if (rep.length < sizeof(body)
+      || rep.length != sizeof(body) + STRING2_SIZE(body.commentlen)
+      + STRING2_SIZE(body.datalen)) {
+    fprintf(stderr, _("malformed reply\n"));
+    return STATUS_COMM_ERR;
+  }
+  if (!(buf = secmem_malloc(STREAM_CHUNK))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return STATUS_COMM_ERR;
+  }
+  /* the comment is not wanted */
+  rep.length = STRING2_SIZE(body.commentlen);
+  ret = receive_body2(&rep, NULL, NULL, 0);
+  for (len = body.datalen; ret == STATUS_OK && len; len -= n) {
+    n = len < STREAM_CHUNK ? len : STREAM_CHUNK;
+    if (receive(buf, n) < 0)
+      ret = STATUS_COMM_ERR;
+    /* the rest is received anyway, to get at the next reply */
+    else if (!failed && xwrite(fd, buf, n) < 0) {
+      perror(_("could not write the secret"));
+      failed = 1;
+    }
+  }
+  secmem_free(buf);
+  if (ret != STATUS_OK)
+    return ret;
+  rep.length = STRING2_SIZE(body.datalen) - body.datalen;
+  if (receive_body2(&rep, NULL, NULL, 0) != STATUS_OK)
+    return STATUS_COMM_ERR;
+  return failed ? STATUS_FAIL : STATUS_OK;
+}
+
+status_t agent_get_fd(const char *id, int *fd, size_t *len)
+{
+  header2 *req, rep;
+  reply2_get body;
+  struct stat st;
+  size_t reqlen;
+  int s, ret;
+
+  *fd = -1;
+  if (version != 2 || !sockname)
+    return STATUS_RETRY;
+  if (!(req = get2_request(id, 0, &reqlen)))
+    return STATUS_FAIL;
+  /* a connection of its own, on which nothing comes before the memfd */
+  if ((s = connect_to(SOCK_STREAM, sockname, "", 0)) < 0) {
+    free(req);
+    return STATUS_COMM_ERR;
+  }
+  header2_init(req, REQ_GET_FD, reqlen, 0);
+  ret = xwrite(s, req, sizeof(header2) + reqlen);
+  free(req);
+  if (ret < 0) {
+    perror(_("could not send request"));
+    ret = STATUS_COMM_ERR;
+    goto done;
+  }
+  if (receive_fd(s, &rep, sizeof(rep), fd) != sizeof(rep)
+      || rep.magic != REPLY2_MAGIC) {
+    fprintf(stderr, _("no proper reply from the agent\n"));
+    ret = STATUS_COMM_ERR;
+    goto done;
+  }
+  if (rep.type != STATUS_OK) {
+    ret = rep.type;
+    goto done;
+  }
+  /* the comment is not wanted - the memfd is all there is to it */
+  if (rep.length < sizeof(body) || xread(s, &body, sizeof(body)) != sizeof(body)
+      || rep.length != sizeof(body) + STRING2_SIZE(body.commentlen)
+      || *fd == -1 || fstat(*fd, &st) < 0 || st.st_size != body.datalen) {
+    fprintf(stderr, _("malformed reply\n"));
+    ret = STATUS_COMM_ERR;
+    goto done;
+  }
+  *len = body.datalen;
+  ret = STATUS_OK;
+ done:
+  close(s);
+  if (ret != STATUS_OK && *fd != -1) {
+    close(*fd);
+    *fd = -1;
+  }
+  return ret;
+}
+
+/* send a version 2 WATCH with FLAGS and TAG, for PATTERN */
+static int watch2(const char *pattern, unsigned flags, unsigned tag)
+{
+  size_t patternlen = strlen(pattern), len;
+  header2 *req, rep;
+  request2_watch *watch;
+  char *p;
+  int ret;
+
+  len = sizeof(request2_watch) + STRING2_SIZE(patternlen);
+  if (!(req = malloc(sizeof(header2) + len))) {
+    fprintf(stderr, _("out of memory\n"));
+    return STATUS_FAIL;
+  }
+  watch = (request2_watch *)(req + 1);
+  memset(watch, 0, sizeof(*watch));
+  watch->flags = flags;
+  watch->patternlen = patternlen;
+  p = (char *)(watch + 1);
+  add_string2(&p, pattern, patternlen);
+  if ((ret = send2(req, REQ_WATCH, len, tag)) == STATUS_OK
+      && (ret = receive_tagged2(&rep, tag)) == STATUS_OK)
+    ret = receive_body2(&rep, NULL, NULL, 0) == STATUS_OK
+      ? rep.type : STATUS_COMM_ERR;
+  free(req);
+  if (ret == OLD_AGENT) {
+    fprintf(stderr, _("the agent is too old for watching secrets\n"));
+    ret = old_agent() < 0 ? STATUS_COMM_ERR : STATUS_FAIL;
+  }
+  return ret;
+}
+
+unsigned agent_watch(const char *pattern, int prefix)
+{
+  if (version != 2 || strlen(pattern) >= ID_LENGTH)
+    return 0;
+  /* the events are told apart from other replies by their tag */
+  if (!++last_tag)
+    ++last_tag;
+  if (watch2(pattern, prefix ? WATCH_PREFIX : 0, last_tag) != STATUS_OK)
+    return 0;
+  return last_tag;
+}
+
+status_t agent_unwatch(unsigned tag)
+{
+  if (version != 2)
+    return STATUS_FAIL;
+  return watch2("", WATCH_CANCEL, tag);
+}
+
+status_t agent_next_event(agent_event *ev)
+{
+  struct pending_event *e;
+  header2 rep;
+  int ret;
+
+  while (!events) {
+    if (version != 2 || sock == -1) {
+      fprintf(stderr, _("nothing is watched\n"));
+      return STATUS_FAIL;
+    }
+    if ((ret = receive_header2(&rep)) != STATUS_OK
+	|| (ret = keep_reply(&rep)) != STATUS_OK)
+      return ret == OLD_AGENT ? STATUS_COMM_ERR : ret;
+  }
+  e = events;
+  if (!(events = e->next))
+    events_tail = &events;
+  *ev = e->ev;
+  free(e);
+  return STATUS_OK;
+}
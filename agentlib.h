@@ -24,9 +24,131 @@
 int agent_init();
 int agent_done();
 status_t agent_list();
+/* list the secrets whose ids start with PATTERN, or, if GLOB, match it as
+   described in glob(7), sorted by id, and at most LIMIT of them, unless
+   that is 0.  *CURSOR is NULL for the first page; it is replaced with
+   what to go on with, in memory that has to be freed, or NULL after the
+   last page. */
+status_t agent_list_page(const char *pattern, int glob, unsigned limit,
+			 char **cursor, reply_list **reply);
 status_t agent_put(const char *id, const flags_t flags, const time_t deadline,
 		   const char *comment, const char *data);
 status_t agent_get(const char *id, reply_get **reply);
 status_t agent_delete(const char *id);
 
+/* like agent_get(), but if the secret still has *VERSION, which is what
+   a previous call stored there, the status is STATUS_UNCHANGED, and
+   nothing else is fetched.  Otherwise the version the secret has is
+   stored at *VERSION - 0 if the agent is too old to tell. */
+status_t agent_get_if(const char *id, unsigned *version, reply_get **reply);
+/* like agent_put(), but only if the secret has *VERSION, or none at all
+   if that is VERSION_NONE - otherwise the status is STATUS_CONFLICT.
+   With 0, it is stored whatever it has.  The version it is stored with
+   replaces *VERSION. */
+status_t agent_put_if(const char *id, const flags_t flags,
+		      const time_t deadline, const char *comment,
+		      const char *data, unsigned *version);
+/* like agent_delete(), but only if the secret has VERSION */
+status_t agent_delete_if(const char *id, unsigned version);
+
+/* give the secret under ID - or, if PREFIX, all whose ids start with it -
+   a new DEADLINE, which is 0 for none, without sending it again.  Unless
+   SLIDE is 0, the deadline moves on to SLIDE seconds after every time the
+   secret is handed out.  STATUS_FAIL if there is no such secret. */
+status_t agent_touch(const char *id, int prefix, time_t deadline,
+		     unsigned slide);
+
+/* have GETs, MGETs and PUTs go through rings in memory shared with the
+   agent, rather than a socket, as far as the agent can answer them right
+   away - it asks for them over a connection of their own.  Returns -1 if
+   the agent does not offer them, and then nothing changes. */
+int agent_use_shm();
+
+/* send a GET for ID, without waiting for the reply - any number of them
+   may be in flight at once.  Returns the tag it is known by, or 0 if it
+   could not be sent. */
+unsigned agent_get_start(const char *id);
+/* wait for the reply to the GET started with *TAG, or, if that is 0, for
+   whichever is answered first, and store its tag there.  Replies need not
+   come in the order the GETs were started.  Unless communication fails,
+   the reply is stored at *REPLY, like with agent_get(). */
+status_t agent_get_finish(unsigned *tag, reply_get **reply);
+
+/* a secret fetched with agent_mget() */
+typedef struct _agent_secret {
+  status_t status;		/* whether the secret was handed out */
+  flags_t flags;
+  time_t deadline;
+  const char *comment;		/* NULL unless status is STATUS_OK */
+  const char *data;		/* likewise - kept in secure memory */
+  unsigned version;		/* likewise */
+} agent_secret;
+
+typedef struct _reply_mget {
+  unsigned entries;		/* one for every id asked for, in order */
+  unsigned nbufs;		/* where comments and data are kept */
+  char **bufs;
+  agent_secret entry[1];
+} reply_mget;
+
+/* fetch the secrets under the N IDS in as few round trips as possible.
+   Unless communication fails, the reply is stored at *REPLY, and has to be
+   freed with agent_mget_free(). */
+status_t agent_mget(const char *const *ids, unsigned n, reply_mget **reply);
+void agent_mget_free(reply_mget *reply);
+
+/* an operation of a transaction */
+typedef struct _agent_op {
+  req_type type;		/* REQ_PUT or REQ_DELETE */
+  const char *id;
+  unsigned version;		/* that the secret has to have, or 0 - like
+				   with agent_put_if() */
+  flags_t flags;		/* the rest is only for REQ_PUT */
+  time_t deadline;
+  const char *comment;
+  const char *data;
+} agent_op;
+
+/* apply the N operations at OPS all at once, or none of them */
+status_t agent_txn(const agent_op *ops, unsigned n);
+
+/* store the LEN bytes read from FD as the secret under ID.  They may be
+   more than DATA_LENGTH - 1, and contain zero bytes.  They are sent in
+   chunks, as they are read, and are not kept anywhere else. */
+status_t agent_put_stream(const char *id, flags_t flags, time_t deadline,
+			  const char *comment, int fd, size_t len);
+/* write the secret under ID to FD, in chunks, as it is received - whether
+   it has been stored with agent_put_stream() or not */
+status_t agent_get_stream(const char *id, int fd);
+
+/* fetch the secret under ID, whether it has been stored with
+   agent_put_stream() or not, as a memfd: its descriptor is stored at *FD,
+   and the length of the secret at *LEN.  The memfd can be read, mapped
+   or spliced, but not written to; the agent wipes it once it forgets the
+   secret.  The descriptor is closed on exec, and has to be closed when it
+   is no longer needed.  STATUS_RETRY if the agent cannot hand it out like
+   this - agent_get_stream() may still work then. */
+status_t agent_get_fd(const char *id, int *fd, size_t *len);
+
+/* something that has happened to a watched secret */
+typedef struct _agent_event {
+  unsigned tag;			/* of the watch, as agent_watch() returned */
+  int type;			/* EVENT_* */
+  flags_t flags;		/* of the secret, like its deadline */
+  time_t deadline;
+  char id[ID_LENGTH];		/* empty for EVENT_LOST */
+} agent_event;
+
+/* have the agent tell about the secret under PATTERN - or, if PREFIX,
+   about all whose ids start with it - whenever it is stored, deleted or
+   expires.  Returns the tag of the events, or 0 if the agent refuses.
+   The watch lasts as long as the connection, which other requests go on
+   to use. */
+unsigned agent_watch(const char *pattern, int prefix);
+/* stop the watch with TAG */
+status_t agent_unwatch(unsigned tag);
+/* wait for the next event of any watch, and store it at *EV.  Events that
+   come in while other replies are waited for are kept until then. */
+status_t agent_next_event(agent_event *ev);
+
 #endif
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 
 #ifdef HAVE_CONFIG_H
@@ -116,10 +117,35 @@ char *find_id(int argc, char **argv)
   return NULL;
 }
 
+/* run_gpg - exec gpg with the arguments in ARGV, telling it to read the
+   passphrase from FD.  Returns only on errors. */
+void run_gpg(int fd, int argc, char **argv)
+{
+  char **args;
+  int i;
+
+  args = malloc(sizeof(char *) * (argc + 2));
+  if (!args) {
+    fprintf(stderr, _("out of memory\n"));
+    return;
+  }
+  args[0] = GPG;
+  args[1] = "--passphrase-fd";
+  if (asprintf(&args[2], "%d", fd) < 0) {
+    fprintf(stderr, _("out of memory\n"));
+    return;
+  }
+  for (i = 1; i < argc; i++)
+    args[i+2] = argv[i];
+  args[i+2] = NULL;
+  execvp(GPG, args);
+}
+
 int main(int argc, char **argv)
 {
   pid_t child;
-  int p[2];
+  int p[2], fd, ready;
+  size_t len;
   char *id;
 
   secmem_init(1);
@@ -139,6 +165,27 @@ int main(int argc, char **argv)
   if (!(id = find_id(argc, argv))) {
     return EXIT_FAILURE;
   }
+  /* gpg reads the passphrase straight from the agent's memfd, if it can
+     have it - a pipe is filled in otherwise */
+  if ((ready = agent_init() >= 0)) {
+    switch (agent_get_fd(id, &fd, &len)) {
+    case STATUS_OK:
+      agent_done();
+      if (fcntl(fd, F_SETFD, 0) < 0) {
+	perror(_("could not pass on passphrase"));
+	return EXIT_FAILURE;
+      }
+      run_gpg(fd, argc, argv);
+      return EXIT_FAILURE;
+    case STATUS_RETRY:
+      break;
+    default:
+      /* gpg is left to find out, like below */
+      fprintf(stderr, _("agent could not provide passphrase\n"));
+      ready = 0;
+      break;
+    }
+  }
   if (pipe(p) < 0) {
     perror(_("could not create pipe"));
     return EXIT_FAILURE;
@@ -151,7 +198,7 @@ int main(int argc, char **argv)
     int status;
 
     close(p[0]);
-    if (agent_init() >= 0) {
+    if (ready) {
       if (agent_get(id, &r) == STATUS_OK) {
 	if (write(p[1], r->data, strlen(r->data)) < 0)
 	  perror(_("error while writing passphrase"));
@@ -171,25 +218,8 @@ int main(int argc, char **argv)
     else
       return EXIT_FAILURE;
   } else {
-    char **args;
-    int i;
-
     close(p[1]);
-    args = malloc(sizeof(char *) * (argc + 2));
-    if (!args) {
-      fprintf(stderr, _("out of memory\n"));
-      return EXIT_FAILURE;
-    }
-    args[0] = GPG;
-    args[1] = "--passphrase-fd";
-    if (asprintf(&args[2], "%d", p[0]) < 0) {
-      fprintf(stderr, _("out of memory\n"));
-      return EXIT_FAILURE;
-    }
-    for (i = 1; i < argc; i++)
-      args[i+2] = argv[i];
-    args[i+2] = NULL;
-    execvp(GPG, args);
+    run_gpg(p[0], argc, argv);
     return EXIT_FAILURE;
   }
 }
@@ -0,0 +1,960 @@
+/* Quintuple Agent secret cache
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef USE_OPEN_TABLE
+#include "table.h"
+#else
+#include <glib.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "i18n.h"
+#include "memory.h"
+#include "cache.h"
+#include "util.h"
+
+#ifndef HAVE_STRDUP
+#include "strdup.h"
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#define RDLOCK(l)	pthread_rwlock_rdlock(l)
+#define WRLOCK(l)	pthread_rwlock_wrlock(l)
+#define RWUNLOCK(l)	pthread_rwlock_unlock(l)
+#define LOCK(m)		pthread_mutex_lock(m)
+#define UNLOCK(m)	pthread_mutex_unlock(m)
+#else
+#define RDLOCK(l)
+#define WRLOCK(l)
+#define RWUNLOCK(l)
+#define LOCK(m)
+#define UNLOCK(m)
+#endif
+
+/* a secret held by the agent */
+struct secret {
+  char *id;			/* in secure memory with the open table */
+  struct value *value;		/* in secure memory */
+  unsigned slot;		/* position in the deadline heap */
+  time_t expires;		/* where it is in there - cache_renew() may
+				   have moved the deadline on since */
+};
+
+#define NO_SLOT		((unsigned)-1)
+
+/* what a value is allocated as, with room for its comment and data, and
+   no more - only large secrets have data apart */
+struct stored {
+  struct value value;
+  uint32_t version;		/* 0 until it is inserted */
+  unsigned slide;		/* seconds a hand-out renews it for, or 0 */
+  struct large *large;
+  struct memfd *memfd;		/* handed out for GET_FD, or NULL */
+  char strings[1];		/* what COMMENT and DATA point to */
+};
+
+/* a memfd holding the data of a secret - apart from the value, since few
+   secrets ever get one */
+struct memfd {
+  int fd;
+  char *map;			/* where it is mapped, to be wiped */
+  size_t len;
+};
+
+/* Whoever gets the memfd may map it, but not write to it, nor resize it.
+   The agent still writes through the mapping it had before, to wipe it. */
+#ifdef F_ADD_SEALS
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+#define FD_SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE \
+			 | F_SEAL_SEAL)
+#endif
+
+struct shard {
+#ifdef HAVE_PTHREAD_H
+  pthread_rwlock_t lock;
+#endif
+#ifdef USE_OPEN_TABLE
+  struct table table;		/* struct secret by id */
+#else
+  GHashTable *table;
+#endif
+  struct secret **deadlines;	/* heap of secrets that expire, soonest first */
+  unsigned ndeadlines, deadlines_size;
+};
+
+static struct shard *shards;
+static unsigned nshards;
+
+/* the version given to a secret last */
+static uint32_t last_version = 0;
+
+/* cache_expire() has said that nothing expires before next_expiry.  Secrets
+   stored while it is looking through the shards are noted in
+   pending_expiry, so they cannot slip by. */
+static time_t next_expiry = 0, pending_expiry = 0;
+static void (*expiry_wakeup)(void);
+static void (*changed)(int what, const char *id, struct value *value);
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t expiry_lock = PTHREAD_MUTEX_INITIALIZER;
+/* protects the counts of large data */
+static pthread_mutex_t refs_lock = PTHREAD_MUTEX_INITIALIZER;
+/* lets a single reader set up the memfd of a secret */
+static pthread_mutex_t memfd_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define DEADLINE(sh, i)	((sh)->deadlines[i]->expires)
+
+/* put secret S into slot I of the deadline heap of SH */
+static void heap_set(struct shard *sh, unsigned i, struct secret *s)
+{
+  sh->deadlines[i] = s;
+  s->slot = i;
+}
+
+/* move the secret in slot I of the heap up to where it belongs */
+static void sift_up(struct shard *sh, unsigned i)
+{
+  struct secret *s = sh->deadlines[i];
+  unsigned parent;
+
+  for (; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (DEADLINE(sh, parent) <= s->expires)
+      break;
+    heap_set(sh, i, sh->deadlines[parent]);
+  }
+  heap_set(sh, i, s);
+}
+
+/* move the secret in slot I of the heap down to where it belongs */
+static void sift_down(struct shard *sh, unsigned i)
+{
+  struct secret *s = sh->deadlines[i];
+  unsigned child;
+
+  for (; (child = 2 * i + 1) < sh->ndeadlines; i = child) {
+    if (child + 1 < sh->ndeadlines
+	&& DEADLINE(sh, child + 1) < DEADLINE(sh, child))
+      child++;
+    if (s->expires <= DEADLINE(sh, child))
+      break;
+    heap_set(sh, i, sh->deadlines[child]);
+  }
+  heap_set(sh, i, s);
+}
+
+/* the secret under ID in SH, or NULL - and its value, stored at *VALUE
+   unless that is NULL, which the open table has at hand */
+static struct secret *find(struct shard *sh, const char *id,
+			   struct value **value)
+{
+#ifdef USE_OPEN_TABLE
+  return table_lookup(&sh->table, id, value);
+#else
+  struct secret *s = g_hash_table_lookup(sh->table, id);
+
+  if (s && value)
+    *value = s->value;
+  return s;
+#endif
+}
+
+#ifndef USE_OPEN_TABLE
+struct each {
+  void (*fn)(struct secret *, void *);
+  void *arg;
+};
+
+static void each_secret(char *id, struct secret *s, struct each *e)
+{
+  e->fn(s, e->arg);
+}
+#endif
+
+/* call FN for every secret in SH */
+static void each(struct shard *sh, void (*fn)(struct secret *, void *),
+		 void *arg)
+{
+#ifdef USE_OPEN_TABLE
+  table_foreach(&sh->table, fn, arg);
+#else
+  struct each e;
+
+  e.fn = fn;
+  e.arg = arg;
+  g_hash_table_foreach(sh->table, (GHFunc) each_secret, &e);
+#endif
+}
+
+/* a copy of ID - in secure memory, if the table is - or NULL */
+static char *copy_id(const char *id)
+{
+  char *copy;
+
+#ifdef USE_OPEN_TABLE
+  if (!(copy = secmem_malloc(strlen(id) + 1))) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return NULL;
+  }
+  strcpy(copy, id);
+#else
+  if (!(copy = strdup(id)))
+    fprintf(stderr, _("out of memory\n"));
+#endif
+  return copy;
+}
+
+static void free_id(char *id)
+{
+#ifdef USE_OPEN_TABLE
+  secmem_free(id);
+#else
+  free(id);
+#endif
+}
+
+/* make room in the heap of SH for N more secrets that expire */
+static int reserve_deadlines(struct shard *sh, unsigned n)
+{
+  unsigned size = sh->deadlines_size ? sh->deadlines_size : 64;
+  struct secret **d;
+
+  while (size < sh->ndeadlines + n)
+    size *= 2;
+  if (size == sh->deadlines_size)
+    return 0;
+  if (!(d = realloc(sh->deadlines, size * sizeof(struct secret *)))) {
+    fprintf(stderr, _("out of memory\n"));
+    return -1;
+  }
+  sh->deadlines = d;
+  sh->deadlines_size = size;
+  return 0;
+}
+
+int cache_reserve(struct shard *sh, unsigned n, unsigned expiring)
+{
+#ifdef USE_OPEN_TABLE
+  if (table_reserve(&sh->table, n) < 0)
+    return -1;
+#endif
+  return reserve_deadlines(sh, expiring);
+}
+
+/* remember when S expires - there has to be room */
+static void add_deadline(struct shard *sh, struct secret *s)
+{
+  s->expires = s->value->deadline;
+  heap_set(sh, sh->ndeadlines, s);
+  sift_up(sh, sh->ndeadlines++);
+}
+
+/* forget when S expires */
+static void remove_deadline(struct shard *sh, struct secret *s)
+{
+  unsigned i = s->slot;
+  struct secret *last;
+
+  if (i == NO_SLOT)
+    return;
+  s->slot = NO_SLOT;
+  last = sh->deadlines[--sh->ndeadlines];
+  if (i < sh->ndeadlines) {
+    heap_set(sh, i, last);
+    sift_up(sh, i);
+    sift_down(sh, last->slot);
+  }
+}
+
+/* note that something expires at DEADLINE, and wake up whoever calls
+   cache_expire() if that is earlier than it was told */
+static void note_deadline(time_t deadline)
+{
+  int wake = 0;
+
+  LOCK(&expiry_lock);
+  if (!next_expiry || deadline < next_expiry) {
+    next_expiry = deadline;
+    wake = 1;
+  }
+  if (!pending_expiry || deadline < pending_expiry)
+    pending_expiry = deadline;
+  UNLOCK(&expiry_lock);
+  if (wake && expiry_wakeup)
+    expiry_wakeup();
+}
+
+int cache_init(unsigned n, void (*wakeup)(void),
+	       void (*notify)(int what, const char *id, struct value *value))
+{
+  unsigned i;
+
+  if (!(shards = calloc(n, sizeof(struct shard)))) {
+    fprintf(stderr, _("out of memory\n"));
+    return -1;
+  }
+  nshards = n;
+  for (i = 0; i < n; i++) {
+#ifdef HAVE_PTHREAD_H
+    pthread_rwlock_init(&shards[i].lock, NULL);
+#endif
+#ifndef USE_OPEN_TABLE
+    shards[i].table = g_hash_table_new(g_str_hash, g_str_equal);
+#endif
+  }
+  expiry_wakeup = wakeup;
+  changed = notify;
+  return 0;
+}
+
+size_t cache_memory(unsigned nshards, unsigned n)
+{
+#ifdef USE_OPEN_TABLE
+  /* the ids are in secure memory as well */
+  return table_memory(nshards, n) + n * secmem_block_size(TABLE_INLINE / 2);
+#else
+  return 0;
+#endif
+}
+
+struct shard *cache_shard(const char *id)
+{
+#ifdef USE_OPEN_TABLE
+  return nshards > 1 ? &shards[table_hash(id) % nshards] : shards;
+#else
+  return nshards > 1 ? &shards[g_str_hash(id) % nshards] : shards;
+#endif
+}
+
+void cache_read_lock(struct shard *sh)
+{
+  RDLOCK(&sh->lock);
+}
+
+void cache_write_lock(struct shard *sh)
+{
+  WRLOCK(&sh->lock);
+}
+
+void cache_unlock(struct shard *sh)
+{
+  RWUNLOCK(&sh->lock);
+}
+
+void cache_lock_all()
+{
+  unsigned i;
+
+  for (i = 0; i < nshards; i++)
+    RDLOCK(&shards[i].lock);
+}
+
+void cache_unlock_all()
+{
+  unsigned i;
+
+  for (i = nshards; i-- > 0; )
+    RWUNLOCK(&shards[i].lock);
+}
+
+struct value *cache_lookup(struct shard *sh, const char *id)
+{
+  struct value *value;
+
+  if (!find(sh, id, &value))
+    return NULL;
+  /* expired, but cache_expire() has not been called since */
+  if (value->deadline && value->deadline < time(NULL))
+    return NULL;
+  return value;
+}
+
+/* forget the secret under ID, telling the watcher WHAT has happened - or
+   nothing, if WHAT is negative.  Returns whether there was one. */
+static int forget(struct shard *sh, const char *id, int what)
+{
+  struct secret *s;
+
+  if ((s = find(sh, id, NULL)) == NULL)
+    return 0;
+  if (what >= 0 && changed)
+    changed(what, s->id, s->value);
+#ifdef USE_OPEN_TABLE
+  table_remove(&sh->table, id);
+#else
+  g_hash_table_remove(sh->table, id);
+#endif
+  remove_deadline(sh, s);
+  cache_discard(s);
+  return 1;
+}
+
+void cache_delete(struct shard *sh, const char *id)
+{
+  forget(sh, id, EVENT_DELETE);
+}
+
+/* a secret under ID, with room for DATALEN bytes of data, which are not
+   filled in yet */
+static struct secret *new_secret(const char *id, flags_t flags,
+				 time_t deadline, const char *comment,
+				 size_t datalen)
+{
+  size_t commentlen = strlen(comment);
+  struct secret *s;
+  struct stored *st;
+
+  st = secmem_malloc(offsetof(struct stored, strings) + commentlen + 1
+		     + datalen + 1);
+  if (!st) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return NULL;
+  }
+  if (!(s = malloc(sizeof(struct secret)))) {
+    fprintf(stderr, _("out of memory\n"));
+    secmem_free(st);
+    return NULL;
+  }
+  if (!(s->id = copy_id(id))) {
+    free(s);
+    secmem_free(st);
+    return NULL;
+  }
+  st->value.flags = flags;
+  st->value.deadline = deadline;
+  st->value.comment = st->strings;
+  st->value.commentlen = commentlen;
+  memcpy(st->value.comment, comment, commentlen + 1);
+  st->value.data = st->strings + commentlen + 1;
+  st->value.datalen = 0;
+  st->value.data[0] = 0;
+  st->version = 0;
+  st->slide = 0;
+  st->large = NULL;
+  st->memfd = NULL;
+  s->value = &st->value;
+  s->slot = NO_SLOT;
+  return s;
+}
+
+struct secret *cache_prepare(const char *id, flags_t flags, time_t deadline,
+			     const char *comment, const char *data)
+{
+  size_t len = strlen(data);
+  struct secret *s;
+
+  if ((s = new_secret(id, flags, deadline, comment, len)) != NULL) {
+    memcpy(s->value->data, data, len + 1);
+    s->value->datalen = len;
+  }
+  return s;
+}
+
+struct secret *cache_prepare_large(const char *id, flags_t flags,
+				   time_t deadline, const char *comment,
+				   size_t len, char **data)
+{
+  struct secret *s;
+  struct large *l;
+
+  l = secmem_malloc(offsetof(struct large, data) + len);
+  if (!l) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return NULL;
+  }
+  /* should it turn out to be a regular one, the data moves in with the
+     comment */
+  if (!(s = new_secret(id, flags | FLAGS_LARGE, deadline, comment,
+		       len < DATA_LENGTH ? len : 0))) {
+    secmem_free(l);
+    return NULL;
+  }
+  l->refs = 1;
+  l->len = len;
+  ((struct stored *)s->value)->large = l;
+  *data = l->data;
+  return s;
+}
+
+void cache_finish_large(struct secret *s)
+{
+  struct stored *st = (struct stored *)s->value;
+  struct large *l = st->large;
+
+  if (l->len < DATA_LENGTH && !memchr(l->data, 0, l->len)) {
+    memcpy(st->value.data, l->data, l->len);
+    st->value.data[l->len] = 0;
+    st->value.datalen = l->len;
+    st->value.flags &= ~FLAGS_LARGE;
+    st->large = NULL;
+    cache_release(l);
+  }
+}
+
+struct large *cache_hold(struct value *value)
+{
+  struct large *l = ((struct stored *)value)->large;
+
+  if (l) {
+    LOCK(&refs_lock);
+    l->refs++;
+    UNLOCK(&refs_lock);
+  }
+  return l;
+}
+
+void cache_release(struct large *l)
+{
+  unsigned refs;
+
+  if (!l)
+    return;
+  LOCK(&refs_lock);
+  refs = --l->refs;
+  UNLOCK(&refs_lock);
+  if (!refs)
+    secmem_free(l);
+}
+
+/* put the data of ST into a new memfd, and seal it.  Returns -1 on
+   errors, with errno set. */
+static int make_memfd(struct stored *st)
+{
+#ifdef F_ADD_SEALS
+  const char *data = st->large ? st->large->data : st->value.data;
+  size_t len = st->large ? st->large->len : st->value.datalen;
+  struct memfd *m;
+  char *map = NULL;
+  int fd, err;
+
+  if (!(m = malloc(sizeof(struct memfd))))
+    return -1;
+  if ((fd = create_memfd("q-agent-secret")) < 0) {
+    free(m);
+    return -1;
+  }
+  if (ftruncate(fd, len) < 0)
+    goto failed;
+  /* an empty one cannot be mapped, and there is nothing to wipe */
+  if (len) {
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      map = NULL;
+      goto failed;
+    }
+    /* it is a copy of the secret, which must not be swapped out either */
+    if (mlock(map, len) < 0)
+      goto failed;
+    memcpy(map, data, len);
+  }
+  if (fcntl(fd, F_ADD_SEALS, FD_SEALS) < 0)
+    goto failed;
+  m->fd = fd;
+  m->map = map;
+  m->len = len;
+  st->memfd = m;
+  return 0;
+
+ failed:
+  err = errno;
+  if (map) {
+    wipe(map, len);
+    munmap(map, len);
+  }
+  close(fd);
+  free(m);
+  errno = err;
+  return -1;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* wipe the memfd of ST, if it has one, and let go of it */
+static void drop_memfd(struct stored *st)
+{
+  struct memfd *m = st->memfd;
+
+  if (!m)
+    return;
+  if (m->map) {
+    wipe(m->map, m->len);
+    munmap(m->map, m->len);
+  }
+  close(m->fd);
+  free(m);
+  st->memfd = NULL;
+}
+
+int cache_open_fd(struct value *value, size_t *len)
+{
+  struct stored *st = (struct stored *)value;
+  char path[40];
+  int fd;
+
+  LOCK(&memfd_lock);
+  if (!st->memfd && make_memfd(st) < 0) {
+    UNLOCK(&memfd_lock);
+    return -1;
+  }
+  /* a file description of its own, with an offset of its own, which does
+     not allow writing - the memfd itself could be reopened for that, but
+     the seals keep anything from being written */
+  sprintf(path, "/proc/self/fd/%d", st->memfd->fd);
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    fd = fcntl(st->memfd->fd, F_DUPFD_CLOEXEC, 0);
+  *len = st->memfd->len;
+  UNLOCK(&memfd_lock);
+  return fd;
+}
+
+static void wipe_fd(struct secret *s, void *unused)
+{
+  drop_memfd((struct stored *)s->value);
+}
+
+void cache_wipe_fds()
+{
+  unsigned i;
+
+  for (i = 0; i < nshards; i++) {
+    WRLOCK(&shards[i].lock);
+    each(&shards[i], wipe_fd, NULL);
+    RWUNLOCK(&shards[i].lock);
+  }
+}
+
+void cache_discard(struct secret *s)
+{
+  drop_memfd((struct stored *)s->value);
+  free_id(s->id);
+  cache_release(((struct stored *)s->value)->large);
+  secmem_free(s->value);
+  free(s);
+}
+
+/* a version that has not been given to any secret yet */
+static uint32_t new_version()
+{
+  uint32_t v;
+
+  /* after 2^32 - 2 of them, they start over */
+  do
+    v = __atomic_add_fetch(&last_version, 1, __ATOMIC_RELAXED);
+  while (v == 0 || v == VERSION_NONE);
+  return v;
+}
+
+uint32_t cache_version(struct value *value)
+{
+  return ((struct stored *)value)->version;
+}
+
+int cache_has_version(struct shard *sh, const char *id, uint32_t version)
+{
+  struct value *value;
+
+  if (!version)
+    return 1;
+  if (!(value = cache_lookup(sh, id)))
+    return version == VERSION_NONE;
+  return cache_version(value) == version;
+}
+
+uint32_t cache_last_version()
+{
+  return __atomic_load_n(&last_version, __ATOMIC_RELAXED);
+}
+
+void cache_resume_versions(uint32_t last)
+{
+  if (last > last_version)
+    last_version = last;
+}
+
+const char *cache_id(struct secret *s)
+{
+  return s->id;
+}
+
+struct value *cache_value(struct secret *s)
+{
+  return s->value;
+}
+
+void cache_keep_version(struct secret *s, uint32_t version)
+{
+  ((struct stored *)s->value)->version = version;
+}
+
+void cache_insert(struct shard *sh, struct secret *s)
+{
+  struct stored *st = (struct stored *)s->value;
+
+  debugmsg("storing at %p\n", s->value);
+  if (!st->version)
+    st->version = new_version();
+  /* delete old version cleanly, since it will be overwritten anyway */
+  forget(sh, s->id, -1);
+  if (s->value->deadline)
+    add_deadline(sh, s);
+#ifdef USE_OPEN_TABLE
+  table_insert(&sh->table, s->id, s, s->value);
+#else
+  g_hash_table_insert(sh->table, s->id, s);
+#endif
+  if (s->value->deadline)
+    note_deadline(s->value->deadline);
+  if (changed)
+    changed(EVENT_PUT, s->id, s->value);
+}
+
+/* give S in SH a new DEADLINE, and SLIDE - there has to be room in the
+   heap, if it had no deadline before */
+static void touch(struct shard *sh, struct secret *s, time_t deadline,
+		  unsigned slide)
+{
+  ((struct stored *)s->value)->slide = slide;
+  s->value->deadline = deadline;
+  if (!deadline)
+    remove_deadline(sh, s);
+  else if (s->slot == NO_SLOT)
+    add_deadline(sh, s);
+  else {
+    /* earlier or later */
+    s->expires = deadline;
+    sift_up(sh, s->slot);
+    sift_down(sh, s->slot);
+  }
+  if (deadline)
+    note_deadline(deadline);
+}
+
+int cache_touch(struct shard *sh, const char *id, time_t deadline,
+		unsigned slide)
+{
+  struct secret *s;
+
+  if (!cache_lookup(sh, id))
+    return 0;
+  s = find(sh, id, NULL);
+  if (deadline && s->slot == NO_SLOT && reserve_deadlines(sh, 1) < 0)
+    return -1;
+  touch(sh, s, deadline, slide);
+  return 1;
+}
+
+/* the secrets of a shard that cache_touch_prefix() is looking for */
+struct touch {
+  const char *prefix;
+  size_t len;
+  time_t now;
+  struct secret **found;
+  unsigned n, size;
+  int failed;			/* out of memory */
+};
+
+static void find_prefixed(struct secret *s, void *arg)
+{
+  struct touch *t = arg;
+  struct secret **f;
+
+  if (t->failed || strncmp(s->id, t->prefix, t->len) != 0
+      || (s->value->deadline && s->value->deadline < t->now))
+    return;
+  if (t->n == t->size) {
+    if (!(f = realloc(t->found, 2 * t->size * sizeof(*f)))) {
+      t->failed = 1;
+      return;
+    }
+    t->found = f;
+    t->size *= 2;
+  }
+  t->found[t->n++] = s;
+}
+
+int cache_touch_prefix(const char *prefix, time_t deadline, unsigned slide)
+{
+  struct touch t;
+  unsigned i, j, room;
+  int n = 0;
+
+  t.prefix = prefix;
+  t.len = strlen(prefix);
+  t.now = time(NULL);
+  t.size = 16;
+  t.failed = 0;
+  if (!(t.found = malloc(t.size * sizeof(*t.found)))) {
+    fprintf(stderr, _("out of memory\n"));
+    return -1;
+  }
+  for (i = 0; i < nshards && n >= 0; i++) {
+    struct shard *sh = &shards[i];
+    WRLOCK(&sh->lock);
+    t.n = 0;
+    each(sh, find_prefixed, &t);
+    for (j = room = 0; j < t.n; j++)
+      if (t.found[j]->slot == NO_SLOT)
+	room++;
+    if (t.failed)
+      fprintf(stderr, _("out of memory\n"));
+    if (t.failed || (deadline && room && reserve_deadlines(sh, room) < 0))
+      n = -1;
+    else {
+      for (j = 0; j < t.n; j++)
+	touch(sh, t.found[j], deadline, slide);
+      n += t.n;
+    }
+    RWUNLOCK(&sh->lock);
+  }
+  free(t.found);
+  return n;
+}
+
+void cache_renew(struct value *value)
+{
+  unsigned slide = ((struct stored *)value)->slide;
+  time_t deadline;
+
+  if (!slide)
+    return;
+  /* readers of the shard may do this at the same time - whoever is last
+     may set it back by the second that lies between them, at worst */
+  deadline = time(NULL) + slide;
+  if (deadline > __atomic_load_n(&value->deadline, __ATOMIC_RELAXED))
+    __atomic_store_n(&value->deadline, deadline, __ATOMIC_RELAXED);
+}
+
+unsigned cache_slide(struct value *value)
+{
+  return ((struct stored *)value)->slide;
+}
+
+struct value *cache_store(struct shard *sh, const char *id, flags_t flags,
+			  time_t deadline, const char *comment,
+			  const char *data)
+{
+  struct secret *s;
+
+  if (!(s = cache_prepare(id, flags, deadline, comment, data)))
+    return NULL;
+  if (cache_reserve(sh, 1, deadline != 0) < 0) {
+    cache_discard(s);
+    return NULL;
+  }
+  cache_insert(sh, s);
+  return s->value;
+}
+
+unsigned cache_size()
+{
+  unsigned i, n = 0;
+
+  for (i = 0; i < nshards; i++)
+#ifdef USE_OPEN_TABLE
+    n += shards[i].table.used;
+#else
+    n += g_hash_table_size(shards[i].table);
+#endif
+  return n;
+}
+
+struct visit {
+  void (*fn)(const char *, struct value *, void *);
+  void *arg;
+};
+
+static void visit_secret(struct secret *s, void *arg)
+{
+  struct visit *v = arg;
+
+  v->fn(s->id, s->value, v->arg);
+}
+
+void cache_foreach(void (*fn)(const char *id, struct value *value,
+			      void *arg),
+		   void *arg)
+{
+  struct visit v;
+  unsigned i;
+
+  v.fn = fn;
+  v.arg = arg;
+  for (i = 0; i < nshards; i++)
+    each(&shards[i], visit_secret, &v);
+}
+
+time_t cache_expire()
+{
+  time_t now = time(NULL), next = 0;
+  unsigned i;
+
+  LOCK(&expiry_lock);
+  if (!next_expiry || next_expiry >= now) {
+    next = next_expiry;
+    UNLOCK(&expiry_lock);
+    return next;
+  }
+  pending_expiry = 0;
+  UNLOCK(&expiry_lock);
+  for (i = 0; i < nshards; i++) {
+    struct shard *sh = &shards[i];
+    WRLOCK(&sh->lock);
+    while (sh->ndeadlines && DEADLINE(sh, 0) < now) {
+      struct secret *s = sh->deadlines[0];
+      /* handed out since it was put there, and renewed */
+      if (s->value->deadline > s->expires) {
+	s->expires = s->value->deadline;
+	sift_down(sh, 0);
+	continue;
+      }
+      debugmsg("forgetting %s\n", sh->deadlines[0]->id);
+      forget(sh, sh->deadlines[0]->id, EVENT_EXPIRE);
+    }
+    if (sh->ndeadlines && (!next || DEADLINE(sh, 0) < next))
+      next = DEADLINE(sh, 0);
+    RWUNLOCK(&sh->lock);
+  }
+  LOCK(&expiry_lock);
+  if (pending_expiry && (!next || pending_expiry < next))
+    next = pending_expiry;
+  next_expiry = next;
+  UNLOCK(&expiry_lock);
+  return next;
+}
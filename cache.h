@@ -0,0 +1,156 @@
+/* Quintuple Agent secret cache
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "agent.h"
+
+/* A secret as the cache holds it, in secure memory: its comment and data
+   follow right behind, taking as many bytes as they are long, plus a
+   NUL.  Replies are put together from the pieces.  The data of a large
+   secret (FLAGS_LARGE) is held apart, and DATA is empty. */
+struct value {
+  flags_t flags;		/* miscellaneous flags - see agent.h */
+  time_t deadline;		/* will forget after this deadline */
+  char *comment;
+  char *data;
+  uint32_t commentlen, datalen;
+};
+
+/* The secrets are spread over shards by the hash of their id.  Every shard
+   has a lock of its own, which has to be held around all accesses to the
+   shard - for reading by lookups, for writing by everything else. */
+struct shard;
+
+/* set up the cache with NSHARDS shards.  WAKEUP is called whenever a
+   secret expires earlier than cache_expire() has said.  CHANGED, if not
+   NULL, is told whenever a secret is stored, deleted or expires, as
+   EVENT_*, with its shard locked for writing. */
+int cache_init(unsigned nshards, void (*wakeup)(void),
+	       void (*changed)(int what, const char *id, struct value *value));
+/* about how much secure memory NSHARDS shards take to keep track of N
+   secrets with short ids, besides what the secrets take */
+size_t cache_memory(unsigned nshards, unsigned n);
+struct shard *cache_shard(const char *id); /* the shard holding ID */
+void cache_read_lock(struct shard *);
+void cache_write_lock(struct shard *);
+void cache_unlock(struct shard *);
+void cache_lock_all(void);	/* read lock all shards, in order */
+void cache_unlock_all(void);
+
+/* the secret under ID, or NULL if it is unknown or has expired */
+struct value *cache_lookup(struct shard *, const char *id);
+/* store a secret under ID, replacing any old one - NULL if out of memory */
+struct value *cache_store(struct shard *, const char *id, flags_t flags,
+			  time_t deadline, const char *comment, const char *data);
+void cache_delete(struct shard *, const char *id);
+
+/* give the secret under ID in SH a new DEADLINE - or none, if that is 0
+   - and, unless SLIDE is 0, have cache_renew() move it on to SLIDE
+   seconds after every time the secret is handed out.  With the shard
+   locked for writing.  Returns whether there is such a secret, or -1 if
+   out of memory, and then nothing changes. */
+int cache_touch(struct shard *, const char *id, time_t deadline,
+		unsigned slide);
+/* the same for all secrets whose ids start with PREFIX - one shard after
+   the other, with no lock held by the caller.  Returns how many there
+   are, or -1 if out of memory, and then those in the shards not done yet
+   are left as they are. */
+int cache_touch_prefix(const char *prefix, time_t deadline, unsigned slide);
+/* the secret VALUE is handed out now - with the shard locked, for reading
+   will do.  cache_expire() catches up with the deadline it moves on to
+   once the one before has passed. */
+void cache_renew(struct value *value);
+/* the SLIDE of the secret VALUE */
+unsigned cache_slide(struct value *value);
+
+/* Every secret that is stored gets a version higher than that of all
+   stored before it, starting at 1, and never VERSION_NONE - so whoever
+   has seen a version of a secret can tell whether it has changed since.
+   These are that of the secret VALUE, and whether the secret under ID in
+   SH has VERSION, which is true for 0 whatever it has, and for
+   VERSION_NONE if there is none. */
+uint32_t cache_version(struct value *value);
+int cache_has_version(struct shard *, const char *id, uint32_t version);
+/* the version given to a secret last */
+uint32_t cache_last_version(void);
+/* when taking over: go on with versions after LAST, as well */
+void cache_resume_versions(uint32_t last);
+
+/* Storing in steps, so that several secrets can be stored at once, or not
+   at all: a secret is prepared without any lock held - NULL if out of
+   memory - and then inserted, with the shard locked for writing.  Room
+   for N of them, EXPIRING of which have a deadline, has to be reserved
+   before, with the same lock.  A prepared secret that is not inserted
+   after all is discarded. */
+struct secret;
+struct secret *cache_prepare(const char *id, flags_t flags, time_t deadline,
+			     const char *comment, const char *data);
+int cache_reserve(struct shard *, unsigned n, unsigned expiring);
+void cache_insert(struct shard *, struct secret *);
+void cache_discard(struct secret *);
+/* the id of the prepared secret S, and its value */
+const char *cache_id(struct secret *s);
+struct value *cache_value(struct secret *s);
+/* have the prepared secret S inserted with VERSION, rather than a new one
+   - when taking over */
+void cache_keep_version(struct secret *s, uint32_t version);
+
+/* The data of a large secret (FLAGS_LARGE) is kept apart from its value,
+   and counted, so that it can be sent while the secret is replaced or
+   forgotten meanwhile.  A large secret is prepared with room for LEN
+   bytes of data, which are filled in at *DATA before it is inserted. */
+struct large {
+  unsigned refs;
+  size_t len;
+  char data[1];
+};
+struct secret *cache_prepare_large(const char *id, flags_t flags,
+				   time_t deadline, const char *comment,
+				   size_t len, char **data);
+/* once the data is filled in: a large secret that turns out to be short,
+   and free of zero bytes, is made a regular one */
+void cache_finish_large(struct secret *);
+/* the data of the secret VALUE, if it is large, held until released - with
+   the shard locked */
+struct large *cache_hold(struct value *value);
+void cache_release(struct large *);
+
+/* a new read-only descriptor of a sealed memfd holding the data of the
+   secret VALUE, whose length is stored at *LEN - with the shard locked.
+   The memfd is set up when it is first asked for, and wiped when the
+   secret is forgotten.  -1 on errors, with errno set. */
+int cache_open_fd(struct value *value, size_t *len);
+/* wipe all memfds handed out so far - with no lock held.  Secrets that are
+   asked for again get new ones. */
+void cache_wipe_fds(void);
+
+/* with all shards locked: the number of secrets, and a way to visit them */
+unsigned cache_size(void);
+void cache_foreach(void (*fn)(const char *id, struct value *value,
+			      void *arg),
+		   void *arg);
+
+/* forget all secrets whose deadline has passed.  Returns when the next
+   one expires, or 0 if none does.  No lock may be held by the caller. */
+time_t cache_expire(void);
+
+#endif
@@ -27,11 +27,16 @@
 #include <string.h>
 #include <termios.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #else 
@@ -44,6 +49,9 @@
 #include "memory.h"
 #include "util.h"
 
+/* how many entries are asked for at once by a filtered LIST */
+#define LIST_PAGE	64
+
 int debug = 0;
 char *query_options = "";
 
@@ -52,20 +60,64 @@ void usage()
 {
     printf(_("Usage: q-client [OPTION]... put ID [COMMENT]\n\
        q-client [OPTION]... {get|delete} ID\n\
-       q-client [OPTION]... list\n\
+       q-client [OPTION]... mget ID...\n\
+       q-client [OPTION]... txn {put ID COMMENT|delete ID}...\n\
+       q-client [OPTION]... list [PATTERN]\n\
+       q-client [OPTION]... watch ID...\n\
+       q-client [OPTION]... touch ID\n\
 `put' reads a secret from stdin and stores it with the agent under ID with\n\
 COMMENT, if specified, attached to it.\n\
 `get' fetches the secret under ID, and prints it to stdout.\n\
+`mget' fetches the secrets under all IDs at once, and prints one line for\n\
+each, which is empty if the secret is not available.\n\
+`txn' stores and deletes secrets all at once, or not at all.  The secrets\n\
+to store are read from stdin, one per line.\n\
 `delete' induces the agent to forget the secret under ID.\n\
-`list' lists the ids of all known secrets along with their comments.\n\
+`list' lists the ids of all known secrets, or of those matching the glob\n\
+PATTERN, along with their comments.\n\
+`watch' prints a line whenever a secret under one of the IDs is stored,\n\
+deleted, or expires.  An ID ending in `*' stands for all starting with\n\
+what comes before.\n\
+`touch' gives the secret under ID a new time-to-live, or none, without\n\
+storing it again.  An ID ending in `*' stands for all starting with what\n\
+comes before.\n\
 \n\
-Options relevant to `put':\n\
+Options relevant to `put' and `txn':\n\
   -i, --insure             ask again, before giving out a secret\n\
   -q, --query-options OPT  pass options OPT through to the query program\n\
+\n\
+Options relevant to `put', `txn' and `touch':\n\
   -t, --time-to-live N     forget the secret after N seconds\n\
 \n\
+Options relevant to `touch':\n\
+  -S, --sliding            forget the secret only once it has not been\n\
+                           fetched for N seconds\n\
+\n\
+Options relevant to `put', `get' and `delete':\n\
+  -e, --if-version N       only store or delete the secret if it has version\n\
+                           N, or none at all if N is `none' - or only fetch\n\
+                           it if it has not got version N anymore\n\
+  -v, --print-version      print the version of the secret fetched or\n\
+                           stored to stderr\n\
+\n\
+Options relevant to `put' and `get':\n\
+  -s, --stream             move the secret as it is, in chunks, between the\n\
+                           agent and stdin, which has to be a file, or\n\
+                           stdout - it may be large, and binary\n\
+\n\
+Options relevant to `get':\n\
+  -z, --zero-copy          like --stream, but have the agent hand out the\n\
+                           secret in a sealed memfd, and copy it to stdout\n\
+                           from there\n\
+\n\
+Options relevant to `list' and `watch':\n\
+  -n, --max-entries N      list no more than the first N ids, in order, or\n\
+                           stop watching after N events\n\
+\n\
 General options:\n\
   -d, --debug            turn on debugging output\n\
+  -m, --shm              ask through rings in memory shared with the agent,\n\
+                         if it offers them\n\
       --help             display this help and exit\n\
       --version          output version information and exit\n\n"));
 }
@@ -81,6 +133,9 @@ void check_status(status_t re)
   case STATUS_OK: status = "OK"; break;
   case STATUS_FAIL: status = "FAIL"; break;
   case STATUS_COMM_ERR: status = "COMM_ERR"; break;
+  case STATUS_RETRY: status = "RETRY"; break;
+  case STATUS_UNCHANGED: status = "UNCHANGED"; break;
+  case STATUS_CONFLICT: status = "CONFLICT"; break;
   default: assert(0);
   }
   debugmsg("agent replied: %s\n", status);
@@ -159,20 +214,169 @@ char *xgetpass(char *prompt)
   return buf;
 }  
 
+/* ask_secret - read the secret to store under ID, into secure storage */
+char *ask_secret(const char *id)
+{
+  char *buf, *s;
+
+  if (asprintf(&buf, _("Enter secret to store under \"%s\": "), id) < 0) {
+    perror(_("out of memory"));
+    return NULL;
+  }
+  s = xgetpass(buf);
+  free(buf);
+  return s;
+}
+
+/* put_options - the FLAGS and DEADLINE that the options ask for */
+void put_options(int opt_insure, char *opt_ttl, flags_t *flags,
+		 time_t *deadline)
+{
+  *flags = 0;
+  if (opt_insure)
+    *flags |= FLAGS_INSURE;
+  if (opt_ttl) {
+    char *err;
+    *deadline = time(NULL);
+    *deadline += strtoul(opt_ttl, &err, 10);
+    if (*err) {
+      fprintf(stderr, _("%s: invalid time-to-live\n"), opt_ttl);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    *deadline = 0;
+  }
+}
+
+/* parse_version - the version OPT_VERSION names, or 0 if it is NULL */
+unsigned parse_version(char *opt_version)
+{
+  unsigned long v;
+  char *err;
+
+  if (!opt_version)
+    return 0;
+  if (strcmp(opt_version, "none") == 0)
+    return VERSION_NONE;
+  v = strtoul(opt_version, &err, 10);
+  if (*err || !v || v >= VERSION_NONE) {
+    fprintf(stderr, _("%s: invalid version\n"), opt_version);
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+/* stream_length - how many bytes are left to read from FD, which has to be
+   a regular file */
+off_t stream_length(int fd)
+{
+  struct stat st;
+  off_t pos;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+      || (pos = lseek(fd, 0, SEEK_CUR)) < 0) {
+    fprintf(stderr, _("stdin has to be a file to stream a secret from it\n"));
+    return -1;
+  }
+  return st.st_size > pos ? st.st_size - pos : 0;
+}
+
+/* copy_fd - write the LEN bytes in the memfd FD to OUT - by the kernel, if
+   it can, or else from a mapping.  Returns -1 on errors. */
+int copy_fd(int fd, size_t len, int out)
+{
+  off_t off = 0;
+  char *map;
+  int ret;
+#ifdef HAVE_SENDFILE
+  ssize_t n;
+#endif
+
+  if (!len)
+    return 0;
+#ifdef HAVE_SENDFILE
+
+  while (off < len) {
+    if ((n = sendfile(out, fd, &off, len - off)) < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+  }
+  if (off == len)
+    return 0;
+  if (n == 0 || (errno != EINVAL && errno != ENOSYS)) {
+    perror(_("could not write the secret"));
+    return -1;
+  }
+#endif
+  if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    perror(_("could not map the secret"));
+    return -1;
+  }
+  if ((ret = xwrite(out, map + off, len - off)) < 0)
+    perror(_("could not write the secret"));
+  munmap(map, len);
+  return ret < 0 ? -1 : 0;
+}
+
+/* print_list - print the entries of a LIST reply, one per line */
+void print_list(reply_list *reply)
+{
+  unsigned i;
+
+  for (i = 0; i < reply->entries; i++) {
+    char dl[20];
+    if (reply->entry[i].deadline)
+      strftime(dl, 20, "%Y-%m-%d %H:%M:%S",
+	       localtime(&reply->entry[i].deadline));
+    else
+      dl[0] = 0;
+    printf("%s\t%-20s\t%s\t%s\n", reply->entry[i].id,
+	   dl[0] ? dl : _("none"),
+	   (reply->entry[i].flags & FLAGS_INSURE) ? "insure" : "",
+	   reply->entry[i].comment);
+  }
+}
+
+/* print_event - print what EV tells, in a line */
+void print_event(agent_event *ev)
+{
+  switch (ev->type) {
+  case EVENT_PUT: printf("put\t%s\n", ev->id); break;
+  case EVENT_DELETE: printf("delete\t%s\n", ev->id); break;
+  case EVENT_EXPIRE: printf("expire\t%s\n", ev->id); break;
+  case EVENT_LOST: printf("lost\n"); break;
+  default: printf("unknown\t%s\n", ev->id); break;
+  }
+  /* whoever reads this wants to know right away */
+  fflush(stdout);
+}
+
 /* main - read commands & arguments, execute them */
 int main(int argc, char **argv)
 {
-  int opt, opt_insure = 0, opt_help = 0, opt_version = 0;
-  char *opt_ttl = NULL;
+  int opt, opt_insure = 0, opt_stream = 0, opt_help = 0, opt_version = 0;
+  int opt_shm = 0, opt_zero = 0, opt_print = 0, opt_sliding = 0;
+  char *opt_ttl = NULL, *opt_max = NULL, *opt_if = NULL;
   struct option opts[] = {{ "debug",	     no_argument,	 NULL,  'd' },
+			  { "if-version",    required_argument,  NULL,  'e' },
 			  { "insure",	     no_argument,	 NULL,	'i' },
+			  { "max-entries",   required_argument,  NULL,  'n' },
 			  { "query-options", required_argument,  NULL,  'q' },
+			  { "shm",	     no_argument,	 NULL,  'm' },
+			  { "sliding",	     no_argument,	 NULL,  'S' },
+			  { "stream",	     no_argument,	 NULL,  's' },
+			  { "print-version", no_argument,	 NULL,  'v' },
 			  { "time-to-live",  required_argument,  NULL,  't' },
+			  { "zero-copy",     no_argument,	 NULL,  'z' },
 			  { "help",	     no_argument,  &opt_help,	 1  },
 			  { "version",	     no_argument,  &opt_version, 1  },
 			  { NULL, 0, NULL, 0 } };
-  enum { CMD_List, CMD_Put, CMD_Get, CMD_Delete } command;
-  char *Commands[] = { "list", "put", "get", "delete" };
+  enum { CMD_List, CMD_Put, CMD_Get, CMD_Delete, CMD_Mget, CMD_Txn,
+	 CMD_Watch, CMD_Touch } command;
+  char *Commands[] = { "list", "put", "get", "delete", "mget", "txn",
+		       "watch", "touch" };
+  unsigned version;
   status_t status;
 
   secmem_init(1);		/* 1 is too small, so default size is used */
@@ -183,20 +387,41 @@ int main(int argc, char **argv)
   bindtextdomain(PACKAGE, LOCALEDIR);
   textdomain(PACKAGE);
 
-  while ((opt = getopt_long(argc, argv, "diq:t:", opts, NULL)) != -1)
+  while ((opt = getopt_long(argc, argv, "de:imn:q:Sst:vz", opts, NULL)) != -1)
     switch (opt) {
     case 'd':
       debug = 1;
       break;
+    case 'e':
+      opt_if = optarg;
+      break;
     case 'i':
       opt_insure = 1;
       break;
+    case 'm':
+      opt_shm = 1;
+      break;
+    case 'n':
+      opt_max = optarg;
+      break;
+    case 's':
+      opt_stream = 1;
+      break;
+    case 'S':
+      opt_sliding = 1;
+      break;
     case 't':
       opt_ttl = optarg;
       break;
     case 'q':
       query_options = optarg;
       break;
+    case 'v':
+      opt_print = 1;
+      break;
+    case 'z':
+      opt_zero = 1;
+      break;
     case 0:
     case '?':
       break;
@@ -219,52 +444,100 @@ int main(int argc, char **argv)
     if (strcmp(argv[optind], Commands[command]) == 0)
       break;
   if (command >= sizeof(Commands)/sizeof(Commands[0])) {
-    fprintf(stderr, _("command must be one of: put, get, delete, list\n"));
+    fprintf(stderr, _("command must be one of: put, get, delete, list, mget, txn, watch, "
+		      "touch\n"));
     usage();
     exit(EXIT_FAILURE);
   }
   if (agent_init() < 0)
     exit(EXIT_FAILURE);
-  if (command != CMD_Put) {
-    if (opt_insure)
+  /* the socket does just as well */
+  if (opt_shm && agent_use_shm() < 0)
+    debugmsg("agent offers no rings in shared memory\n");
+  if (command != CMD_Put && command != CMD_Txn && opt_insure)
+    fprintf(stderr,
+	    _("%s option has no meaning with %s command - ignored\n"),
+	    "insure", Commands[command]);
+  if (command != CMD_Put && command != CMD_Txn && command != CMD_Touch
+      && opt_ttl)
+    fprintf(stderr,
+	    _("%s option has no meaning with %s command - ignored\n"),
+	    "time-to-live", Commands[command]);
+  if (command != CMD_Touch && opt_sliding)
+    fprintf(stderr,
+	    _("%s option has no meaning with %s command - ignored\n"),
+	    "sliding", Commands[command]);
+  if (command != CMD_List && command != CMD_Watch && opt_max)
+    fprintf(stderr,
+	    _("%s option has no meaning with %s command - ignored\n"),
+	    "max-entries", Commands[command]);
+  if (command != CMD_Put && command != CMD_Get && opt_stream)
+    fprintf(stderr,
+	    _("%s option has no meaning with %s command - ignored\n"),
+	    "stream", Commands[command]);
+  if (command != CMD_Get && opt_zero)
+    fprintf(stderr,
+	    _("%s option has no meaning with %s command - ignored\n"),
+	    "zero-copy", Commands[command]);
+  if (command != CMD_Put && command != CMD_Get && command != CMD_Delete) {
+    if (opt_if)
       fprintf(stderr,
 	      _("%s option has no meaning with %s command - ignored\n"),
-	      "insure", Commands[command]);
-    if (opt_ttl)
+	      "if-version", Commands[command]);
+    if (opt_print)
       fprintf(stderr,
 	      _("%s option has no meaning with %s command - ignored\n"),
-	      "time-to-live", Commands[command]);
+	      "print-version", Commands[command]);
   }
+  /* streamed secrets go without versions */
+  if ((opt_stream || opt_zero) && (opt_if || opt_print)) {
+    fprintf(stderr, _("versions cannot be used with streamed secrets\n"));
+    exit(EXIT_FAILURE);
+  }
+  version = parse_version(opt_if);
   if (command == CMD_List) {
     reply_list *reply;
-    if (optind != argc-1) {
-      fprintf(stderr, _("list wants no arguments\n"));
+    char *pattern = NULL, *cursor = NULL, *err;
+    unsigned long left = 0, limit;
+    if (optind+1 == argc-1)
+      pattern = argv[optind+1];
+    else if (optind != argc-1) {
+      fprintf(stderr, _("list wants at most one PATTERN\n"));
       exit(EXIT_FAILURE);
     }
+    if (opt_max) {
+      left = strtoul(opt_max, &err, 10);
+      if (*err || !left) {
+	fprintf(stderr, _("%s: invalid number of entries\n"), opt_max);
+	exit(EXIT_FAILURE);
+      }
+    }
     if (!(reply = malloc(sizeof(reply_list)))) {
       fprintf(stderr, _("out of memory\n"));
       exit(EXIT_FAILURE);
     }
-    status = agent_list(&reply);
-    check_status(status);
-    if (status == STATUS_OK) {
-      unsigned i;
-      for (i = 0; i < reply->entries; i++) {
-	char dl[20];
-	if (reply->entry[i].deadline)
-	  strftime(dl, 20, "%Y-%m-%d %H:%M:%S",
-		   localtime(&reply->entry[i].deadline));
-	else
-	  dl[0] = 0;
-	printf("%s\t%-20s\t%s\t%s\n", reply->entry[i].id,
-	       dl[0] ? dl : _("none"),
-	       (reply->entry[i].flags & FLAGS_INSURE) ? "insure" : "",
-	       reply->entry[i].comment);
-      }
+    if (!pattern && !opt_max) {
+      status = agent_list(&reply);
+      check_status(status);
+      if (status == STATUS_OK)
+	print_list(reply);
+    } else {
+      /* a page at a time, so that the agent does not send all of them */
+      do {
+	limit = left && left < LIST_PAGE ? left : LIST_PAGE;
+	status = agent_list_page(pattern ? pattern : "*", 1, limit, &cursor,
+				 &reply);
+	check_status(status);
+	if (status != STATUS_OK)
+	  break;
+	print_list(reply);
+	left -= left ? reply->entries : 0;
+      } while (cursor && (!opt_max || left));
+      free(cursor);
     }
     free(reply);
   } else if (command == CMD_Put) {
-    char *s, *c, *buf;
+    char *s, *c;
     flags_t flags = 0;
     time_t deadline;
     if (optind+1 == argc-1 ) {
@@ -276,31 +549,65 @@ int main(int argc, char **argv)
       usage();
       exit(EXIT_FAILURE);
     }
-    if (asprintf(&buf, _("Enter secret to store under \"%s\": "),
-		 argv[optind+1]) < 0) {
-      perror(_("out of memory"));
+    put_options(opt_insure, opt_ttl, &flags, &deadline);
+    if (opt_stream) {
+      off_t len;
+      if ((len = stream_length(STDIN_FILENO)) < 0)
+	exit(EXIT_FAILURE);
+      status = agent_put_stream(argv[optind+1], flags, deadline, c,
+				STDIN_FILENO, len);
+    } else {
+      if (!(s = ask_secret(argv[optind+1])))
+	exit(EXIT_FAILURE);
+      if (opt_if || opt_print)
+	status = agent_put_if(argv[optind+1], flags, deadline, c, s,
+			      &version);
+      else
+	status = agent_put(argv[optind+1], flags, deadline, c, s);
+      secmem_free(s);
+    }
+    check_status(status);
+    if (status == STATUS_OK && opt_print)
+      fprintf(stderr, "%u\n", version);
+  } else if (command == CMD_Txn) {
+    agent_op *ops;
+    flags_t flags = 0;
+    time_t deadline;
+    unsigned n = 0, i;
+    int arg;
+    if (!(ops = calloc(argc, sizeof(agent_op)))) {
+      fprintf(stderr, _("out of memory\n"));
       exit(EXIT_FAILURE);
     }
-    s = xgetpass(buf);
-    free(buf);
-    if (!s)
+    put_options(opt_insure, opt_ttl, &flags, &deadline);
+    for (arg = optind+1; arg < argc; n++) {
+      if (strcmp(argv[arg], "put") == 0 && arg+2 < argc) {
+	ops[n].type = REQ_PUT;
+	ops[n].flags = flags;
+	ops[n].deadline = deadline;
+	ops[n].comment = argv[arg+2];
+	ops[n].id = argv[arg+1];
+	arg += 3;
+      } else if (strcmp(argv[arg], "delete") == 0 && arg+1 < argc) {
+	ops[n].type = REQ_DELETE;
+	ops[n].id = argv[arg+1];
+	arg += 2;
+      } else
+	break;
+    }
+    if (!n || arg < argc) {
+      fprintf(stderr, _("txn wants operations: put ID COMMENT, or delete ID\n"));
+      usage();
       exit(EXIT_FAILURE);
-    flags = 0;
-    if (opt_insure)
-      flags |= FLAGS_INSURE;
-    if (opt_ttl) {
-      char *err;
-      deadline = time(NULL);
-      deadline += strtoul(opt_ttl, &err, 10);
-      if (*err) {
-	fprintf(stderr, _("%s: invalid time-to-live\n"), opt_ttl);
-	exit(EXIT_FAILURE);
-      }
-    } else {
-      deadline = 0;
     }
-    status = agent_put(argv[optind+1], flags, deadline, c, s);
-    secmem_free(s);
+    for (i = 0; i < n; i++)
+      if (ops[i].type == REQ_PUT && !(ops[i].data = ask_secret(ops[i].id)))
+	exit(EXIT_FAILURE);
+    status = agent_txn(ops, n);
+    for (i = 0; i < n; i++)
+      if (ops[i].data)
+	secmem_free((char *)ops[i].data);
+    free(ops);
     check_status(status);
   } else if (command == CMD_Get) {
     reply_get *reply;
@@ -309,25 +616,142 @@ int main(int argc, char **argv)
       usage();
       exit(EXIT_FAILURE);
     }
-    status = agent_get(argv[optind+1], &reply);
+    if (opt_stream || opt_zero) {
+      int fd;
+      size_t len;
+      if (isatty(STDOUT_FILENO)) {
+	fprintf(stderr, _("I won't stream a secret to a tty\n"));
+	exit(EXIT_FAILURE);
+      }
+      status = opt_zero ? agent_get_fd(argv[optind+1], &fd, &len)
+	: STATUS_RETRY;
+      if (status == STATUS_OK) {
+	if (copy_fd(fd, len, STDOUT_FILENO) < 0)
+	  status = STATUS_FAIL;
+	close(fd);
+      } else if (status == STATUS_RETRY) {
+	if (opt_zero)
+	  debugmsg("agent hands out no memfd, streaming instead\n");
+	status = agent_get_stream(argv[optind+1], STDOUT_FILENO);
+      }
+      check_status(status);
+    } else {
+      status = agent_get_if(argv[optind+1], &version, &reply);
+      check_status(status);
+      if (status == STATUS_OK && opt_print)
+	fprintf(stderr, "%u\n", version);
+      if (status == STATUS_OK) {
+	if (isatty(STDOUT_FILENO))
+	  printf(_("secret available, but I won't print it on a tty\n"));
+	else
+	  puts(reply->data);
+      }
+    }
+  } else if (command == CMD_Delete) {
+    if (optind+1 != argc-1) {
+      fprintf(stderr, _("delete wants exactly one argument\n"));
+      usage();
+      exit(EXIT_FAILURE);
+    }
+    status = opt_if ? agent_delete_if(argv[optind+1], version)
+      : agent_delete(argv[optind+1]);
+    check_status(status);
+  } else if (command == CMD_Mget) {
+    reply_mget *reply;
+    unsigned i;
+    if (optind+1 > argc-1) {
+      fprintf(stderr, _("mget wants at least one argument\n"));
+      usage();
+      exit(EXIT_FAILURE);
+    }
+    status = agent_mget((const char *const *)argv + optind+1, argc-optind-1,
+			&reply);
     check_status(status);
     if (status == STATUS_OK) {
       if (isatty(STDOUT_FILENO))
-	printf(_("secret available, but I won't print it on a tty\n"));
-      else
-	puts(reply->data);
+	printf(_("secrets available, but I won't print them on a tty\n"));
+      for (i = 0; i < reply->entries; i++) {
+	/* fail if any is missing, but print what is there */
+	if (reply->entry[i].status != STATUS_OK)
+	  status = STATUS_FAIL;
+	if (!isatty(STDOUT_FILENO))
+	  puts(reply->entry[i].status == STATUS_OK
+	       ? reply->entry[i].data : "");
+      }
+      agent_mget_free(reply);
     }
-  } else if (command == CMD_Delete) {
+  } else if (command == CMD_Touch) {
+    flags_t flags;
+    time_t deadline;
+    char *id;
+    size_t len;
+    int prefix = 0;
     if (optind+1 != argc-1) {
-      fprintf(stderr, _("delete wants exactly one argument\n"));
+      fprintf(stderr, _("touch wants exactly one argument\n"));
       usage();
       exit(EXIT_FAILURE);
     }
-    status = agent_delete(argv[optind+1]);
+    if (opt_sliding && !opt_ttl) {
+      fprintf(stderr, _("sliding option needs time-to-live option\n"));
+      exit(EXIT_FAILURE);
+    }
+    put_options(0, opt_ttl, &flags, &deadline);
+    /* a trailing `*' makes it a prefix */
+    id = argv[optind+1];
+    len = strlen(id);
+    if (len && id[len-1] == '*') {
+      id[len-1] = 0;
+      prefix = 1;
+    }
+    status = agent_touch(id, prefix, deadline,
+			 opt_sliding ? strtoul(opt_ttl, NULL, 10) : 0);
+    check_status(status);
+  } else if (command == CMD_Watch) {
+    agent_event ev;
+    unsigned long left = 0;
+    char pattern[ID_LENGTH], *err;
+    size_t len;
+    int arg;
+    if (optind+1 > argc-1) {
+      fprintf(stderr, _("watch wants at least one argument\n"));
+      usage();
+      exit(EXIT_FAILURE);
+    }
+    if (opt_max) {
+      left = strtoul(opt_max, &err, 10);
+      if (*err || !left) {
+	fprintf(stderr, _("%s: invalid number of events\n"), opt_max);
+	exit(EXIT_FAILURE);
+      }
+    }
+    status = STATUS_OK;
+    for (arg = optind+1; arg < argc && status == STATUS_OK; arg++) {
+      /* a trailing `*' makes it a prefix */
+      len = strlen(argv[arg]);
+      if (len && argv[arg][len-1] == '*')
+	len--;
+      if (len >= ID_LENGTH) {
+	fprintf(stderr, _("%s: too long to watch\n"), argv[arg]);
+	exit(EXIT_FAILURE);
+      }
+      memcpy(pattern, argv[arg], len);
+      pattern[len] = 0;
+      if (!agent_watch(pattern, len < strlen(argv[arg]))) {
+	fprintf(stderr, _("%s: could not watch\n"), argv[arg]);
+	status = STATUS_FAIL;
+      }
+    }
+    while (status == STATUS_OK
+	   && (status = agent_next_event(&ev)) == STATUS_OK) {
+      print_event(&ev);
+      if (left && !--left)
+	break;
+    }
     check_status(status);
   } else
     assert(0);
   agent_done();
   secmem_term();
-  exit(status == STATUS_OK ? EXIT_SUCCESS : status == STATUS_FAIL ? 2 : 3);
+  exit(status == STATUS_OK ? EXIT_SUCCESS : status == STATUS_FAIL ? 2
+       : status == STATUS_UNCHANGED ? 4 : status == STATUS_CONFLICT ? 5 : 3);
 }
@@ -0,0 +1,356 @@
+/* Quintuple Agent handover to a successor
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "memory.h"
+#include "util.h"
+#include "handover.h"
+
+/* what must not change anymore once a handover has been sent */
+#define SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+/* how many descriptors go with each message after the first - the kernel
+   takes no more than 253 */
+#define FDS_PER_MESSAGE	250
+
+/* how much is encrypted at once when writing */
+#define CHUNK_SIZE	512
+
+/* lives in secure memory, since it holds the key */
+struct handover {
+  int fd;			/* the memfd */
+  off_t pos;			/* where the next handover_read() reads */
+  uint32_t state[16];		/* ChaCha20, see RFC 8439 */
+  unsigned char block[64];	/* the current block of the keystream */
+  unsigned used;		/* bytes of it used up */
+  unsigned char key[32];
+};
+
+#define ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+  (a += b, d = ROTL(d ^ a, 16), c += d, b = ROTL(b ^ c, 12), \
+   a += b, d = ROTL(d ^ a, 8), c += d, b = ROTL(b ^ c, 7))
+
+/* the next block of the keystream of H */
+static void next_block(struct handover *h)
+{
+  uint32_t x[16];
+  int i;
+
+  memcpy(x, h->state, sizeof(x));
+  for (i = 0; i < 10; i++) {
+    QUARTER(x[0], x[4], x[8], x[12]);
+    QUARTER(x[1], x[5], x[9], x[13]);
+    QUARTER(x[2], x[6], x[10], x[14]);
+    QUARTER(x[3], x[7], x[11], x[15]);
+    QUARTER(x[0], x[5], x[10], x[15]);
+    QUARTER(x[1], x[6], x[11], x[12]);
+    QUARTER(x[2], x[7], x[8], x[13]);
+    QUARTER(x[3], x[4], x[9], x[14]);
+  }
+  for (i = 0; i < 16; i++) {
+    x[i] += h->state[i];
+    h->block[4*i] = x[i];
+    h->block[4*i+1] = x[i] >> 8;
+    h->block[4*i+2] = x[i] >> 16;
+    h->block[4*i+3] = x[i] >> 24;
+  }
+  wipe(x, sizeof(x));
+  h->state[12]++;		/* the block counter */
+  h->used = 0;
+}
+
+/* start the keystream of H with its key, and a nonce of zero - every key
+   is used for a single handover */
+static void start_keystream(struct handover *h)
+{
+  const unsigned char *k = h->key;
+  int i;
+
+  h->state[0] = 0x61707865;	/* "expand 32-byte k" */
+  h->state[1] = 0x3320646e;
+  h->state[2] = 0x79622d32;
+  h->state[3] = 0x6b206574;
+  for (i = 0; i < 8; i++, k += 4)
+    h->state[4+i] = k[0] | k[1] << 8 | k[2] << 16 | (uint32_t)k[3] << 24;
+  h->state[12] = h->state[13] = h->state[14] = h->state[15] = 0;
+  next_block(h);
+}
+
+/* encrypt or decrypt LEN bytes from IN into OUT, which may be the same */
+static void apply_keystream(struct handover *h, unsigned char *out,
+			    const unsigned char *in, size_t len)
+{
+  while (len--) {
+    if (h->used == sizeof(h->block))
+      next_block(h);
+    *out++ = *in++ ^ h->block[h->used++];
+  }
+}
+
+/* a handover with no key yet, in secure memory */
+static struct handover *alloc_handover(void)
+{
+  struct handover *h;
+
+  if (!(h = secmem_malloc(sizeof(struct handover)))) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memset(h, 0, sizeof(*h));
+  h->fd = -1;
+  return h;
+}
+
+struct handover *handover_new(void)
+{
+  struct handover *h;
+  int fd;
+
+#ifndef F_ADD_SEALS
+  /* without seals the successor could not trust what it reads */
+  errno = ENOSYS;
+  return NULL;
+#else
+  if (!(h = alloc_handover()))
+    return NULL;
+  if ((fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0) {
+    handover_free(h);
+    return NULL;
+  }
+  if (read(fd, h->key, sizeof(h->key)) != sizeof(h->key)) {
+    close(fd);
+    handover_free(h);
+    errno = EIO;
+    return NULL;
+  }
+  close(fd);
+  if ((h->fd = create_memfd("q-agent-handover")) < 0) {
+    handover_free(h);
+    return NULL;
+  }
+  start_keystream(h);
+  return h;
+#endif
+}
+
+int handover_write(struct handover *h, const void *data, size_t len)
+{
+  unsigned char buf[CHUNK_SIZE];
+  const unsigned char *p = data;
+  size_t n;
+
+  while (len) {
+    n = len < sizeof(buf) ? len : sizeof(buf);
+    apply_keystream(h, buf, p, n);
+    if (xwrite(h->fd, buf, n) < 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* send the NFDS descriptors at FDS with a message made of IOV */
+static int send_fds(int sock, struct iovec *iov, int iovlen,
+		    const int *fds, unsigned nfds)
+{
+  char control[CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovlen;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  /* nobody reads before we are gone - waiting would be forever */
+  while (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    if (errno != EINTR)
+      return -1;
+  return 0;
+}
+
+int handover_send(struct handover *h, int sock, const int *fds,
+		  unsigned nfds)
+{
+  struct iovec iov[2];
+  unsigned n;
+
+#ifdef F_ADD_SEALS
+  if (fcntl(h->fd, F_ADD_SEALS, SEALS) < 0)
+    return -1;
+#endif
+  /* the first message has the key, and tells how many descriptors follow */
+  iov[0].iov_base = h->key;
+  iov[0].iov_len = sizeof(h->key);
+  iov[1].iov_base = &nfds;
+  iov[1].iov_len = sizeof(nfds);
+  if (send_fds(sock, iov, 2, &h->fd, 1) < 0)
+    return -1;
+  iov[0].iov_base = (void *)"";
+  iov[0].iov_len = 1;
+  for (; nfds; nfds -= n, fds += n) {
+    n = nfds < FDS_PER_MESSAGE ? nfds : FDS_PER_MESSAGE;
+    if (send_fds(sock, iov, 1, fds, n) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* receive a message of LEN bytes into IOV from SOCK, and store the
+   descriptors that came with it at FDS, which has room for MAX of them.
+   Returns how many there were, or -1 on errors. */
+static int receive_fds(int sock, struct iovec *iov, int iovlen, size_t len,
+		       int *fds, unsigned max)
+{
+  char control[CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t n;
+  unsigned got = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovlen;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
+    if (errno != EINTR)
+      return -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      unsigned i, count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int *p = (int *)CMSG_DATA(cmsg);
+      for (i = 0; i < count; i++)
+	if (got < max)
+	  fds[got++] = p[i];
+	else
+	  close(p[i]);
+    }
+  if (n != len || msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    while (got)
+      close(fds[--got]);
+    errno = EPROTO;
+    return -1;
+  }
+  return got;
+}
+
+struct handover *handover_receive(int sock, int **fds, unsigned *nfds)
+{
+  struct handover *h;
+  struct iovec iov[2];
+  unsigned n, got;
+  char byte;
+  int r;
+
+  if (!(h = alloc_handover()))
+    return NULL;
+  iov[0].iov_base = h->key;
+  iov[0].iov_len = sizeof(h->key);
+  iov[1].iov_base = &n;
+  iov[1].iov_len = sizeof(n);
+  if ((r = receive_fds(sock, iov, 2, sizeof(h->key) + sizeof(n),
+		       &h->fd, 1)) != 1) {
+    if (r == 0)
+      errno = EPROTO;
+    handover_free(h);
+    return NULL;
+  }
+#ifdef F_GET_SEALS
+  /* nobody may change it while it is read */
+  if ((fcntl(h->fd, F_GET_SEALS) & SEALS) != SEALS) {
+    handover_free(h);
+    errno = EPERM;
+    return NULL;
+  }
+#endif
+  if (!(*fds = malloc((n ? n : 1) * sizeof(int)))) {
+    handover_free(h);
+    return NULL;
+  }
+  iov[0].iov_base = &byte;
+  iov[0].iov_len = 1;
+  for (got = 0; got < n; got += r)
+    if ((r = receive_fds(sock, iov, 1, 1, *fds + got, n - got)) <= 0) {
+      while (got)
+	close((*fds)[--got]);
+      free(*fds);
+      handover_free(h);
+      if (r == 0)
+	errno = EPROTO;
+      return NULL;
+    }
+  *nfds = n;
+  start_keystream(h);
+  return h;
+}
+
+int handover_read(struct handover *h, void *buf, size_t len)
+{
+  char *p = buf;
+  size_t left = len;
+  ssize_t n;
+
+  while (left) {
+    if ((n = pread(h->fd, p, left, h->pos)) < 0) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    if (n == 0) {
+      errno = EPROTO;
+      return -1;
+    }
+    p += n;
+    left -= n;
+    h->pos += n;
+  }
+  apply_keystream(h, buf, buf, len);
+  return 0;
+}
+
+void handover_free(struct handover *h)
+{
+  if (h->fd >= 0)
+    close(h->fd);
+  wipe(h, sizeof(*h));
+  secmem_free(h);
+}
@@ -0,0 +1,48 @@
+/* Quintuple Agent handover to a successor
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _HANDOVER_H
+#define _HANDOVER_H
+
+#include <sys/types.h>
+
+/* The state an agent hands over to its successor.  The data is written to
+   a memfd, encrypted with a key that only ever lives in secure memory and
+   in the message passing it on, since the pages of a memfd may be swapped
+   out.  The memfd is sealed, and sent over a socket together with the
+   key and any other descriptors. */
+struct handover;
+
+/* start a handover - NULL on errors, with errno set */
+struct handover *handover_new(void);
+/* append LEN bytes at DATA - returns -1 on errors */
+int handover_write(struct handover *, const void *data, size_t len);
+/* seal what has been written, and send it and the NFDS descriptors at FDS
+   over the SOCK_SEQPACKET socket SOCK */
+int handover_send(struct handover *, int sock, const int *fds,
+		  unsigned nfds);
+
+/* receive a handover from SOCK.  The descriptors that came along are
+   stored in a newly allocated array at *FDS, and counted in *NFDS. */
+struct handover *handover_receive(int sock, int **fds, unsigned *nfds);
+/* read the next LEN bytes into BUF - returns -1 if there are not as many */
+int handover_read(struct handover *, void *buf, size_t len);
+
+void handover_free(struct handover *);
+
+#endif
@@ -27,9 +27,13 @@
 #define SECMEM_DONT_WARN	1
 #define SECMEM_SUSPEND_WARN	2
 
+/* bytes in the pool unless more are asked for */
+#define SECMEM_DEFAULT_POOLSIZE	16384
+
 void secmem_init( size_t npool );
 void secmem_term( void );
 void *secmem_malloc( size_t size );
+size_t secmem_block_size( size_t size );
 void *secmem_realloc( void *a, size_t newsize );
 void secmem_free( void *a );
 int  m_is_secure( const void *p );
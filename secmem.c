@@ -33,6 +33,9 @@
   #endif
 #endif
 #include <string.h>
+#ifdef HAVE_PTHREAD_H
+  #include <pthread.h>
+#endif
 
 #include "memory.h"
 #include "i18n.h"
@@ -84,7 +87,7 @@ void log_fatal(char *template, ...)
   #define MAP_ANONYMOUS MAP_ANON
 #endif
 
-#define DEFAULT_POOLSIZE 16384
+#define DEFAULT_POOLSIZE SECMEM_DEFAULT_POOLSIZE
 
 typedef struct memblock_struct MEMBLOCK;
 struct memblock_struct {
@@ -112,6 +115,16 @@ static int show_warning;
 static int no_warning;
 static int suspend_warning;
 
+/* the pool may be used by several threads */
+#ifdef HAVE_PTHREAD_H
+  static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+  #define LOCK_POOL()	pthread_mutex_lock(&pool_lock)
+  #define UNLOCK_POOL()	pthread_mutex_unlock(&pool_lock)
+#else
+  #define LOCK_POOL()
+  #define UNLOCK_POOL()
+#endif
+
 
 static void
 print_warn(void)
@@ -243,11 +256,38 @@ init_pool( size_t n)
 }
 
 
-/* concatenate unused blocks */
+/* put MB on the list of unused blocks, which is kept in the order of
+   their addresses, so that it is merged with the unused blocks right
+   before and after it - and given back to the rest of the pool if it is
+   the last block.  Otherwise the pool would fall to pieces too small for
+   anything, as secrets of all sizes come and go.  With the pool locked. */
 static void
-compress_pool(void)
+add_unused( MEMBLOCK *mb )
 {
-    /* fixme: we really should do this */
+    MEMBLOCK **link, **prevlink = NULL, *prev = NULL, *next;
+
+    for( link = &unused_blocks; *link && *link < mb;
+	 link = &(*link)->u.next ) {
+	prevlink = link;
+	prev = *link;
+    }
+    next = *link;
+    if( next && (char*)mb + mb->size == (char*)next ) {
+	mb->size += next->size;
+	next = next->u.next;
+    }
+    if( prev && (char*)prev + prev->size == (char*)mb ) {
+	prev->size += mb->size;
+	mb = prev;
+	link = prevlink;
+    }
+    if( (char*)mb + mb->size == (char*)pool + poollen ) {
+	poollen -= mb->size;
+	*link = next;
+	return;
+    }
+    mb->u.next = next;
+    *link = mb;
 }
 
 void
@@ -305,11 +345,20 @@ secmem_init( size_t n )
 }
 
 
+/* how much of the pool an allocation of SIZE bytes takes up */
+size_t
+secmem_block_size( size_t size )
+{
+    /* blocks are always a multiple of 32 */
+    size += sizeof(MEMBLOCK);
+    return ((size + 31) / 32) * 32;
+}
+
+
 void *
 secmem_malloc( size_t size )
 {
-    MEMBLOCK *mb, *mb2;
-    int compressed=0;
+    MEMBLOCK *mb, *mb2, *best, *bestprev;
 
     if( !pool_okay ) {
 	log_info(
@@ -317,38 +366,50 @@ secmem_malloc( size_t size )
 	log_info(_("(you may have used the wrong program for this task)\n"));
 	exit(2);
     }
+
+    size = secmem_block_size(size);
+
+    LOCK_POOL();
     if( show_warning && !suspend_warning ) {
 	show_warning = 0;
 	print_warn();
     }
-
-    /* blocks are always a multiple of 32 */
-    size += sizeof(MEMBLOCK);
-    size = ((size + 31) / 32) * 32;
-
-  retry:
-    /* try to get it from the used blocks */
+    /* try to get it from the used blocks - the smallest that fits, so that
+       large ones are left for large secrets */
+    best = bestprev = NULL;
     for(mb = unused_blocks,mb2=NULL; mb; mb2=mb, mb = mb->u.next )
-	if( mb->size >= size ) {
-	    if( mb2 )
-		mb2->u.next = mb->u.next;
-	    else
-		unused_blocks = mb->u.next;
-	    goto leave;
+	if( mb->size >= size && (!best || mb->size < best->size) ) {
+	    best = mb;
+	    bestprev = mb2;
+	    if( mb->size == size )
+		break;
 	}
+    if( best ) {
+	mb = best;
+	if( bestprev )
+	    bestprev->u.next = mb->u.next;
+	else
+	    unused_blocks = mb->u.next;
+	/* secrets come in all sizes - what this one does not need is split
+	   off, rather than wasted on it */
+	if( mb->size > size ) {
+	    mb2 = (MEMBLOCK*)((char*)mb + size);
+	    mb2->size = mb->size - size;
+	    mb->size = size;
+	    add_unused(mb2);
+	}
+	goto leave;
+    }
     /* allocate a new block */
     if( (poollen + size <= poolsize) ) {
 	mb = (void*)((char*)pool + poollen);
 	poollen += size;
 	mb->size = size;
     }
-    else if( !compressed ) {
-	compressed=1;
-	compress_pool();
-	goto retry;
-    }
-    else
+    else {
+	UNLOCK_POOL();
 	return NULL;
+    }
 
   leave:
     cur_alloced += mb->size;
@@ -357,6 +418,7 @@ secmem_malloc( size_t size )
 	max_alloced = cur_alloced;
     if( cur_blocks > max_blocks )
 	max_blocks = cur_blocks;
+    UNLOCK_POOL();
 
     return &mb->u.aligned.c;
 }
@@ -399,10 +461,11 @@ secmem_free( void *a )
     memset(mb, 0x55, size );
     memset(mb, 0x00, size );
     mb->size = size;
-    mb->u.next = unused_blocks;
-    unused_blocks = mb;
+    LOCK_POOL();
+    add_unused(mb);
     cur_blocks--;
     cur_alloced -= size;
+    UNLOCK_POOL();
 }
 
 int
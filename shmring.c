@@ -0,0 +1,253 @@
+/* Quintuple Agent rings in shared memory
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#endif
+
+#include "util.h"
+#include "shmring.h"
+
+/* the rings need a futex to sleep on, and a memfd that can be sealed */
+#if defined(HAVE_LINUX_FUTEX_H) && defined(SYS_futex) && defined(F_ADD_SEALS)
+#define USE_FUTEX
+#endif
+
+/* how often a consumer looks for something in a ring before it sleeps -
+   unless there is a single CPU, which the producer would need to put it
+   there */
+#define SHMRING_SPIN	2000
+
+/* what must not change about the memfd once it has been set up */
+#define SEALS	(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+
+#ifdef USE_FUTEX
+/* sleep while *WORD is 1, but no longer than TIMEOUT milliseconds, unless
+   that is negative.  The futex is shared with another process, so it
+   must not be a private one. */
+static void futex_wait(uint32_t *word, int timeout)
+{
+  struct timespec ts;
+
+  ts.tv_sec = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000L;
+  syscall(SYS_futex, word, FUTEX_WAIT, 1, timeout < 0 ? NULL : &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+#endif
+
+struct shmrings *shmring_create(int *fd)
+{
+#ifdef USE_FUTEX
+  struct shmrings *s;
+  int err;
+
+  if ((*fd = create_memfd("q-agent-rings")) < 0)
+    return NULL;
+  if (ftruncate(*fd, sizeof(struct shmrings)) < 0
+      || fcntl(*fd, F_ADD_SEALS, SEALS) < 0
+      || (s = mmap(NULL, sizeof(struct shmrings), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, *fd, 0)) == MAP_FAILED) {
+    err = errno;
+    close(*fd);
+    errno = err;
+    return NULL;
+  }
+  /* secrets go through them */
+  if (mlock(s, sizeof(struct shmrings)) < 0) {
+    err = errno;
+    munmap(s, sizeof(struct shmrings));
+    close(*fd);
+    errno = err;
+    return NULL;
+  }
+  s->magic = SHMRING_MAGIC;
+  return s;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+struct shmrings *shmring_map(int fd)
+{
+#ifdef USE_FUTEX
+  struct shmrings *s;
+  struct stat st;
+
+  /* since it is sealed, it cannot shrink under our feet */
+  if (fstat(fd, &st) < 0 || st.st_size != sizeof(struct shmrings)
+      || (fcntl(fd, F_GET_SEALS) & SEALS) != SEALS) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if ((s = mmap(NULL, sizeof(struct shmrings), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0)) == MAP_FAILED)
+    return NULL;
+  if (s->magic != SHMRING_MAGIC) {
+    munmap(s, sizeof(struct shmrings));
+    errno = EINVAL;
+    return NULL;
+  }
+  return s;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+void shmring_unmap(struct shmrings *s)
+{
+  munmap(s, sizeof(struct shmrings));
+}
+
+ssize_t shmring_used(struct shmring *r)
+{
+  uint32_t used = LOAD(&r->head) - LOAD(&r->tail);
+
+  return used > SHMRING_SIZE ? -1 : (ssize_t)used;
+}
+
+int shmring_put(struct shmring *r, const struct iovec *iov, int n)
+{
+  uint32_t head = LOAD(&r->head), tail = LOAD(&r->tail);
+  size_t len = 0, pos, part, k;
+  int i;
+
+  for (i = 0; i < n; i++)
+    len += iov[i].iov_len;
+  if ((uint32_t)(head - tail) > SHMRING_SIZE
+      || len > SHMRING_SIZE - (uint32_t)(head - tail))
+    return -1;
+  for (i = 0; i < n; i++)
+    for (k = 0; k < iov[i].iov_len; k += part, head += part) {
+      pos = head % SHMRING_SIZE;
+      part = SHMRING_SIZE - pos;
+      if (part > iov[i].iov_len - k)
+	part = iov[i].iov_len - k;
+      memcpy(r->data + pos, (const char *)iov[i].iov_base + k, part);
+    }
+  /* the consumer either sees the new head, or is seen to sleep */
+  STORE(&r->head, head);
+  if (LOAD(&r->sleeping)) {
+#ifdef USE_FUTEX
+    STORE(&r->sleeping, 0);
+    futex_wake(&r->sleeping);
+#endif
+  }
+  return 0;
+}
+
+void shmring_copy(struct shmring *r, size_t offset, void *buf, size_t len)
+{
+  uint32_t tail = LOAD(&r->tail) + offset;
+  size_t pos, part;
+  char *p = buf;
+
+  for (; len; len -= part, p += part, tail += part) {
+    pos = tail % SHMRING_SIZE;
+    part = SHMRING_SIZE - pos;
+    if (part > len)
+      part = len;
+    memcpy(p, r->data + pos, part);
+  }
+}
+
+void shmring_consume(struct shmring *r, size_t len)
+{
+  uint32_t tail = LOAD(&r->tail);
+  size_t pos, part, left;
+
+  for (left = len; left; left -= part, tail += part) {
+    pos = tail % SHMRING_SIZE;
+    part = SHMRING_SIZE - pos;
+    if (part > left)
+      part = left;
+    wipe(r->data + pos, part);
+  }
+  STORE(&r->tail, tail);
+}
+
+int shmring_wait(struct shmring *r, const uint32_t *closed, int timeout)
+{
+  static int spin = -1;
+  int i;
+
+  if (spin < 0)
+    spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHMRING_SPIN : 0;
+  for (i = 0; i < spin; i++) {
+    if (shmring_used(r))
+      return 1;
+    if (LOAD(closed))
+      return 0;
+  }
+#ifdef USE_FUTEX
+  for (;;) {
+    /* the producer either sees this, or has moved head already */
+    STORE(&r->sleeping, 1);
+    if (shmring_used(r) || LOAD(closed)) {
+      STORE(&r->sleeping, 0);
+      return shmring_used(r) != 0;
+    }
+    futex_wait(&r->sleeping, timeout);
+    STORE(&r->sleeping, 0);
+    if (shmring_used(r))
+      return 1;
+    /* woken up early, or by a signal, is not told apart from timing
+       out - the caller goes on without the rings, at worst */
+    if (timeout >= 0 || LOAD(closed))
+      return 0;
+  }
+#else
+  return 0;
+#endif
+}
+
+void shmring_close(struct shmrings *s)
+{
+  STORE(&s->closed, 1);
+#ifdef USE_FUTEX
+  STORE(&s->requests.sleeping, 0);
+  futex_wake(&s->requests.sleeping);
+  STORE(&s->replies.sleeping, 0);
+  futex_wake(&s->replies.sleeping);
+#endif
+}
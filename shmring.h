@@ -0,0 +1,81 @@
+/* Quintuple Agent rings in shared memory
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _SHMRING_H
+#define _SHMRING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "agent.h"
+
+/* bytes of data in a ring - a power of 2, and more than any request or
+   reply that goes through it */
+#define SHMRING_SIZE	16384
+
+/* A queue of bytes in memory shared by a client and the agent, with a
+   single producer and a single consumer, neither of which takes a lock.
+   HEAD only moves on when the producer has put something in, and TAIL
+   when the consumer has taken it out.  The consumer looks for a while
+   before it goes to sleep on SLEEPING, a futex, and only then does the
+   producer have to wake it up.  They live on cache lines of their own. */
+struct shmring {
+  uint32_t head;		/* bytes ever put in, modulo 2^32 */
+  uint32_t spare1[15];
+  uint32_t tail;		/* bytes ever taken out */
+  uint32_t sleeping;		/* the consumer waits for HEAD to move */
+  uint32_t spare2[14];
+  char data[SHMRING_SIZE];
+};
+
+/* what a memfd passed with the reply to a SHM request holds: version 2
+   requests go from the client to the agent through REQUESTS, and their
+   replies come back through REPLIES.  The agent locks it into memory,
+   and wipes what it has taken out. */
+struct shmrings {
+  uint32_t magic;		/* SHMRING_MAGIC */
+  uint32_t closed;		/* the agent serves them no longer */
+  uint32_t spare[14];
+  struct shmring requests, replies;
+};
+
+#define SHMRING_MAGIC	0xa8e5c001
+
+/* new rings in a sealed memfd, whose descriptor is stored at *FD, locked
+   into memory.  NULL on errors, with errno set. */
+struct shmrings *shmring_create(int *fd);
+/* the rings in the memfd FD, as passed by the agent - NULL on errors */
+struct shmrings *shmring_map(int fd);
+void shmring_unmap(struct shmrings *);
+
+/* put the N elements of IOV into R, all at once, and wake up its
+   consumer, should it sleep.  Returns -1 if there is no room. */
+int shmring_put(struct shmring *r, const struct iovec *iov, int n);
+/* how many bytes are in R - or -1 if the other side has messed them up */
+ssize_t shmring_used(struct shmring *r);
+/* copy LEN bytes in R, from OFFSET on, to BUF, and take nothing out */
+void shmring_copy(struct shmring *r, size_t offset, void *buf, size_t len);
+/* take LEN bytes out of R, and wipe them */
+void shmring_consume(struct shmring *r, size_t len);
+/* wait until something is in R, or *CLOSED is set, but no longer than
+   TIMEOUT milliseconds - forever if that is negative.  Returns whether
+   something is in there. */
+int shmring_wait(struct shmring *r, const uint32_t *closed, int timeout);
+/* set *CLOSED, and wake up the consumers of both rings of S */
+void shmring_close(struct shmrings *s);
+
+#endif
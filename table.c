@@ -0,0 +1,219 @@
+/* Quintuple Agent table of secrets
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "i18n.h"
+#include "memory.h"
+#include "table.h"
+#include "util.h"
+
+/* slots a table starts with - there may be a table for each of many
+   shards, and secure memory is scarce */
+#define TABLE_MIN	2
+
+/* the slots are aligned to this, so that none straddles two cache lines */
+#define TABLE_ALIGN	64
+
+/* how far a table may fill up, in eighths - the further, the longer the
+   runs of slots that are taken */
+#define TABLE_LOAD	7
+
+/* the slot that a HASH belongs to in T: the top bits of the hash times
+   2^32 / phi, which depend on all of its bits - the bottom ones alone
+   pick the shard already */
+#define HOME(t, hash)	((uint32_t)((hash) * 2654435769U) >> (t)->shift)
+
+#define NEXT(t, i)	(((i) + 1) & ((t)->size - 1))
+
+/* FNV-1a of ID, whose length is stored at *LEN */
+static uint32_t hash_id(const char *id, size_t *len)
+{
+  const unsigned char *p = (const unsigned char *)id;
+  uint32_t h = 2166136261U;
+
+  for (; *p; p++)
+    h = (h ^ *p) * 16777619U;
+  *len = p - (const unsigned char *)id;
+  return h;
+}
+
+uint32_t table_hash(const char *id)
+{
+  size_t len;
+
+  return hash_id(id, &len);
+}
+
+/* whether SL holds ID, which is LEN bytes long */
+static int matches(const struct slot *sl, const char *id, size_t len)
+{
+  /* the NUL of a short id tells its length */
+  if (len < TABLE_INLINE)
+    return memcmp(sl->id, id, len + 1) == 0;
+  return memcmp(sl->id, id, TABLE_INLINE) == 0
+    && strcmp(sl->key + TABLE_INLINE, id + TABLE_INLINE) == 0;
+}
+
+/* the slot of T holding ID, or NULL */
+static struct slot *find(struct table *t, const char *id)
+{
+  struct slot *sl;
+  uint32_t hash, dist;
+  size_t len;
+  unsigned i;
+
+  if (!t->used)
+    return NULL;
+  hash = hash_id(id, &len);
+  for (i = HOME(t, hash), dist = 1; ; i = NEXT(t, i), dist++) {
+    sl = &t->slots[i];
+    /* had it been put in, it would have taken this slot - free ones
+       included */
+    if (sl->dist < dist)
+      return NULL;
+    if (sl->hash == hash && matches(sl, id, len))
+      return sl;
+  }
+}
+
+/* put what NEW holds into T, moving any secret that is closer to home
+   than it on - NEW is used up in the process */
+static void place(struct table *t, struct slot *new)
+{
+  struct slot *sl, tmp;
+  unsigned i;
+
+  new->dist = 1;
+  for (i = HOME(t, new->hash); ; i = NEXT(t, i), new->dist++) {
+    sl = &t->slots[i];
+    if (!sl->dist) {
+      *sl = *new;
+      break;
+    }
+    if (sl->dist < new->dist) {
+      tmp = *sl;
+      *sl = *new;
+      *new = tmp;
+    }
+  }
+  wipe(&tmp, sizeof(tmp));
+}
+
+struct secret *table_lookup(struct table *t, const char *id,
+			    struct value **value)
+{
+  struct slot *sl;
+
+  if (!(sl = find(t, id)))
+    return NULL;
+  if (value)
+    *value = sl->value;
+  return sl->secret;
+}
+
+size_t table_memory(unsigned ntables, unsigned n)
+{
+  /* every table starts out with TABLE_MIN slots, and one that has grown
+     has fewer than 16 / TABLE_LOAD of them for each of its secrets */
+  return ntables * secmem_block_size(TABLE_MIN * sizeof(struct slot)
+				     + TABLE_ALIGN - 1)
+    + (size_t)n * 16 / TABLE_LOAD * sizeof(struct slot);
+}
+
+int table_reserve(struct table *t, unsigned n)
+{
+  unsigned size = t->size ? t->size : TABLE_MIN, shift, i;
+  struct slot *old = t->slots;
+  unsigned old_size = t->size;
+  void *mem;
+
+  while ((t->used + n) * 8 > size * TABLE_LOAD)
+    size *= 2;
+  if (size == t->size)
+    return 0;
+  mem = secmem_malloc(size * sizeof(struct slot) + TABLE_ALIGN - 1);
+  if (!mem) {
+    fprintf(stderr, _("could not allocate space in secure storage\n"));
+    return -1;
+  }
+  for (shift = 32; (1U << (32 - shift)) < size; shift--)
+    ;
+  t->slots = (struct slot *)(((uintptr_t)mem + TABLE_ALIGN - 1)
+			     & ~(uintptr_t)(TABLE_ALIGN - 1));
+  memset(t->slots, 0, size * sizeof(struct slot));
+  t->size = size;
+  t->shift = shift;
+  for (i = 0; i < old_size; i++)
+    if (old[i].dist)
+      place(t, &old[i]);
+  /* that wipes the old slots */
+  secmem_free(t->mem);
+  t->mem = mem;
+  return 0;
+}
+
+void table_insert(struct table *t, const char *id, struct secret *s,
+		  struct value *value)
+{
+  struct slot new;
+  size_t len;
+
+  new.hash = hash_id(id, &len);
+  new.key = id;
+  new.secret = s;
+  new.value = value;
+  memset(new.id, 0, TABLE_INLINE);
+  memcpy(new.id, id, len < TABLE_INLINE ? len + 1 : TABLE_INLINE);
+  place(t, &new);
+  wipe(&new, sizeof(new));
+  t->used++;
+}
+
+void table_remove(struct table *t, const char *id)
+{
+  struct slot *sl;
+  unsigned i, next;
+
+  if (!(sl = find(t, id)))
+    return;
+  /* move the run that follows back by one, rather than leaving a
+     tombstone, so that every secret stays as close to home as it can */
+  for (i = sl - t->slots; t->slots[next = NEXT(t, i)].dist > 1; i = next) {
+    t->slots[i] = t->slots[next];
+    t->slots[i].dist--;
+  }
+  wipe(&t->slots[i], sizeof(struct slot));
+  t->used--;
+}
+
+void table_foreach(struct table *t, void (*fn)(struct secret *, void *),
+		   void *arg)
+{
+  unsigned i;
+
+  for (i = 0; i < t->size; i++)
+    if (t->slots[i].dist)
+      fn(t->slots[i].secret, arg);
+}
@@ -0,0 +1,78 @@
+/* Quintuple Agent table of secrets
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _TABLE_H
+#define _TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* bytes of an id kept in its slot, with the terminating NUL if it fits -
+   longer ids are compared through KEY for the rest */
+#define TABLE_INLINE	32
+
+struct secret;
+struct value;
+
+/* One slot of a table, which takes a cache line of its own on 64 bit
+   machines: finding the value of a secret whose id is shorter than
+   TABLE_INLINE looks at nothing but this. */
+struct slot {
+  uint32_t hash;		/* of the id */
+  uint32_t dist;		/* 1 + how far it is from where it hashes to,
+				   or 0 if the slot is free */
+  const char *key;		/* the id, in full */
+  struct secret *secret;
+  struct value *value;
+  char id[TABLE_INLINE];	/* as much of the id as fits */
+};
+
+/* An open addressing hash table of secrets by id, with Robin Hood hashing:
+   a secret that is further from where it hashes to takes the slot of one
+   that is closer, so that no id is far from home, and a lookup can give
+   up as soon as it comes to a secret that is closer to home than the id
+   would be.  The slots are in secure memory, like the ids they hold.
+   Whoever uses a table has to lock it.  All zeroes make an empty one. */
+struct table {
+  struct slot *slots;		/* SIZE of them, a power of 2 - or NULL */
+  void *mem;			/* what they are allocated in */
+  unsigned size, used;
+  unsigned shift;		/* 32 - log2(SIZE) */
+};
+
+/* about how much secure memory NTABLES tables holding N secrets between
+   them take, the ids left aside */
+size_t table_memory(unsigned ntables, unsigned n);
+/* the hash of ID */
+uint32_t table_hash(const char *id);
+/* the secret under ID in T, or NULL - and its value, stored at *VALUE
+   unless that is NULL */
+struct secret *table_lookup(struct table *t, const char *id,
+			    struct value **value);
+/* make room in T for N more secrets.  -1 if out of secure memory. */
+int table_reserve(struct table *t, unsigned n);
+/* put S with VALUE into T under ID, which stays where it is until S is
+   removed - there has to be room, and nothing under ID yet */
+void table_insert(struct table *t, const char *id, struct secret *s,
+		  struct value *value);
+void table_remove(struct table *t, const char *id);
+/* call FN for every secret in T, which must not change meanwhile */
+void table_foreach(struct table *t, void (*fn)(struct secret *, void *),
+		   void *arg);
+
+#endif
@@ -25,6 +25,8 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 
@@ -37,9 +39,12 @@
 #ifndef HAVE_SETENV
 #include "setenv.h"
 #endif
+#include "../agent.h"
 
 #define SHELL		"/bin/sh"
 #define AGENT_CMD	"../q-agent"
+#define LAUNCH_CMD	"./launch"
+#define LAUNCH_SOCKET	"launch.sock"
 #define CLIENT_CMD	"../q-client "
 #define FILTER_CMD	"grep -v '^Warning: using insecure memory!$'"
 #define DIFF_CMD	"diff -c"
@@ -72,6 +77,8 @@ void timeout(int sig)
 
 void stop_agent()
 {
+  if (!agent_pid)
+    return;
   kill(agent_pid, SIGTERM);
   signal(SIGALRM, timeout);
   alarm(5);
@@ -79,6 +86,7 @@ void stop_agent()
     perror("couldn't wait for shutdown of q-agent");
   }
   alarm(0);
+  agent_pid = 0;
 }
 
 void remove_files()
@@ -86,10 +94,15 @@ void remove_files()
   unlink("client1.out");
   unlink("client2.out");
   unlink("diff.out");
+  unlink("stream.in");
+  unlink(LAUNCH_SOCKET);
 }
 
-void start_agent()
+/* start the agent, serving with THREADS threads unless that is NULL - if
+   ACTIVATED, have the launcher start it on the first connection */
+void start_agent(int activated, const char *threads)
 {
+  static int registered = 0;
   int p[2];
   char buf[BUFSIZ], *s;
 
@@ -108,12 +121,21 @@ void start_agent()
       exit(EXIT_FAILURE);
     }
     close(p[1]);
-    execl(AGENT_CMD, "q-agent", NULL);
-    perror("couldn't exec `q-agent'");
+    if (activated) {
+      execl(LAUNCH_CMD, "launch", LAUNCH_SOCKET, AGENT_CMD, NULL);
+      perror("couldn't exec `launch'");
+    } else if (threads) {
+      execl(AGENT_CMD, "q-agent", "--threads", threads, NULL);
+      perror("couldn't exec `q-agent'");
+    } else {
+      execl(AGENT_CMD, "q-agent", NULL);
+      perror("couldn't exec `q-agent'");
+    }
     exit(EXIT_FAILURE);
   }
   close(p[1]);
-  atexit(stop_agent);
+  if (!registered++)
+    atexit(stop_agent);
   if (read(p[0], buf, BUFSIZ) <= 0) {
     perror("couldn't read agent output");
     exit(EXIT_FAILURE);
@@ -128,6 +150,17 @@ void start_agent()
   }
 }
 
+/* write DATA to the file NAME */
+void write_file(char *name, char *data)
+{
+  FILE *f;
+
+  if (!(f = fopen(name, "w")) || fputs(data, f) < 0 || fclose(f) < 0) {
+    perror("couldn't write file");
+    exit(EXIT_FAILURE);
+  }
+}
+
 void client(char *args, char *in, char *out, int stat)
 {
   int status;
@@ -200,27 +233,162 @@ void client(char *args, char *in, char *out, int stat)
   printf("PASS\n");
 }
 
+/* send a GET for ID with TAG, and hang up halfway at once - whenever the
+   user has decided, the reply has to come, and then the end */
+void hangup_get(char *id, uint32_t tag)
+{
+  struct sockaddr_un addr;
+  struct {
+    header2 h;
+    request2_get get;
+    char id[STRING2_SIZE(ID_LENGTH)];
+  } req;
+  header2 *rep;
+  char buf[BUFSIZ];
+  size_t len = strlen(id), got = 0;
+  ssize_t n;
+  int s;
+
+  printf("Testing %-30s ... ", "tagged GET, then hangup");
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, getenv("AGENT_SOCKET"), sizeof(addr.sun_path) - 1);
+  if ((s = socket(PF_UNIX, SOCK_STREAM, 0)) < 0
+      || connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("couldn't connect to q-agent");
+    exit(EXIT_FAILURE);
+  }
+  memset(&req, 0, sizeof(req));
+  req.h.magic = REQUEST2_MAGIC;
+  req.h.type = REQ_GET;
+  req.h.length = sizeof(request2_get) + STRING2_SIZE(len);
+  req.h.tag = tag;
+  req.get.idlen = len;
+  memcpy(req.id, id, len);
+  if (write(s, &req, sizeof(header2) + req.h.length) < 0
+      || shutdown(s, SHUT_WR) < 0) {
+    perror("couldn't send request");
+    exit(EXIT_FAILURE);
+  }
+  while ((n = read(s, buf + got, sizeof(buf) - got)) > 0)
+    got += n;
+  close(s);
+  rep = (header2 *)buf;
+  if (got < sizeof(header2) || rep->magic != REPLY2_MAGIC || rep->tag != tag
+      || got != sizeof(header2) + rep->length) {
+    printf("FAIL: %lu bytes of reply\n", (unsigned long)got);
+    exit(EXIT_FAILURE);
+  }
+  printf("PASS\n");
+}
+
+/* store some eighty short secrets */
+void fill_up()
+{
+  client("put s/0; for i in $(seq 80); do echo s$i | "
+	 CLIENT_CMD "put s/$i || exit 1; done", "s0\n", NULL, 0);
+  client("get s/80", NULL, "s80\n", 0);
+}
+
 int main()
 {
   time_t deadline;
 
   unsetenv("DISPLAY");
   setenv("LANG", "C", 1);
-  start_agent();
+  start_agent(0, NULL);
   atexit(remove_files);
   client("list", NULL, "", 0);
   client("put 23 \"Joe Malik\"", "fnord\n", NULL, 0);
   client("list", NULL, "23\tnone                \t\tJoe Malik\n", 0);
   client("get 23", NULL, "fnord\n", 0);
   client("get foo", NULL, "", 2);
+  client("mget 23 foo 23", NULL, "fnord\n\nfnord\n", 2);
   client("-t 3 put 17 \"J. Random Hacker\"", "fubar\n", NULL, 0);
   deadline = time(NULL) + 3 + 1;
   client("get 17", NULL, "fubar\n", 0);
+  /* a hot restart keeps the secrets, and their deadlines */
+  if (kill(agent_pid, SIGUSR2) < 0) {
+    perror("couldn't signal q-agent");
+    exit(EXIT_FAILURE);
+  }
+  sleep(1);
+  client("get 23", NULL, "fnord\n", 0);
+  client("get 17", NULL, "fubar\n", 0);
   while (time(NULL) < deadline)
     sleep(deadline - time(NULL));
   client("get 17", NULL, "", 2);
   client("delete 23", NULL, NULL, 0);
   client("get 23", NULL, "", 2);
   client("delete 23", NULL, "", 0);
+  /* transactions apply all of their operations, or none */
+  client("txn put 5 five put 6 six", "s5\ns6\n", NULL, 0);
+  client("mget 5 6", NULL, "s5\ns6\n", 0);
+  client("txn delete 5 put 6 \"\" put "
+	 "0123456789012345678901234567890123456789012345678901234567890123456789"
+	 "0123456789012345678901234567890123456789 x", "t6\nbad\n", NULL, 2);
+  client("mget 5 6", NULL, "s5\ns6\n", 0);
+  client("txn delete 5 put 6 \"\"", "t6\n", NULL, 0);
+  client("mget 5 6", NULL, "\nt6\n", 2);
+  /* listing only some, in order */
+  client("txn put ns/b B put ns/a A put other O", "b\na\no\n", NULL, 0);
+  client("list 'ns/*'", NULL, "ns/a\tnone                \t\tA\n"
+	 "ns/b\tnone                \t\tB\n", 0);
+  client("-n 2 list", NULL, "6\tnone                \t\t\n"
+	 "ns/a\tnone                \t\tA\n", 0);
+  /* streamed secrets may contain anything, and can be read back whole */
+  write_file("stream.in", "line 1\nline 2\n");
+  client("-s put 9 streamed <stream.in", NULL, NULL, 0);
+  client("-s get 9", NULL, "line 1\nline 2\n", 0);
+  client("-z get 9", NULL, "line 1\nline 2\n", 0);
+  /* watchers are told what happens, but nothing secret */
+  client("-n 4 watch 'w/*' & sleep 1; "
+	 CLIENT_CMD "-s put w/a c <stream.in; "
+	 CLIENT_CMD "-s put other c <stream.in; "
+	 CLIENT_CMD "delete w/a; "
+	 CLIENT_CMD "-t 1 -s put w/b c <stream.in; wait $!", NULL,
+	 "put\tw/a\ndelete\tw/a\nput\tw/b\nexpire\tw/b\n", 0);
+  /* through rings in shared memory, if the agent offers them */
+  client("-m put r/1 ring", "r1\n", NULL, 0);
+  client("-m get r/1", NULL, "r1\n", 0);
+  client("-m mget r/1 foo", NULL, "r1\n\n", 2);
+  /* a secret that has not changed is not fetched again, and a PUT only
+     replaces the version it names */
+  client("-e none put v/1", "v1\n", NULL, 0);
+  client("-e none put v/1", "v2\n", NULL, 5);
+  client("-e \"$(" CLIENT_CMD "-v get v/1 2>&1 >/dev/null)\" get v/1", NULL,
+	 "", 4);
+  client("-e \"$(" CLIENT_CMD "-v get v/1 2>&1 >/dev/null)\" put v/1; "
+	 CLIENT_CMD "-e 1 delete v/1", "v3\n", NULL, 5);
+  client("get v/1", NULL, "v3\n", 0);
+  /* a touched secret lives on for as long as it is fetched */
+  client("-t 1 put t/1", "t1\n", NULL, 0);
+  client("-S -t 3 touch 't/*'", NULL, "", 0);
+  sleep(2);
+  client("get t/1", NULL, "t1\n", 0);
+  sleep(2);
+  client("get t/1", NULL, "t1\n", 0);
+  client("touch t/2", NULL, "", 2);
+  /* a short secret takes little of the secure memory - with threads too,
+     which take some of it, as may the shards they split the cache into */
+  fill_up();
+  stop_agent();
+  start_agent(0, "4");
+  fill_up();
+  /* a client may hang up while a GET waits for the user - who cannot be
+     asked here, so the GET is denied when that fails */
+  stop_agent();
+  setenv("DISPLAY", "nowhere:99", 1);
+  start_agent(0, NULL);
+  unsetenv("DISPLAY");
+  client("-i put i/1", "i1\n", NULL, 0);
+  hangup_get("i/1", 7);
+  client("list", NULL, "i/1\tnone                \tinsure\t\n", 0);
+  /* started by a supervisor, once a client shows up */
+  stop_agent();
+  start_agent(1, NULL);
+  client("put 42 \"on demand\"", "xyzzy\n", NULL, 0);
+  client("get 42", NULL, "xyzzy\n", 0);
+  client("list", NULL, "42\tnone                \t\ton demand\n", 0);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,93 @@
+/* Quintuple Agent socket activation stub
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* launch SOCKET COMMAND [ARG]...
+   Listen on the Unix socket SOCKET, and once the first client connects,
+   run COMMAND with the socket passed on, like a supervisor doing socket
+   activation would. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+#ifndef HAVE_SETENV
+#include "setenv.h"
+#endif
+
+#define LISTEN_FDS_START	3
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  struct pollfd pfd;
+  char pid[32];
+  int s;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: launch SOCKET COMMAND [ARG]...\n");
+    return EXIT_FAILURE;
+  }
+  if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, argv[1]);
+  unlink(argv[1]);
+  if ((s = socket(PF_UNIX, SOCK_STREAM, 0)) < 0
+      || bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(s, SOMAXCONN) < 0) {
+    perror("couldn't set up socket");
+    return EXIT_FAILURE;
+  }
+  /* clients can connect from now on */
+  printf("AGENT_SOCKET='%s'; export AGENT_SOCKET\n", argv[1]);
+  fflush(stdout);
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, -1) < 0)
+    if (errno != EINTR) {
+      perror("couldn't wait for a connection");
+      return EXIT_FAILURE;
+    }
+  if (s != LISTEN_FDS_START) {
+    if (dup2(s, LISTEN_FDS_START) < 0) {
+      perror("couldn't dup2");
+      return EXIT_FAILURE;
+    }
+    close(s);
+  }
+  /* COMMAND keeps our pid */
+  sprintf(pid, "%ld", (long)getpid());
+  setenv("LISTEN_PID", pid, 1);
+  setenv("LISTEN_FDS", "1", 1);
+  execvp(argv[2], argv + 2);
+  perror("couldn't exec command");
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,266 @@
+/* Quintuple Agent io_uring plumbing
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef USE_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+struct uring {
+  int fd;
+  /* the submission queue */
+  unsigned *sq_head, *sq_tail;
+  unsigned sq_mask, sq_entries;
+  unsigned tail;		/* entries up to here have been filled in */
+  struct io_uring_sqe *sqes;
+  /* the completion queue */
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *rings;			/* where both queues are mapped */
+  size_t rings_size, sqes_size;
+  /* the buffers to receive into */
+  struct io_uring_buf_ring *br;
+  size_t br_size;
+  unsigned short br_tail, br_mask;
+  char *bufs;
+  unsigned buf_size;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags, void *arg, size_t argsz)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		 arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+			     unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct uring *uring_new(unsigned entries)
+{
+  struct io_uring_params p;
+  struct uring *r;
+  char *sq, *cq;
+  unsigned *array, i;
+  size_t size;
+
+  if (!(r = calloc(1, sizeof(struct uring))))
+    return NULL;
+  memset(&p, 0, sizeof(p));
+  /* no need to interrupt the agent for work that can wait until it asks
+     for completions anyway */
+  p.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN;
+  if ((r->fd = io_uring_setup(entries, &p)) < 0) {
+    free(r);
+    return NULL;
+  }
+  /* waiting with a timeout needs EXT_ARG, and both queues in one mapping
+     keeps this simple */
+  if (!(p.features & IORING_FEAT_EXT_ARG)
+      || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(r->fd);
+    free(r);
+    errno = ENOSYS;
+    return NULL;
+  }
+  r->rings_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (r->rings_size < size)
+    r->rings_size = size;
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->rings == MAP_FAILED) {
+    close(r->fd);
+    free(r);
+    return NULL;
+  }
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    munmap(r->rings, r->rings_size);
+    close(r->fd);
+    free(r);
+    return NULL;
+  }
+  sq = cq = r->rings;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->tail = *r->sq_tail;
+  /* entries are always used in order */
+  array = (unsigned *)(sq + p.sq_off.array);
+  for (i = 0; i < p.sq_entries; i++)
+    array[i] = i;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return r;
+}
+
+void uring_free(struct uring *r)
+{
+  close(r->fd);
+  munmap(r->sqes, r->sqes_size);
+  munmap(r->rings, r->rings_size);
+  if (r->br)
+    munmap(r->br, r->br_size);
+  free(r);
+}
+
+/* hand the queued entries to the kernel, and wait for MIN_COMPLETE
+   completions, at most as long as ARG says */
+static int enter(struct uring *r, unsigned min_complete,
+		 struct io_uring_getevents_arg *arg)
+{
+  unsigned submit;
+
+  __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+  submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  return io_uring_enter(r->fd, submit, min_complete,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			arg, sizeof(*arg));
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+  struct io_uring_getevents_arg arg;
+  struct io_uring_sqe *sqe;
+
+  if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+      == r->sq_entries) {
+    memset(&arg, 0, sizeof(arg));
+    if (enter(r, 0, &arg) < 0 && errno != EINTR)
+      return NULL;
+    if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+	== r->sq_entries)
+      return NULL;
+  }
+  sqe = &r->sqes[r->tail++ & r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uring_wait(struct uring *r, int timeout)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+
+  memset(&arg, 0, sizeof(arg));
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    arg.ts = (uintptr_t)&ts;
+  }
+  if (enter(r, uring_peek(r) ? 0 : 1, &arg) < 0)
+    switch (errno) {
+    case ETIME:			/* timed out */
+    case EINTR:
+    case EAGAIN:		/* completions have to be reaped first */
+    case EBUSY:
+      return 0;
+    default:
+      return -1;
+    }
+  return 0;
+}
+
+struct io_uring_cqe *uring_peek(struct uring *r)
+{
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & r->cq_mask];
+}
+
+void uring_seen(struct uring *r)
+{
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_add_buffers(struct uring *r, unsigned short group, char *mem,
+		      unsigned count, unsigned size)
+{
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  /* the kernel wants the ring page aligned */
+  r->br_size = count * sizeof(struct io_uring_buf);
+  r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE,
+	       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (r->br == MAP_FAILED) {
+    r->br = NULL;
+    return -1;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)r->br;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(r->br, r->br_size);
+    r->br = NULL;
+    return -1;
+  }
+  r->br_tail = 0;
+  r->br_mask = count - 1;
+  r->bufs = mem;
+  r->buf_size = size;
+  for (i = 0; i < count; i++)
+    uring_recycle(r, i);
+  return 0;
+}
+
+char *uring_buffer(struct uring *r, unsigned short id)
+{
+  return r->bufs + (size_t)id * r->buf_size;
+}
+
+void uring_recycle(struct uring *r, unsigned short id)
+{
+  struct io_uring_buf *b = &r->br->bufs[r->br_tail & r->br_mask];
+
+  b->addr = (uintptr_t)uring_buffer(r, id);
+  b->len = r->buf_size;
+  b->bid = id;
+  __atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif /* USE_IO_URING */
@@ -0,0 +1,54 @@
+/* Quintuple Agent io_uring plumbing
+ * Copyright (C) 1999 Robert Bihlmeyer <robbe@orcus.priv.at>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+
+/* An io_uring, talked to with the bare system calls: a queue of operations
+   for the kernel to start, a queue of the ones that have completed, and a
+   ring of buffers the kernel receives into.  A ring may only be used by
+   one thread at a time. */
+struct uring;
+
+/* a ring with room for ENTRIES operations, or NULL if the kernel does not
+   have all that is needed */
+struct uring *uring_new(unsigned entries);
+void uring_free(struct uring *);
+
+/* a cleared entry for the next operation, submitted by uring_wait().
+   NULL if the queue is full, and could not be submitted to make room. */
+struct io_uring_sqe *uring_get_sqe(struct uring *);
+/* submit what has been queued, and wait at most TIMEOUT milliseconds
+   (forever if negative) for a completion.  Returns -1 on fatal errors. */
+int uring_wait(struct uring *, int timeout);
+/* the oldest completion not yet seen, or NULL */
+struct io_uring_cqe *uring_peek(struct uring *);
+void uring_seen(struct uring *);
+
+/* let operations with IOSQE_BUFFER_SELECT in buffer group GROUP receive
+   into the COUNT buffers of SIZE bytes at MEM.  COUNT must be a power of
+   2.  Returns -1 if that is not supported. */
+int uring_add_buffers(struct uring *, unsigned short group, char *mem,
+		      unsigned count, unsigned size);
+char *uring_buffer(struct uring *, unsigned short id);
+/* hand buffer ID back to the kernel, once its contents have been used */
+void uring_recycle(struct uring *, unsigned short id);
+
+#endif
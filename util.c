@@ -25,6 +25,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -33,6 +36,11 @@
 #include "i18n.h"
 #include "util.h"
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		1U
+#define MFD_ALLOW_SEALING	2U
+#endif
+
 #ifndef TEMP_FAILURE_RETRY
 #define TEMP_FAILURE_RETRY(expression) \
   (__extension__							      \
@@ -58,6 +66,22 @@ ssize_t xwrite(int fd, const void *data, size_t bytes)
   return written;
 }
 
+/* read BYTES into DATA from FD, until all is read or an error occurs.
+   Returns how much was read, which is less than BYTES only at EOF. */
+ssize_t xread(int fd, void *data, size_t bytes)
+{
+  char *ptr = data;
+  ssize_t n;
+  size_t done;
+
+  for (done = 0; done < bytes; done += n)
+    if ((n = TEMP_FAILURE_RETRY(read(fd, ptr + done, bytes - done))) < 0)
+      return -1;
+    else if (!n)
+      break;
+  return done;
+}
+
 extern int debug;
 
 int debugmsg(const char *fmt, ...)
@@ -81,7 +105,29 @@ void wipe(void *ptr, size_t n)
 {
   /* you may want to overwrite with several different bit patterns, depending
      on your belief system. */
-  memset(ptr, n, 0);
+  memset(ptr, 0, n);
+}
+
+/* whether ID starts with PATTERN, or, if GLOB, matches it as described in
+   glob(7) */
+int id_matches(const char *id, const char *pattern, int glob)
+{
+  if (glob)
+    return fnmatch(pattern, id, 0) == 0;
+  return strncmp(id, pattern, strlen(pattern)) == 0;
+}
+
+/* an anonymous file in memory called NAME, which may be sealed */
+int create_memfd(const char *name)
+{
+#if defined(HAVE_MEMFD_CREATE)
+  return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#elif defined(SYS_memfd_create)
+  return syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
 }
 
 /* initialize uid variables */
@@ -22,8 +22,13 @@
 #include <sys/types.h>
 
 ssize_t xwrite(int, const void *, size_t); /* write until finished */
+ssize_t xread(int, void *, size_t); /* read until finished */
 int debugmsg(const char *, ...); /* output a debug message if debugging==on */
 void wipe(void *, size_t);	/* wipe a block of memory */
+int id_matches(const char *id, const char *pattern, int glob);
+				/* whether a LIST with PATTERN takes ID */
+int create_memfd(const char *name); /* an anonymous file that may be
+				       sealed */
 void lower_privs();		/* lower privileges */
 void raise_privs();		/* raise privileges again */
 void drop_privs();		/* finally drop privileges */